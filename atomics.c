@@ -172,6 +172,10 @@ atomic_dec_64_nv(volatile uint64_t *p)
     return r;
 }
 
+/*
+ * The CAS functions return the value found, and callers take oldval to
+ * mean success, so they must not fail spuriously: they're strong CASes.
+ */
 void *
 atomic_cas_ptr(volatile void **p, void *oldval, void *newval)
 {
@@ -180,7 +184,7 @@ atomic_cas_ptr(volatile void **p, void *oldval, void *newval)
     ANNOTATE_HAPPENS_AFTER(*p);
 #ifdef HAVE___ATOMIC
     volatile void *expected = oldval;
-    (void) __atomic_compare_exchange_n(p, &expected, newval, 1, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    (void) __atomic_compare_exchange_n(p, &expected, newval, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
     r = (void *)(uintptr_t)/*drop volatile*/expected;
 #elif defined(HAVE___SYNC)
     r = (void *)(uintptr_t)__sync_val_compare_and_swap(p, oldval, newval);
@@ -213,7 +217,7 @@ atomic_cas_32(volatile uint32_t *p, uint32_t oldval, uint32_t newval)
     ANNOTATE_HAPPENS_AFTER(*p);
 #ifdef HAVE___ATOMIC
     uint32_t expected = oldval;
-    (void) __atomic_compare_exchange_n(p, &expected, newval, 1, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    (void) __atomic_compare_exchange_n(p, &expected, newval, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
     r = expected;
 #elif defined(HAVE___SYNC)
     r = __sync_val_compare_and_swap(p, oldval, newval);
@@ -244,7 +248,7 @@ atomic_cas_64(volatile uint64_t *p, uint64_t oldval, uint64_t newval)
     ANNOTATE_HAPPENS_AFTER(*p);
 #ifdef HAVE___ATOMIC
     uint64_t expected = oldval;
-    (void) __atomic_compare_exchange_n(p, &expected, newval, 1, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    (void) __atomic_compare_exchange_n(p, &expected, newval, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
     r = expected;
 #elif defined(HAVE___SYNC)
     r = __sync_val_compare_and_swap(p, oldval, newval);
@@ -427,3 +431,33 @@ atomic_write_64(volatile uint64_t *p, uint64_t v)
 #endif
     ANNOTATE_HAPPENS_BEFORE(*p);
 }
+
+void
+membar_consumer(void)
+{
+#ifdef HAVE___ATOMIC
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+#elif defined(HAVE___SYNC) || defined(HAVE_INTEL_INTRINSICS)
+    __sync_synchronize();
+#elif defined(WIN32)
+    MemoryBarrier();
+#elif defined(HAVE_PTHREAD)
+    (void) pthread_mutex_lock(&atomic_lock);
+    (void) pthread_mutex_unlock(&atomic_lock);
+#endif
+}
+
+void
+membar_producer(void)
+{
+#ifdef HAVE___ATOMIC
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+#elif defined(HAVE___SYNC) || defined(HAVE_INTEL_INTRINSICS)
+    __sync_synchronize();
+#elif defined(WIN32)
+    MemoryBarrier();
+#elif defined(HAVE_PTHREAD)
+    (void) pthread_mutex_lock(&atomic_lock);
+    (void) pthread_mutex_unlock(&atomic_lock);
+#endif
+}
@@ -54,4 +54,21 @@ void atomic_write_ptr(volatile void **, void *);
 void atomic_write_32(volatile uint32_t *, uint32_t);
 void atomic_write_64(volatile uint64_t *, uint64_t);
 
+/* Fences: loads before vs. loads after, stores before vs. stores after */
+void membar_consumer(void);
+void membar_producer(void);
+
+/*
+ * Compiler-only barrier: keeps the compiler from moving memory accesses
+ * across it, but emits no fence instruction.
+ */
+#if defined(__GNUC__) || defined(__clang__)
+#define compiler_barrier() __asm__ __volatile__("" ::: "memory")
+#elif defined(_MSC_VER)
+#include <intrin.h>
+#define compiler_barrier() _ReadWriteBarrier()
+#else
+#define compiler_barrier() membar_consumer()
+#endif
+
 #endif /* ATOMICS_H */
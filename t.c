@@ -39,7 +39,9 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -47,17 +49,50 @@
 #include <time.h>
 #include <unistd.h>
 #include "thread_safe_global.h"
+#include "tsv_impl.h"
 #include "atomics.h"
 
-#if !defined(USE_TSV_SLOT_PAIR_DESIGN) && !defined(USE_TSV_SUBSCRIPTION_SLOTS_DESIGN)
+#if !defined(USE_TSV_SLOT_PAIR_DESIGN) && \
+    !defined(USE_TSV_SUBSCRIPTION_SLOTS_DESIGN) && \
+    !defined(USE_TSV_QSBR_DESIGN) && \
+    !defined(USE_TSV_LEFT_RIGHT_DESIGN) && \
+    !defined(USE_TSV_HYBRID_DESIGN)
 #define USE_TSV_SLOT_PAIR_DESIGN
 #endif
 #ifdef USE_TSV_SLOT_PAIR_DESIGN
 #define TSV_TYPE "slotpair"
 #endif
 #ifdef USE_TSV_SUBSCRIPTION_SLOTS_DESIGN
+#ifdef USE_TSV_MEMBARRIER
+#define TSV_TYPE "slotlist (membarrier)"
+#else
 #define TSV_TYPE "slotlist"
 #endif
+#endif
+#ifdef USE_TSV_QSBR_DESIGN
+#define TSV_TYPE "qsbr"
+#endif
+#ifdef USE_TSV_LEFT_RIGHT_DESIGN
+#define TSV_TYPE "leftright"
+#endif
+#ifdef USE_TSV_HYBRID_DESIGN
+#define TSV_TYPE "hybrid"
+#endif
+
+/* Every design, for tests that pick one per var */
+static const struct {
+    const char              *name;
+    thread_safe_var_design  design;
+    uint32_t                flags;
+} test_designs[] = {
+    { "slotpair", THREAD_SAFE_VAR_DESIGN_SLOT_PAIR, 0 },
+    { "slotlist", THREAD_SAFE_VAR_DESIGN_SLOT_LIST, 0 },
+    { "slotlist (membarrier)", THREAD_SAFE_VAR_DESIGN_SLOT_LIST,
+      THREAD_SAFE_VAR_MEMBARRIER },
+    { "qsbr", THREAD_SAFE_VAR_DESIGN_QSBR, 0 },
+    { "leftright", THREAD_SAFE_VAR_DESIGN_LEFT_RIGHT, 0 },
+    { "hybrid", THREAD_SAFE_VAR_DESIGN_HYBRID, 0 },
+};
 
 /*
  * TODO:
@@ -108,6 +143,28 @@ static void *reader(void *data);
 static void *idle_reader(void *);
 static void *writer(void *data);
 static void dtor(void *);
+static int copy_value(void *, void *, void **);
+static void pod_test(void);
+static void set_if_test(void);
+static void update_test(void);
+static void wait_version_test(void);
+static void synchronize_test(void);
+static void defer_test(void);
+static void static_test(void);
+static void group_test(void);
+static void ref_test(void);
+static void changed_test(void);
+static void derived_test(void);
+static void get_many_test(void);
+static void generation_test(void);
+static void stale_test(void);
+static void async_test(void);
+static void timed_set_test(void);
+static void notify_test(void);
+static void budget_test(void);
+static void design_test(void);
+static void hybrid_test(void);
+static void numa_test(void);
 
 static pthread_t *readers;
 static pthread_t *writers;
@@ -227,6 +284,28 @@ main(int argc, char **argv)
         writerq = 20;
     nthreads = MY_NTHREADS;
 
+    pod_test();
+    set_if_test();
+    update_test();
+    wait_version_test();
+    synchronize_test();
+    defer_test();
+    static_test();
+    group_test();
+    ref_test();
+    changed_test();
+    derived_test();
+    get_many_test();
+    generation_test();
+    stale_test();
+    async_test();
+    timed_set_test();
+    notify_test();
+    budget_test();
+    design_test();
+    hybrid_test();
+    numa_test();
+
     printf("Testing the thread-safe variable implementation type \"%s\"\n",
            TSV_TYPE);
     printf("Will use %ju reader threads and %ju writer threads\n",
@@ -324,6 +403,7 @@ main(int argc, char **argv)
         }
         if (clock_gettime(CLOCK_MONOTONIC, &idle_end) != 0)
             err(1, "clock_gettime(CLOCK_MONOTONIC) failed");
+        thread_safe_var_quiescent();
         idle_run = timesub(idle_end, idle_start);
         usperrun = idle_run.tv_sec * 1000000 + idle_run.tv_nsec / 1000;
         usperrun /= IDLE_READ_RUNS;
@@ -508,6 +588,7 @@ reader(void *data)
             fflush(stdout);
             first = 0;
         }
+        thread_safe_var_quiescent();
         usleep(us);
     }
 
@@ -668,3 +749,1829 @@ dtor(void *data)
     *(uint64_t *)data = MAGIC_FREED;
     free(data);
 }
+
+/* Update function for thread_safe_var_update() */
+static int
+copy_value(void *arg, void *current, void **newp)
+{
+    uint64_t *p;
+
+    (void) arg;
+    if (current != NULL && *(uint64_t *)current != MAGIC_INITED)
+        err(1, "copy_value() was given a bad current value");
+    if ((p = malloc(sizeof(*p))) == NULL)
+        return errno;
+    *p = MAGIC_INITED;
+    *newp = p;
+    return 0;
+}
+
+/* A POD TSV value whose halves must always agree */
+struct pod {
+    uint64_t a;
+    uint64_t pad[6];
+    uint64_t b;     /* always ~a */
+};
+
+#define POD_READERS 4
+#define POD_WRITERS 2
+#define POD_WRITES  200000
+
+static thread_safe_pod_var pod_var;
+static volatile uint32_t pod_stop;
+
+static void *
+pod_reader(void *data)
+{
+    uint64_t version;
+    uint64_t last_version = 0;
+    uint64_t *nreads = data;
+    struct pod p;
+
+    while (atomic_read_32(&pod_stop) == 0) {
+        if ((errno = thread_safe_var_get_copy(pod_var, &p, &version)) != 0)
+            err(1, "thread_safe_var_get_copy() failed");
+        if (version < last_version)
+            errx(1, "POD version went backwards for this reader!");
+        if (p.b != ~p.a)
+            errx(1, "torn POD read!");
+        last_version = version;
+        (*nreads)++;
+    }
+    return NULL;
+}
+
+static void *
+pod_writer(void *data)
+{
+    uint64_t version;
+    uint64_t last_version = 0;
+    uint64_t i;
+    struct pod p;
+
+    memset(&p, 0, sizeof(p));
+    for (i = 0; i < POD_WRITES; i++) {
+        p.a = i + (uintptr_t)data;
+        p.b = ~p.a;
+        if ((errno = thread_safe_var_set_copy(pod_var, &p, &version)) != 0)
+            err(1, "thread_safe_var_set_copy() failed");
+        if (version <= last_version)
+            errx(1, "POD version went backwards for this writer!");
+        last_version = version;
+    }
+    return NULL;
+}
+
+/* Race POD TSV readers and writers, checking for torn reads */
+static void
+pod_test(void)
+{
+    pthread_t threads[POD_READERS + POD_WRITERS];
+    uint64_t nreads[POD_READERS];
+    uint64_t version;
+    uint64_t total = 0;
+    struct pod p;
+    size_t i;
+
+    if ((errno = thread_safe_var_init_pod(&pod_var, sizeof(p))) != 0)
+        err(1, "thread_safe_var_init_pod() failed");
+    memset(&p, 0, sizeof(p));
+    p.b = ~p.a;
+    if ((errno = thread_safe_var_set_copy(pod_var, &p, &version)) != 0)
+        err(1, "thread_safe_var_set_copy() failed");
+    assert(version == 1);
+
+    for (i = 0; i < POD_READERS; i++) {
+        nreads[i] = 0;
+        if ((errno = pthread_create(&threads[i], NULL, pod_reader,
+                                    &nreads[i])) != 0)
+            err(1, "Failed to create POD reader thread");
+    }
+    for (i = 0; i < POD_WRITERS; i++) {
+        if ((errno = pthread_create(&threads[POD_READERS + i], NULL,
+                                    pod_writer,
+                                    (void *)(uintptr_t)(i * POD_WRITES))) != 0)
+            err(1, "Failed to create POD writer thread");
+    }
+    for (i = 0; i < POD_WRITERS; i++)
+        (void) pthread_join(threads[POD_READERS + i], NULL);
+    atomic_write_32(&pod_stop, 1);
+    for (i = 0; i < POD_READERS; i++) {
+        (void) pthread_join(threads[i], NULL);
+        total += nreads[i];
+    }
+
+    if ((errno = thread_safe_var_get_copy(pod_var, &p, &version)) != 0)
+        err(1, "thread_safe_var_get_copy() failed");
+    if (version != 1 + POD_WRITERS * POD_WRITES)
+        errx(1, "POD TSV lost writes!");
+    thread_safe_var_destroy_pod(pod_var);
+    printf("POD TSV test: %ju reads, %ju writes, no torn reads\n",
+           (uintmax_t)total, (uintmax_t)(POD_WRITERS * POD_WRITES));
+}
+
+#define SET_IF_WRITERS  4
+#define SET_IF_WRITES   2000
+
+static thread_safe_var set_if_var;
+static volatile uint32_t nset_if_conflicts;
+
+/* Optimistic writers; on conflict they learn the current version */
+static void *
+set_if_writer(void *data)
+{
+    uint64_t last_version = 0;
+    uint64_t version;
+    void *p = NULL;
+    size_t i;
+
+    (void) data;
+    for (i = 0; i < SET_IF_WRITES; i++) {
+        if ((errno = copy_value(NULL, NULL, &p)) != 0)
+            err(1, "malloc() failed");
+        version = last_version;
+        while ((errno = thread_safe_var_set_if(set_if_var, version, p,
+                                               &version)) == EAGAIN) {
+            (void) atomic_inc_32_nv(&nset_if_conflicts);
+            if (version < last_version)
+                errx(1, "version went backwards on conflict");
+        }
+        if (errno != 0)
+            err(1, "thread_safe_var_set_if() failed");
+        if (version <= last_version)
+            errx(1, "thread_safe_var_set_if() version went backwards");
+        last_version = version;
+        if (i % 16 == 0)
+            sched_yield();
+    }
+    return NULL;
+}
+
+/* Conditional writes fail with EAGAIN unless the version is current */
+static void
+set_if_test(void)
+{
+    pthread_t writers[SET_IF_WRITERS];
+    uint64_t version, current;
+    void *p = NULL;
+    void *v;
+    size_t i;
+
+    if ((errno = thread_safe_var_init(&set_if_var, dtor)) != 0)
+        err(1, "thread_safe_var_init() failed");
+    if ((errno = copy_value(NULL, NULL, &p)) != 0)
+        err(1, "malloc() failed");
+    if ((errno = thread_safe_var_set_if(set_if_var, 0, p, &version)) != 0)
+        err(1, "thread_safe_var_set_if() failed on a new var");
+    if (version != 1)
+        errx(1, "thread_safe_var_set_if() set the wrong version");
+
+    /* A stale version fails, outputs the current one, and leaves p ours */
+    if ((errno = copy_value(NULL, NULL, &p)) != 0)
+        err(1, "malloc() failed");
+    if ((errno = thread_safe_var_set_if(set_if_var, 0, p,
+                                        &version)) != EAGAIN)
+        errx(1, "thread_safe_var_set_if() with a stale version did not "
+             "fail with EAGAIN");
+    if ((errno = thread_safe_var_get(set_if_var, &v, &current)) != 0)
+        err(1, "thread_safe_var_get() failed");
+    if (version != 1 || current != 1 || v == p)
+        errx(1, "thread_safe_var_set_if() with a stale version changed "
+             "the var or output the wrong version");
+    thread_safe_var_release(set_if_var);
+    if ((errno = thread_safe_var_set_if(set_if_var, version, p,
+                                        &version)) != 0)
+        err(1, "thread_safe_var_set_if() failed with the current version");
+    if (version != 2)
+        errx(1, "thread_safe_var_set_if() set the wrong version");
+
+    for (i = 0; i < SET_IF_WRITERS; i++) {
+        if ((errno = pthread_create(&writers[i], NULL, set_if_writer,
+                                    NULL)) != 0)
+            err(1, "Failed to create set_if writer thread");
+    }
+    for (i = 0; i < SET_IF_WRITERS; i++)
+        (void) pthread_join(writers[i], NULL);
+    if ((errno = thread_safe_var_get(set_if_var, &v, &current)) != 0)
+        err(1, "thread_safe_var_get() failed");
+    if (current != 2 + SET_IF_WRITERS * SET_IF_WRITES)
+        errx(1, "thread_safe_var_set_if() lost writes");
+    thread_safe_var_release(set_if_var);
+    thread_safe_var_quiescent();
+    thread_safe_var_destroy(set_if_var);
+    printf("Conditional write test: %u writes, %u conflicts\n",
+           2 + SET_IF_WRITERS * SET_IF_WRITES, nset_if_conflicts);
+}
+
+#define UPDATE_WRITERS  4
+#define UPDATE_WRITES   2000
+
+static thread_safe_var update_var;
+static volatile uint32_t nupdate_copies;
+static volatile uint32_t nupdate_freed;
+
+static void
+update_dtor(void *data)
+{
+    (void) atomic_inc_32_nv(&nupdate_freed);
+    dtor(data);
+}
+
+/* A counter: { MAGIC_INITED, count } */
+static int
+increment(void *arg, void *current, void **newp)
+{
+    uint64_t *p;
+
+    (void) arg;
+    if (current != NULL && *(uint64_t *)current != MAGIC_INITED)
+        errx(1, "thread_safe_var_update() gave us a bad current value");
+    if ((p = malloc(2 * sizeof(*p))) == NULL)
+        return errno;
+    (void) atomic_inc_32_nv(&nupdate_copies);
+    p[0] = MAGIC_INITED;
+    p[1] = current == NULL ? 1 : ((uint64_t *)current)[1] + 1;
+    *newp = p;
+    return 0;
+}
+
+static void *
+update_writer(void *data)
+{
+    size_t i;
+
+    (void) data;
+    for (i = 0; i < UPDATE_WRITES; i++) {
+        if ((errno = thread_safe_var_update(update_var, increment, NULL,
+                                            NULL)) != 0)
+            err(1, "thread_safe_var_update() failed");
+        thread_safe_var_quiescent();
+        if (i % 16 == 0)
+            sched_yield();
+    }
+    thread_safe_var_release(update_var);
+    return NULL;
+}
+
+/* Read the final count from a thread that exits before destroy */
+static void *
+update_check(void *data)
+{
+    uint64_t version;
+    void *v;
+
+    (void) data;
+    if ((errno = thread_safe_var_get(update_var, &v, &version)) != 0)
+        err(1, "thread_safe_var_get() failed");
+    if (v == NULL || ((uint64_t *)v)[1] != UPDATE_WRITERS * UPDATE_WRITES ||
+        version != UPDATE_WRITERS * UPDATE_WRITES)
+        errx(1, "thread_safe_var_update() lost updates");
+    thread_safe_var_release(update_var);
+    thread_safe_var_quiescent();
+    return NULL;
+}
+
+/* copy_value(), counting calls in *arg */
+static int
+count_copy(void *arg, void *current, void **newp)
+{
+    (*(uint32_t *)arg)++;
+    return copy_value(NULL, current, newp);
+}
+
+/*
+ * Concurrent read-copy-updates lose no increments, and the copies that
+ * lose races are destroyed
+ */
+static void
+update_test(void)
+{
+    pthread_t writers[UPDATE_WRITERS];
+    thread_safe_var_attr attr;
+    thread_safe_var var;
+    pthread_t checker;
+    uint32_t ncopies = 0;
+    uint64_t version;
+    size_t i;
+    void *p = NULL;
+
+    if ((errno = thread_safe_var_init(&update_var, update_dtor)) != 0)
+        err(1, "thread_safe_var_init() failed");
+    for (i = 0; i < UPDATE_WRITERS; i++) {
+        if ((errno = pthread_create(&writers[i], NULL, update_writer,
+                                    NULL)) != 0)
+            err(1, "Failed to create update writer thread");
+    }
+    for (i = 0; i < UPDATE_WRITERS; i++)
+        (void) pthread_join(writers[i], NULL);
+
+    if ((errno = pthread_create(&checker, NULL, update_check, NULL)) != 0)
+        err(1, "Failed to create update checker thread");
+    (void) pthread_join(checker, NULL);
+    thread_safe_var_destroy(update_var);
+    if (nupdate_freed != nupdate_copies)
+        errx(1, "thread_safe_var_update() leaked %u copies",
+             nupdate_copies - nupdate_freed);
+
+    /* Updates of a var with a staleness bound start from its current value */
+    (void) thread_safe_var_attr_init(&attr);
+    attr.design = THREAD_SAFE_VAR_DESIGN_SLOT_PAIR;
+    attr.max_stale_ns = 60000000000ULL;
+    if ((errno = thread_safe_var_init_attr(&var, dtor, &attr)) != 0)
+        err(1, "thread_safe_var_init_attr() failed");
+    for (i = 0; i < 2; i++) {
+        if ((errno = copy_value(NULL, NULL, &p)) != 0)
+            err(1, "malloc() failed");
+        if ((errno = thread_safe_var_set(var, p, NULL)) != 0)
+            err(1, "thread_safe_var_set() failed");
+        if (i == 0 &&
+            (errno = thread_safe_var_get(var, &p, &version)) != 0)
+            err(1, "thread_safe_var_get() failed");
+    }
+    if ((errno = thread_safe_var_update(var, count_copy, &ncopies,
+                                        &version)) != 0)
+        err(1, "thread_safe_var_update() failed");
+    if (version != 3 || ncopies != 1)
+        errx(1, "thread_safe_var_update() started from a stale value");
+    thread_safe_var_release(var);
+    thread_safe_var_destroy(var);
+
+    printf("Read-copy-update test: %u updates, %u copies\n",
+           UPDATE_WRITERS * UPDATE_WRITES, nupdate_copies);
+}
+
+#define WAIT_WRITES 2000
+
+static thread_safe_var wait_var;
+
+/* For thread_safe_var_defer() */
+static void
+count_call(void *arg)
+{
+    (*(uint32_t *)arg)++;
+}
+
+/* Waits for every new version until the last one */
+static void *
+version_watcher(void *data)
+{
+    uint64_t *nwakeups = data;
+    uint64_t version = 0;
+    void *p;
+
+    while (version < WAIT_WRITES) {
+        if ((errno = thread_safe_var_wait_version(wait_var, version + 1,
+                                                  NULL)) != 0)
+            err(1, "thread_safe_var_wait_version() failed");
+        if ((errno = thread_safe_var_get(wait_var, &p, &version)) != 0)
+            err(1, "thread_safe_var_get() failed");
+        (*nwakeups)++;
+    }
+    return NULL;
+}
+
+static void
+wait_version_test(void)
+{
+    struct timespec timeout;
+    uint64_t nwakeups = 0;
+    uint64_t version;
+    pthread_t watcher;
+    size_t i;
+
+    if ((errno = thread_safe_var_init(&wait_var, dtor)) != 0)
+        err(1, "thread_safe_var_init() failed");
+    if ((errno = pthread_create(&watcher, NULL, version_watcher,
+                                &nwakeups)) != 0)
+        err(1, "Failed to create version watcher thread");
+    for (i = 0; i < WAIT_WRITES; i++) {
+        if ((errno = thread_safe_var_set(wait_var, (void *)0x08UL,
+                                         &version)) != 0)
+            err(1, "thread_safe_var_set() failed");
+        if (i % 10 == 0)
+            usleep(100);
+    }
+    (void) pthread_join(watcher, NULL);
+
+    timeout.tv_sec = 0;
+    timeout.tv_nsec = 10000000;
+    if ((errno = thread_safe_var_wait_version(wait_var, version,
+                                              &timeout)) != 0)
+        err(1, "thread_safe_var_wait_version() failed for current version");
+    if (thread_safe_var_wait_version(wait_var, version + 1,
+                                     &timeout) != ETIMEDOUT)
+        errx(1, "thread_safe_var_wait_version() did not time out");
+    thread_safe_var_destroy(wait_var);
+    printf("Version wait test: %ju writes, %ju wakeups\n",
+           (uintmax_t)WAIT_WRITES, (uintmax_t)nwakeups);
+}
+
+static thread_safe_var sync_var;
+static volatile uint32_t sync_pinned;
+static volatile uint32_t sync_go;
+static volatile uint32_t sync_released;
+static volatile uint32_t sync_done;
+
+/* Holds the first value until told to let go */
+static void *
+sync_reader(void *data)
+{
+    void *p;
+
+    (void) data;
+    if ((errno = thread_safe_var_get(sync_var, &p, NULL)) != 0)
+        err(1, "thread_safe_var_get() failed");
+    if (p == NULL || *(uint64_t *)p != MAGIC_INITED)
+        errx(1, "bad value read");
+    atomic_write_32(&sync_pinned, 1);
+    while (!atomic_read_32(&sync_go))
+        usleep(1000);
+    usleep(50000);
+
+    /* Still ours until now */
+    if (*(uint64_t *)p != MAGIC_INITED)
+        errx(1, "value freed while a reader held it");
+    atomic_write_32(&sync_released, 1);
+    thread_safe_var_release(sync_var);
+    thread_safe_var_quiescent();
+
+    /* Stay alive so that only the release can have let the value go */
+    while (!atomic_read_32(&sync_done))
+        usleep(1000);
+    return NULL;
+}
+
+/* Synchronizers wait for readers that hold old values to release them */
+static void
+synchronize_test(void)
+{
+    struct timespec timeout;
+    uint64_t version;
+    pthread_t reader;
+    void *p = NULL;
+
+    timeout.tv_sec = 0;
+    timeout.tv_nsec = 10000000;
+    if ((errno = thread_safe_var_init(&sync_var, dtor)) != 0)
+        err(1, "thread_safe_var_init() failed");
+    if ((errno = copy_value(NULL, NULL, &p)) != 0)
+        err(1, "malloc() failed");
+    if ((errno = thread_safe_var_set(sync_var, p, NULL)) != 0)
+        err(1, "thread_safe_var_set() failed");
+
+    if ((errno = pthread_create(&reader, NULL, sync_reader, NULL)) != 0)
+        err(1, "Failed to create synchronize reader thread");
+    while (!atomic_read_32(&sync_pinned))
+        usleep(1000);
+    if ((errno = copy_value(NULL, NULL, &p)) != 0)
+        err(1, "malloc() failed");
+    if ((errno = thread_safe_var_set(sync_var, p, &version)) != 0)
+        err(1, "thread_safe_var_set() failed");
+
+    thread_safe_var_quiescent();
+    if (thread_safe_var_synchronize(sync_var, version,
+                                    &timeout) != ETIMEDOUT)
+        errx(1, "thread_safe_var_synchronize() did not wait for a reader");
+    atomic_write_32(&sync_go, 1);
+    if ((errno = thread_safe_var_synchronize(sync_var, version,
+                                             NULL)) != 0)
+        err(1, "thread_safe_var_synchronize() failed");
+    if (!atomic_read_32(&sync_released))
+        errx(1, "thread_safe_var_synchronize() returned before the "
+             "reader released its value");
+    atomic_write_32(&sync_done, 1);
+    (void) pthread_join(reader, NULL);
+
+    /* Our own reference doesn't hold us up: it's released first */
+    if ((errno = thread_safe_var_get(sync_var, &p, NULL)) != 0)
+        err(1, "thread_safe_var_get() failed");
+    if ((errno = copy_value(NULL, NULL, &p)) != 0)
+        err(1, "malloc() failed");
+    if ((errno = thread_safe_var_set(sync_var, p, &version)) != 0)
+        err(1, "thread_safe_var_set() failed");
+    thread_safe_var_quiescent();
+    if ((errno = thread_safe_var_synchronize(sync_var, version,
+                                             &timeout)) != 0)
+        err(1, "thread_safe_var_synchronize() waited for its caller");
+
+    thread_safe_var_destroy(sync_var);
+    printf("Synchronize test: design \"%s\"\n", TSV_TYPE);
+}
+
+/*
+ * Deferred calls run once their version is released, right away if it
+ * already was, or at destroy
+ */
+static void
+defer_test(void)
+{
+    struct timespec timeout;
+    thread_safe_var var;
+    uint64_t version;
+    uint32_t ncalls = 0;
+    void *p = NULL;
+
+    timeout.tv_sec = 1;
+    timeout.tv_nsec = 0;
+    if ((errno = thread_safe_var_init(&var, dtor)) != 0)
+        err(1, "thread_safe_var_init() failed");
+    if ((errno = copy_value(NULL, NULL, &p)) != 0)
+        err(1, "malloc() failed");
+    if ((errno = thread_safe_var_set(var, p, &version)) != 0)
+        err(1, "thread_safe_var_set() failed");
+
+    /* The current version, and a future one */
+    if ((errno = thread_safe_var_defer(var, version, count_call,
+                                       &ncalls)) != 0 ||
+        (errno = thread_safe_var_defer(var, version + 2, count_call,
+                                       &ncalls)) != 0)
+        err(1, "thread_safe_var_defer() failed");
+    if (ncalls != 0)
+        errx(1, "thread_safe_var_defer() callback ran early");
+    if ((errno = copy_value(NULL, NULL, &p)) != 0)
+        err(1, "malloc() failed");
+    if ((errno = thread_safe_var_set(var, p, &version)) != 0)
+        err(1, "thread_safe_var_set() failed");
+    thread_safe_var_quiescent();
+    if ((errno = thread_safe_var_synchronize(var, version,
+                                             &timeout)) != 0)
+        err(1, "thread_safe_var_synchronize() failed");
+    if (ncalls != 1)
+        errx(1, "thread_safe_var_defer() callback ran %u times", ncalls);
+
+    /* Version 1 is gone already */
+    if ((errno = thread_safe_var_defer(var, version - 1, count_call,
+                                       &ncalls)) != 0)
+        err(1, "thread_safe_var_defer() failed");
+    if (ncalls != 2)
+        errx(1, "thread_safe_var_defer() callback for a reclaimed version "
+             "did not run right away");
+
+    thread_safe_var_destroy(var);
+    if (ncalls != 3)
+        errx(1, "thread_safe_var_defer() callback not run at destroy");
+    printf("Deferred callback test: design \"%s\"\n", TSV_TYPE);
+}
+
+#define STATIC_WRITERS  4
+
+static struct thread_safe_var_s static_var = THREAD_SAFE_VAR_INITIALIZER(dtor);
+
+/* Races with other first writers to a statically-initialized var */
+static void *
+static_writer(void *data)
+{
+    uint64_t version;
+    void *p;
+
+    (void) data;
+    if ((errno = thread_safe_var_update(&static_var, copy_value, NULL,
+                                        &version)) != 0)
+        err(1, "thread_safe_var_update() failed on static var");
+    if ((errno = thread_safe_var_get(&static_var, &p, NULL)) != 0)
+        err(1, "thread_safe_var_get() failed on static var");
+    if (p == NULL || *(uint64_t *)p != MAGIC_INITED)
+        errx(1, "bad value read from static var");
+    thread_safe_var_release(&static_var);
+    return NULL;
+}
+
+static void
+static_test(void)
+{
+    pthread_t writers[STATIC_WRITERS];
+    uint64_t version;
+    size_t round;
+    size_t i;
+    void *p;
+
+    /* Destroying a static var returns it to its initial state */
+    for (round = 0; round < 2; round++) {
+        if ((errno = thread_safe_var_get(&static_var, &p, &version)) != 0)
+            err(1, "thread_safe_var_get() failed on static var");
+        if (p != NULL || version != 0)
+            errx(1, "static var has a value before its first write");
+        for (i = 0; i < STATIC_WRITERS; i++) {
+            if ((errno = pthread_create(&writers[i], NULL, static_writer,
+                                        NULL)) != 0)
+                err(1, "Failed to create static var writer thread");
+        }
+        for (i = 0; i < STATIC_WRITERS; i++)
+            (void) pthread_join(writers[i], NULL);
+        if ((errno = thread_safe_var_get(&static_var, &p, &version)) != 0)
+            err(1, "thread_safe_var_get() failed on static var");
+        if (version != STATIC_WRITERS)
+            errx(1, "static var lost writes");
+        thread_safe_var_release(&static_var);
+        thread_safe_var_destroy(&static_var);
+    }
+    printf("Static TSV test: %u writers, design \"%s\"\n",
+           STATIC_WRITERS, TSV_TYPE);
+}
+
+#define GROUP_READERS   4
+#define GROUP_WRITERS   2
+#define GROUP_WRITES    20000
+
+static thread_safe_var_group group;
+static volatile uint32_t group_stop;
+static uint64_t group_constant = MAGIC_INITED;
+
+static void
+group_dtor(void *data)
+{
+    if (data != &group_constant)
+        dtor(data);
+}
+
+/* Members 0 and 1 must always agree; member 2 never changes */
+static void *
+group_reader(void *data)
+{
+    uint64_t *nreads = data;
+    uint64_t last_version = 0;
+    uint64_t version;
+    void *values[3];
+
+    while (atomic_read_32(&group_stop) == 0) {
+        if ((errno = thread_safe_var_group_get(group, values,
+                                               &version)) != 0)
+            err(1, "thread_safe_var_group_get() failed");
+        if (version < last_version)
+            errx(1, "group version went backwards for this reader!");
+        if (version > 0 &&
+            (*(uint64_t *)values[1] != ~*(uint64_t *)values[0] ||
+             values[2] != &group_constant))
+            errx(1, "inconsistent group snapshot!");
+        last_version = version;
+        if (((*nreads)++ & 0xff) == 0) {
+            thread_safe_var_group_release(group);
+            thread_safe_var_quiescent();
+            sched_yield();  /* slot-list writers yield to readers */
+        }
+    }
+    thread_safe_var_group_release(group);
+    thread_safe_var_quiescent();
+    return NULL;
+}
+
+static void *
+group_writer(void *data)
+{
+    uint64_t i;
+    void *values[3];
+
+    (void) data;
+    values[2] = NULL;
+    for (i = 0; i < GROUP_WRITES; i++) {
+        if ((values[0] = malloc(sizeof(uint64_t))) == NULL ||
+            (values[1] = malloc(sizeof(uint64_t))) == NULL)
+            err(1, "malloc() failed");
+        *(uint64_t *)values[0] = i;
+        *(uint64_t *)values[1] = ~i;
+        if ((errno = thread_safe_var_group_set(group, values, NULL)) != 0)
+            err(1, "thread_safe_var_group_set() failed");
+    }
+    return NULL;
+}
+
+/* Race group readers and writers, checking for torn snapshots */
+static void
+group_test(void)
+{
+    thread_safe_var_dtor_f dtors[3];
+    pthread_t threads[GROUP_READERS + GROUP_WRITERS];
+    uint64_t nreads[GROUP_READERS];
+    uint64_t total = 0;
+    void *values[3];
+    size_t i;
+
+    dtors[0] = dtors[1] = dtors[2] = group_dtor;
+    if ((errno = thread_safe_var_group_init(&group, 3, dtors, NULL)) != 0)
+        err(1, "thread_safe_var_group_init() failed");
+    values[0] = values[1] = values[2] = NULL;
+    if ((errno = thread_safe_var_group_set(group, values, NULL)) != EINVAL)
+        errx(1, "thread_safe_var_group_set() with no values must fail");
+    values[2] = &group_constant;
+    if ((values[0] = malloc(sizeof(uint64_t))) == NULL ||
+        (values[1] = malloc(sizeof(uint64_t))) == NULL)
+        err(1, "malloc() failed");
+    *(uint64_t *)values[0] = 0;
+    *(uint64_t *)values[1] = ~(uint64_t)0;
+    if ((errno = thread_safe_var_group_set(group, values, NULL)) != 0)
+        err(1, "thread_safe_var_group_set() failed");
+
+    for (i = 0; i < GROUP_READERS; i++) {
+        nreads[i] = 0;
+        if ((errno = pthread_create(&threads[i], NULL, group_reader,
+                                    &nreads[i])) != 0)
+            err(1, "Failed to create group reader thread");
+    }
+    for (i = 0; i < GROUP_WRITERS; i++) {
+        if ((errno = pthread_create(&threads[GROUP_READERS + i], NULL,
+                                    group_writer, NULL)) != 0)
+            err(1, "Failed to create group writer thread");
+    }
+    for (i = 0; i < GROUP_WRITERS; i++)
+        (void) pthread_join(threads[GROUP_READERS + i], NULL);
+    atomic_write_32(&group_stop, 1);
+    for (i = 0; i < GROUP_READERS; i++) {
+        (void) pthread_join(threads[i], NULL);
+        total += nreads[i];
+    }
+    thread_safe_var_group_destroy(group);
+    printf("Group TSV test: %ju reads, %ju writes, no torn snapshots\n",
+           (uintmax_t)total, (uintmax_t)(GROUP_WRITERS * GROUP_WRITES));
+}
+
+#define REF_WRITES      2000
+
+static thread_safe_var ref_var;
+static volatile uint32_t ref_stop;
+
+/* Uses a reference acquired by another thread, then puts it */
+static void *
+ref_worker(void *data)
+{
+    thread_safe_var_ref *ref = data;
+    uint64_t nchecks = 0;
+
+    while (!atomic_read_32(&ref_stop)) {
+        if (*(uint64_t *)ref->value != MAGIC_INITED)
+            errx(1, "value of a reference freed while referenced");
+        if ((++nchecks & 0xff) == 0)
+            sched_yield();
+    }
+    thread_safe_var_ref_put(ref);
+    if (ref->value != NULL || ref->handle != NULL)
+        errx(1, "thread_safe_var_ref_put() did not clear the reference");
+    return NULL;
+}
+
+/* Hand references across threads and hold them across writes */
+static void
+ref_test(void)
+{
+    struct timespec timeout;
+    thread_safe_var_ref ref;
+    thread_safe_var_ref dup;
+    uint64_t version;
+    pthread_t worker;
+    size_t i;
+
+    if ((errno = thread_safe_var_init(&ref_var, dtor)) != 0)
+        err(1, "thread_safe_var_init() failed");
+    if ((errno = thread_safe_var_acquire(ref_var, &ref)) != 0)
+        err(1, "thread_safe_var_acquire() failed");
+    if (ref.value != NULL || ref.version != 0)
+        errx(1, "thread_safe_var_acquire() referenced a value before any");
+    thread_safe_var_ref_put(&ref);
+
+    if ((errno = thread_safe_var_update(ref_var, copy_value, NULL,
+                                        &version)) != 0)
+        err(1, "thread_safe_var_update() failed");
+    if ((errno = thread_safe_var_acquire(ref_var, &ref)) != 0)
+        err(1, "thread_safe_var_acquire() failed");
+    if (ref.value == NULL || ref.version != version)
+        errx(1, "thread_safe_var_acquire() referenced the wrong value");
+    thread_safe_var_ref_dup(&ref, &dup);
+    thread_safe_var_release(ref_var);
+
+    if ((errno = pthread_create(&worker, NULL, ref_worker, &ref)) != 0)
+        err(1, "Failed to create reference worker thread");
+    for (i = 0; i < REF_WRITES; i++) {
+        if ((errno = thread_safe_var_update(ref_var, copy_value, NULL,
+                                            &version)) != 0)
+            err(1, "thread_safe_var_update() failed");
+        thread_safe_var_quiescent();
+        if (i % 10 == 0)
+            sched_yield();
+    }
+    atomic_write_32(&ref_stop, 1);
+    (void) pthread_join(worker, NULL);
+
+    /* Our duplicate still holds the first value */
+    if (dup.version != 1 || *(uint64_t *)dup.value != MAGIC_INITED)
+        errx(1, "value of a duplicate reference freed while referenced");
+    thread_safe_var_ref_put(&dup);
+
+    /* Put references hold up neither synchronizers nor destroy */
+    timeout.tv_sec = 1;
+    timeout.tv_nsec = 0;
+    thread_safe_var_quiescent();
+    if ((errno = thread_safe_var_synchronize(ref_var, version,
+                                             &timeout)) != 0)
+        err(1, "thread_safe_var_synchronize() failed after puts");
+    thread_safe_var_destroy(ref_var);
+    printf("Reference test: %ju writes, design \"%s\"\n",
+           (uintmax_t)REF_WRITES, TSV_TYPE);
+}
+
+#define CHANGED_WRITES  2000
+
+static thread_safe_var changed_var;
+static volatile uint32_t changed_stop;
+
+/* Once a var has changed since a read, the next read is newer */
+static void *
+changed_reader(void *data)
+{
+    uint64_t version;
+    uint64_t newer;
+    void *p;
+
+    (void) data;
+    while (!atomic_read_32(&changed_stop)) {
+        if ((errno = thread_safe_var_get(changed_var, &p, &version)) != 0)
+            err(1, "thread_safe_var_get() failed");
+        if (!thread_safe_var_changed(changed_var, version))
+            continue;
+        if ((errno = thread_safe_var_get(changed_var, &p, &newer)) != 0)
+            err(1, "thread_safe_var_get() failed");
+        if (newer <= version)
+            errx(1, "thread_safe_var_changed() but no newer value");
+        thread_safe_var_quiescent();
+    }
+    thread_safe_var_release(changed_var);
+    return NULL;
+}
+
+static void
+changed_test(void)
+{
+    pthread_t reader;
+    uint64_t version;
+    size_t i;
+
+    if ((errno = thread_safe_var_init(&changed_var, dtor)) != 0)
+        err(1, "thread_safe_var_init() failed");
+    if (thread_safe_var_changed(changed_var, 0))
+        errx(1, "thread_safe_var_changed() before any write");
+    if ((errno = thread_safe_var_set(changed_var, (void *)0x08UL,
+                                     &version)) != 0)
+        err(1, "thread_safe_var_set() failed");
+    if (!thread_safe_var_changed(changed_var, 0) ||
+        thread_safe_var_changed(changed_var, version))
+        errx(1, "thread_safe_var_changed() is wrong after a write");
+
+    if ((errno = pthread_create(&reader, NULL, changed_reader,
+                                NULL)) != 0)
+        err(1, "Failed to create changed reader thread");
+    for (i = 0; i < CHANGED_WRITES; i++) {
+        if ((errno = thread_safe_var_set(changed_var, (void *)0x08UL,
+                                         &version)) != 0)
+            err(1, "thread_safe_var_set() failed");
+        if (thread_safe_var_changed(changed_var, version) ||
+            !thread_safe_var_changed(changed_var, version - 1))
+            errx(1, "thread_safe_var_changed() is wrong for a writer");
+        if (i % 10 == 0)
+            sched_yield();
+    }
+    atomic_write_32(&changed_stop, 1);
+    (void) pthread_join(reader, NULL);
+    thread_safe_var_destroy(changed_var);
+    printf("Change check test: %u writes, design \"%s\"\n",
+           CHANGED_WRITES, TSV_TYPE);
+}
+
+#define DERIVED_READERS 4
+#define DERIVED_WRITES  2000
+
+static thread_safe_var derived_var;
+static volatile uint32_t derived_stop;
+static volatile uint32_t nderived;
+static volatile uint32_t nderived_freed;
+static size_t derived_key;
+
+/* Derives a value's complement */
+static int
+derive_value(void *arg, void *value, void **resp)
+{
+    uint64_t *p;
+
+    (void) arg;
+    if (*(uint64_t *)value != MAGIC_INITED)
+        errx(1, "derivation given a bad value");
+    if ((p = malloc(sizeof(*p))) == NULL)
+        return errno;
+    *p = ~MAGIC_INITED;
+    *resp = p;
+    (void) atomic_inc_32_nv(&nderived);
+    return 0;
+}
+
+static void
+derived_dtor(void *data)
+{
+    (void) atomic_inc_32_nv(&nderived_freed);
+    *(uint64_t *)data = MAGIC_FREED;
+    free(data);
+}
+
+static void *
+derived_reader(void *data)
+{
+    uint64_t nreads = 0;
+    void *p;
+
+    (void) data;
+    while (!atomic_read_32(&derived_stop)) {
+        if ((errno = thread_safe_var_get_derived(derived_var, derived_key,
+                                                 &p, NULL)) != 0)
+            err(1, "thread_safe_var_get_derived() failed");
+        if (p != NULL && *(uint64_t *)p != ~MAGIC_INITED)
+            errx(1, "derived result freed while its value is referenced");
+        if ((++nreads & 0xff) == 0) {
+            thread_safe_var_quiescent();
+            sched_yield();
+        }
+    }
+    thread_safe_var_release(derived_var);
+    thread_safe_var_quiescent();
+    return NULL;
+}
+
+/* Derive once per version, not once per reader */
+static void
+derived_test(void)
+{
+    pthread_t readers[DERIVED_READERS];
+    uint64_t version;
+    size_t key;
+    size_t i;
+
+    if ((errno = thread_safe_var_init(&derived_var, dtor)) != 0)
+        err(1, "thread_safe_var_init() failed");
+    if ((errno = thread_safe_var_derive(derived_var, derive_value,
+                                        derived_dtor, NULL,
+                                        &derived_key)) != 0)
+        err(1, "thread_safe_var_derive() failed");
+    for (i = 0; i < DERIVED_READERS; i++) {
+        if ((errno = pthread_create(&readers[i], NULL, derived_reader,
+                                    NULL)) != 0)
+            err(1, "Failed to create derived value reader thread");
+    }
+    for (i = 0; i < DERIVED_WRITES; i++) {
+        if ((errno = thread_safe_var_update(derived_var, copy_value, NULL,
+                                            &version)) != 0)
+            err(1, "thread_safe_var_update() failed");
+        thread_safe_var_quiescent();
+        if (i % 10 == 0)
+            sched_yield();
+    }
+    if (thread_safe_var_derive(derived_var, derive_value, derived_dtor,
+                               NULL, &key) != EBUSY)
+        errx(1, "thread_safe_var_derive() allowed after a write");
+    atomic_write_32(&derived_stop, 1);
+    for (i = 0; i < DERIVED_READERS; i++)
+        (void) pthread_join(readers[i], NULL);
+    thread_safe_var_destroy(derived_var);
+
+    if (nderived > DERIVED_WRITES)
+        errx(1, "derived more than once per version");
+    if (nderived_freed != nderived)
+        errx(1, "derived results leaked");
+    printf("Derived value test: %u derivations for %u writes\n",
+           nderived, DERIVED_WRITES);
+}
+
+#define NMANY           (sizeof(test_designs) / sizeof(test_designs[0]))
+#define MANY_WRITES     500
+
+/* One var of each design, and one that's never written */
+static thread_safe_var many_vars[NMANY + 1];
+static volatile uint32_t many_stop;
+
+/* Writes { MAGIC_INITED, version } to every var of each design in turn */
+static void *
+many_writer(void *data)
+{
+    uint64_t version;
+    uint64_t *p;
+    size_t i, k;
+
+    (void) data;
+    for (k = 1; k <= MANY_WRITES; k++) {
+        for (i = 0; i < NMANY; i++) {
+            if ((p = malloc(2 * sizeof(*p))) == NULL)
+                err(1, "malloc() failed");
+            p[0] = MAGIC_INITED;
+            p[1] = k;
+            if ((errno = thread_safe_var_set(many_vars[i], p,
+                                             &version)) != 0)
+                err(1, "thread_safe_var_set() failed");
+            if (version != k)
+                errx(1, "thread_safe_var_set() set the wrong version");
+        }
+        if (k % 10 == 0)
+            sched_yield();
+    }
+    atomic_write_32(&many_stop, 1);
+    return NULL;
+}
+
+/*
+ * Batched reads of vars of every design, while they're written, output
+ * for each var a live value with its own version, never going backwards
+ */
+static void
+get_many_test(void)
+{
+    thread_safe_var_attr attr;
+    uint64_t last[NMANY + 1];
+    uint64_t versions[NMANY + 1];
+    void *values[NMANY + 1];
+    pthread_t writer;
+    size_t nreads = 0;
+    size_t i;
+    int stop;
+
+    for (i = 0; i <= NMANY; i++) {
+        (void) thread_safe_var_attr_init(&attr);
+        if (i < NMANY) {
+            attr.design = test_designs[i].design;
+            attr.flags = test_designs[i].flags;
+        }
+        if ((errno = thread_safe_var_init_attr(&many_vars[i], dtor,
+                                               &attr)) != 0)
+            err(1, "thread_safe_var_init_attr() failed");
+        last[i] = 0;
+    }
+    if ((errno = pthread_create(&writer, NULL, many_writer, NULL)) != 0)
+        err(1, "Failed to create get_many writer thread");
+
+    do {
+        stop = atomic_read_32(&many_stop);
+        if ((errno = thread_safe_var_get_many(many_vars, NMANY + 1, values,
+                                              versions)) != 0)
+            err(1, "thread_safe_var_get_many() failed");
+        for (i = 0; i <= NMANY; i++) {
+            if (versions[i] == 0 ? values[i] != NULL :
+                (values[i] == NULL ||
+                 ((uint64_t *)values[i])[0] != MAGIC_INITED ||
+                 ((uint64_t *)values[i])[1] != versions[i]))
+                errx(1, "thread_safe_var_get_many() output a bad value "
+                     "for the %s var", i < NMANY ? test_designs[i].name :
+                     "unwritten");
+            if (versions[i] < last[i])
+                errx(1, "thread_safe_var_get_many() went backwards");
+            last[i] = versions[i];
+        }
+        thread_safe_var_quiescent();
+        nreads++;
+    } while (!stop);
+    (void) pthread_join(writer, NULL);
+
+    /* After the writer's done, every var reads as last written */
+    for (i = 0; i < NMANY; i++) {
+        if (versions[i] != MANY_WRITES)
+            errx(1, "thread_safe_var_get_many() missed the last write");
+    }
+    if (values[NMANY] != NULL || versions[NMANY] != 0)
+        errx(1, "thread_safe_var_get_many() read an unwritten var");
+
+    for (i = 0; i <= NMANY; i++) {
+        thread_safe_var_release(many_vars[i]);
+        thread_safe_var_quiescent();
+        thread_safe_var_destroy(many_vars[i]);
+    }
+    printf("Batched read test: %ju batches of %ju vars\n",
+           (uintmax_t)nreads, (uintmax_t)(NMANY + 1));
+}
+
+#define GENERATION_WRITES   100
+
+/*
+ * The write generation is process-wide: writes to different vars, of
+ * different designs and kinds, all bump it, and nothing else does
+ */
+static void
+generation_test(void)
+{
+    thread_safe_var_attr attr;
+    thread_safe_pod_var pod;
+    thread_safe_var vars[2];
+    uint64_t generation, last;
+    uint64_t version;
+    uint64_t copy;
+    void *p;
+    size_t i;
+
+    for (i = 0; i < 2; i++) {
+        (void) thread_safe_var_attr_init(&attr);
+        attr.design = test_designs[i].design;
+        if ((errno = thread_safe_var_init_attr(&vars[i], dtor, &attr)) != 0)
+            err(1, "thread_safe_var_init_attr() failed");
+    }
+    if ((errno = thread_safe_var_init_pod(&pod, sizeof(copy))) != 0)
+        err(1, "thread_safe_var_init_pod() failed");
+
+    last = thread_safe_var_generation();
+    for (i = 0; i < GENERATION_WRITES; i++) {
+        if (i % 3 == 2) {
+            copy = i;
+            if ((errno = thread_safe_var_set_copy(pod, &copy, &version)) != 0)
+                err(1, "thread_safe_var_set_copy() failed");
+        } else if ((errno = thread_safe_var_set(vars[i % 3], (void *)0x08UL,
+                                                &version)) != 0) {
+            err(1, "thread_safe_var_set() failed");
+        }
+        if ((generation = thread_safe_var_generation()) <= last)
+            errx(1, "thread_safe_var_generation() not bumped by a write");
+        last = generation;
+    }
+
+    /* Reads and failed conditional writes leave it alone */
+    for (i = 0; i < 2; i++) {
+        if ((errno = thread_safe_var_get(vars[i], &p, &version)) != 0)
+            err(1, "thread_safe_var_get() failed");
+        if (thread_safe_var_set_if(vars[i], version - 1, (void *)0x08UL,
+                                   &version) != EAGAIN)
+            errx(1, "thread_safe_var_set_if() accepted a stale version");
+    }
+    if ((errno = thread_safe_var_get_copy(pod, &copy, &version)) != 0)
+        err(1, "thread_safe_var_get_copy() failed");
+    if (thread_safe_var_generation() != last)
+        errx(1, "thread_safe_var_generation() bumped without a write");
+
+    for (i = 0; i < 2; i++) {
+        thread_safe_var_release(vars[i]);
+        thread_safe_var_quiescent();
+        thread_safe_var_destroy(vars[i]);
+    }
+    thread_safe_var_destroy_pod(pod);
+    printf("Write generation test: %ju writes to 3 vars\n",
+           (uintmax_t)GENERATION_WRITES);
+}
+
+#define STALE_READS     4
+
+/* Reads a var with a staleness bound and checks the version read */
+static void
+stale_read(thread_safe_var var, uint64_t expected)
+{
+    uint64_t version;
+    void *p;
+
+    if ((errno = thread_safe_var_get(var, &p, &version)) != 0)
+        err(1, "thread_safe_var_get() failed");
+    if (version != expected)
+        errx(1, "staleness bound not honored (read version %ju, not %ju)",
+             (uintmax_t)version, (uintmax_t)expected);
+    if (p == NULL || *(uint64_t *)p != MAGIC_INITED)
+        errx(1, "bad value read from var with staleness bound");
+}
+
+static void
+stale_write(thread_safe_var var)
+{
+    void *p = NULL;
+
+    if ((errno = copy_value(NULL, NULL, &p)) != 0)
+        err(1, "malloc() failed");
+    if ((errno = thread_safe_var_set(var, p, NULL)) != 0)
+        err(1, "thread_safe_var_set() failed");
+}
+
+/*
+ * Readers of vars with staleness bounds refresh only when they expire,
+ * or when they release or lose a conditional write.  QSBR vars can't
+ * have one.
+ */
+static void
+stale_test(void)
+{
+    thread_safe_var_attr attr;
+    thread_safe_var var;
+    uint64_t version;
+    size_t ndesigns = 0;
+    size_t i, k;
+    void *p = NULL;
+
+    for (k = 0; k < sizeof(test_designs) / sizeof(test_designs[0]); k++) {
+        (void) thread_safe_var_attr_init(&attr);
+        attr.design = test_designs[k].design;
+        attr.flags = test_designs[k].flags;
+        attr.max_stale_reads = STALE_READS;
+        attr.max_stale_ns = 60000000000ULL;
+        if (attr.design == THREAD_SAFE_VAR_DESIGN_QSBR) {
+            if (thread_safe_var_init_attr(&var, dtor, &attr) != EINVAL)
+                errx(1, "QSBR var accepted a staleness bound");
+            attr.max_stale_ns = 0;
+            if (thread_safe_var_init_attr(&var, dtor, &attr) != EINVAL)
+                errx(1, "QSBR var accepted a staleness bound");
+            attr.flags |= THREAD_SAFE_VAR_NUMA_REPLICAS;
+            if (thread_safe_var_init_attr(&var, dtor, &attr) != EINVAL)
+                errx(1, "NUMA var of QSBR replicas accepted a staleness "
+                     "bound");
+            continue;
+        }
+        if ((errno = thread_safe_var_init_attr(&var, dtor, &attr)) != 0)
+            err(1, "thread_safe_var_init_attr() failed for %s var",
+                test_designs[k].name);
+        stale_write(var);
+        stale_read(var, 1);
+
+        /* Stale for STALE_READS reads, then current */
+        stale_write(var);
+        for (i = 0; i < STALE_READS; i++)
+            stale_read(var, 1);
+        stale_read(var, 2);
+
+        /* Releasing ends the bound early */
+        stale_write(var);
+        stale_read(var, 2);
+        thread_safe_var_release(var);
+        thread_safe_var_quiescent();
+        stale_read(var, 3);
+
+        /* So does losing a conditional write */
+        stale_write(var);
+        stale_read(var, 3);
+        if ((errno = copy_value(NULL, NULL, &p)) != 0)
+            err(1, "malloc() failed");
+        if (thread_safe_var_set_if(var, 3, p, &version) != EAGAIN ||
+            version != 4)
+            errx(1, "thread_safe_var_set_if() did not fail on a stale "
+                 "version");
+        dtor(p);
+        stale_read(var, 4);
+
+        thread_safe_var_release(var);
+        thread_safe_var_quiescent();
+        thread_safe_var_destroy(var);
+        ndesigns++;
+    }
+
+    /* Nor can vars of the QSBR build's default design */
+    (void) thread_safe_var_attr_init(&attr);
+    attr.max_stale_reads = STALE_READS;
+    if ((errno = thread_safe_var_init_attr(&var, dtor, &attr)) !=
+        (strcmp(TSV_TYPE, "qsbr") == 0 ? EINVAL : 0))
+        err(1, "thread_safe_var_init_attr() of a default design var "
+            "with a staleness bound returned the wrong result");
+    if (errno == 0)
+        thread_safe_var_destroy(var);
+    printf("Staleness bound test: %ju designs\n", (uintmax_t)ndesigns);
+}
+
+#define ASYNC_WRITERS   4
+#define ASYNC_WRITES    20000
+
+static thread_safe_var async_var;
+static volatile uint32_t nasync_freed;
+
+static void
+async_dtor(void *data)
+{
+    (void) atomic_inc_32_nv(&nasync_freed);
+    dtor(data);
+}
+
+/* Sets { MAGIC_INITED, n } for n = 1..ASYNC_WRITES */
+static void *
+async_writer(void *data)
+{
+    uint64_t *p = NULL;
+    size_t i;
+
+    (void) data;
+    for (i = 0; i < ASYNC_WRITES; i++) {
+        if ((p = malloc(2 * sizeof(*p))) == NULL)
+            err(1, "malloc() failed");
+        p[0] = MAGIC_INITED;
+        p[1] = i + 1;
+        if ((errno = thread_safe_var_set_async(async_var, p)) != 0)
+            err(1, "thread_safe_var_set_async() failed");
+    }
+    return NULL;
+}
+
+/*
+ * The last value submitted was some writer's last, and it must be the
+ * one that stuck.  (Read here, in a thread that exits before the var is
+ * destroyed: slot-list vars read by live threads aren't freed until
+ * those threads exit.)
+ */
+static void *
+async_check(void *data)
+{
+    uint64_t *p;
+
+    (void) data;
+    if ((errno = thread_safe_var_get(async_var, (void **)&p, NULL)) != 0)
+        err(1, "thread_safe_var_get() failed");
+    if (p == NULL || p[0] != MAGIC_INITED)
+        errx(1, "thread_safe_var_set_async() published a bad value");
+    if (p[1] != ASYNC_WRITES)
+        errx(1, "thread_safe_var_set_async() lost the latest value");
+    thread_safe_var_release(async_var);
+    return NULL;
+}
+
+/* Latest-wins writers publish some values and destroy the rest */
+static void
+async_test(void)
+{
+    pthread_t writers[ASYNC_WRITERS];
+    pthread_t checker;
+    size_t i;
+
+    if ((errno = thread_safe_var_init(&async_var, async_dtor)) != 0)
+        err(1, "thread_safe_var_init() failed");
+    for (i = 0; i < ASYNC_WRITERS; i++) {
+        if ((errno = pthread_create(&writers[i], NULL, async_writer,
+                                    NULL)) != 0)
+            err(1, "Failed to create async writer thread");
+    }
+    for (i = 0; i < ASYNC_WRITERS; i++)
+        (void) pthread_join(writers[i], NULL);
+
+    /* Every value was published or destroyed by now, the latest last */
+    if ((errno = pthread_create(&checker, NULL, async_check, NULL)) != 0)
+        err(1, "Failed to create async check thread");
+    (void) pthread_join(checker, NULL);
+    thread_safe_var_destroy(async_var);
+    if (nasync_freed != ASYNC_WRITERS * ASYNC_WRITES)
+        errx(1, "thread_safe_var_set_async() leaked values");
+    printf("Async write test: %u values set, none leaked\n",
+           ASYNC_WRITERS * ASYNC_WRITES);
+}
+
+/* Bounded writes give up on a busy var and leave it alone */
+static void
+timed_set_test(void)
+{
+    struct timespec timeout = { 0, 10000000 };
+    thread_safe_var var;
+    uint64_t version;
+    void *p;
+
+    if ((errno = thread_safe_var_init(&var, dtor)) != 0)
+        err(1, "thread_safe_var_init() failed");
+    if ((errno = copy_value(NULL, NULL, &p)) != 0)
+        err(1, "malloc() failed");
+
+    /* Stand in for a writer stuck mid-write */
+    if ((errno = pthread_mutex_lock(&var->write_lock)) != 0)
+        err(1, "pthread_mutex_lock() failed");
+    if ((errno = thread_safe_var_try_set(var, p, &version)) != EBUSY)
+        errx(1, "thread_safe_var_try_set() did not fail with EBUSY");
+    if ((errno = thread_safe_var_timed_set(var, p, &timeout,
+                                           &version)) != ETIMEDOUT)
+        errx(1, "thread_safe_var_timed_set() did not time out");
+    if (thread_safe_var_changed(var, 0))
+        errx(1, "A timed out write changed the var");
+    (void) pthread_mutex_unlock(&var->write_lock);
+
+    /* The value is still ours; uncontended, neither waits */
+    if ((errno = thread_safe_var_try_set(var, p, &version)) != 0)
+        err(1, "thread_safe_var_try_set() failed");
+    if (version != 1)
+        errx(1, "thread_safe_var_try_set() set the wrong version");
+    if ((errno = copy_value(NULL, NULL, &p)) != 0)
+        err(1, "malloc() failed");
+    if ((errno = thread_safe_var_timed_set(var, p, &timeout,
+                                           &version)) != 0)
+        err(1, "thread_safe_var_timed_set() failed");
+    if (version != 2)
+        errx(1, "thread_safe_var_timed_set() set the wrong version");
+
+    thread_safe_var_destroy(var);
+    printf("Timed write test: design \"%s\"\n", TSV_TYPE);
+}
+
+#define NOTIFY_WRITES   100
+
+static int
+fd_readable(int fd)
+{
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, 0) == -1)
+        err(1, "poll() failed");
+    return (pfd.revents & POLLIN) != 0;
+}
+
+/* The notification fd is readable after writes until acknowledged */
+static void
+notify_test(void)
+{
+    thread_safe_var var;
+    size_t i;
+    void *p;
+    int fd, fd2;
+
+    if ((errno = thread_safe_var_init(&var, dtor)) != 0)
+        err(1, "thread_safe_var_init() failed");
+    if ((errno = thread_safe_var_notify_fd(var, &fd)) != 0)
+        err(1, "thread_safe_var_notify_fd() failed");
+    if ((errno = thread_safe_var_notify_fd(var, &fd2)) != 0 || fd2 != fd)
+        errx(1, "thread_safe_var_notify_fd() returned a different fd");
+    if (fd_readable(fd))
+        errx(1, "Notification fd readable before any write");
+
+    for (i = 0; i < NOTIFY_WRITES; i++) {
+        if ((errno = copy_value(NULL, NULL, &p)) != 0)
+            err(1, "malloc() failed");
+        if ((errno = thread_safe_var_set(var, p, NULL)) != 0)
+            err(1, "thread_safe_var_set() failed");
+        if (!fd_readable(fd))
+            errx(1, "Notification fd not readable after a write");
+    }
+    thread_safe_var_notify_ack(var);
+    if (fd_readable(fd))
+        errx(1, "Notification fd readable after ack");
+
+    if ((errno = copy_value(NULL, NULL, &p)) != 0)
+        err(1, "malloc() failed");
+    if ((errno = thread_safe_var_set(var, p, NULL)) != 0)
+        err(1, "thread_safe_var_set() failed");
+    if (!fd_readable(fd))
+        errx(1, "Notification fd not readable after ack and write");
+
+    thread_safe_var_destroy(var);
+    printf("Notification fd test: %u writes, design \"%s\"\n",
+           NOTIFY_WRITES + 1, TSV_TYPE);
+}
+
+#define BUDGET_VALUE    40
+#define BUDGET_MAX      100     /* two values, not three */
+
+static volatile uint32_t nover_budget;
+
+static void
+over_budget(void *arg)
+{
+    (void) arg;
+    (void) atomic_inc_32_nv(&nover_budget);
+}
+
+static thread_safe_var
+budget_var(thread_safe_var_budget_policy policy)
+{
+    thread_safe_var_attr attr;
+    thread_safe_var var;
+
+    (void) thread_safe_var_attr_init(&attr);
+    attr.max_retained_bytes = BUDGET_MAX;
+    attr.budget_policy = policy;
+    attr.over_budget = over_budget;
+    if ((errno = thread_safe_var_init_attr(&var, dtor, &attr)) != 0)
+        err(1, "thread_safe_var_init_attr() failed");
+    return var;
+}
+
+static int
+budget_write(thread_safe_var var, uint64_t *version)
+{
+    void *p = NULL;
+    int ret;
+
+    if ((errno = copy_value(NULL, NULL, &p)) != 0)
+        err(1, "malloc() failed");
+    if ((ret = thread_safe_var_set_sized(var, p, BUDGET_VALUE,
+                                         version)) != 0)
+        dtor(p);
+    return ret;
+}
+
+/* Write one value and pin it, then write another */
+static void
+budget_pin(thread_safe_var var, thread_safe_var_ref *ref)
+{
+    if ((errno = budget_write(var, NULL)) != 0)
+        err(1, "thread_safe_var_set_sized() failed");
+    if ((errno = thread_safe_var_acquire(var, ref)) != 0)
+        err(1, "thread_safe_var_acquire() failed");
+    thread_safe_var_release(var);
+    thread_safe_var_quiescent();
+    if ((errno = budget_write(var, NULL)) != 0)
+        err(1, "thread_safe_var_set_sized() failed");
+}
+
+static void *
+budget_writer(void *data)
+{
+    if ((errno = budget_write(data, NULL)) != 0)
+        err(1, "thread_safe_var_set_sized() failed");
+    return NULL;
+}
+
+/* Writes over budget with old values pinned fail, notify, or block */
+static void
+budget_test(void)
+{
+    thread_safe_var_ref ref;
+    thread_safe_var var;
+    uint64_t version;
+    pthread_t writer;
+
+    var = budget_var(THREAD_SAFE_VAR_BUDGET_FAIL);
+    budget_pin(var, &ref);
+    if ((errno = budget_write(var, &version)) != ENOMEM)
+        errx(1, "Write over budget did not fail with ENOMEM");
+    thread_safe_var_ref_put(&ref);
+    thread_safe_var_quiescent();
+    if ((errno = budget_write(var, &version)) != 0 || version != 3)
+        errx(1, "Write within budget failed");
+    thread_safe_var_destroy(var);
+
+    var = budget_var(THREAD_SAFE_VAR_BUDGET_NOTIFY);
+    budget_pin(var, &ref);
+    if ((errno = budget_write(var, &version)) != 0 || version != 3)
+        errx(1, "Write over budget with notification failed");
+    if (nover_budget != 1)
+        errx(1, "Write over budget did not notify");
+    thread_safe_var_ref_put(&ref);
+    thread_safe_var_quiescent();
+    thread_safe_var_destroy(var);
+
+    var = budget_var(THREAD_SAFE_VAR_BUDGET_BLOCK);
+    budget_pin(var, &ref);
+    if ((errno = pthread_create(&writer, NULL, budget_writer, var)) != 0)
+        err(1, "Failed to create budget writer thread");
+    usleep(100000);
+    if (thread_safe_var_changed(var, 2))
+        errx(1, "Write over budget did not wait for readers");
+    thread_safe_var_ref_put(&ref);
+    thread_safe_var_quiescent();
+    (void) pthread_join(writer, NULL);
+    if (!thread_safe_var_changed(var, 2))
+        errx(1, "Write over budget not done after readers released");
+    thread_safe_var_destroy(var);
+    printf("Retained bytes budget test: design \"%s\"\n", TSV_TYPE);
+}
+
+/* Every design can be picked per var, whatever the build's default */
+static void
+design_test(void)
+{
+    thread_safe_var_attr attr;
+    thread_safe_var var;
+    uint64_t version;
+    size_t i;
+    void *p = NULL;
+    void *v;
+
+    for (i = 0; i < sizeof(test_designs) / sizeof(test_designs[0]); i++) {
+        (void) thread_safe_var_attr_init(&attr);
+        attr.design = test_designs[i].design;
+        attr.flags = test_designs[i].flags;
+        if ((errno = thread_safe_var_init_attr(&var, dtor, &attr)) != 0)
+            err(1, "thread_safe_var_init_attr() failed for %s",
+                test_designs[i].name);
+        if ((errno = copy_value(NULL, NULL, &p)) != 0)
+            err(1, "malloc() failed");
+        if ((errno = thread_safe_var_set(var, p, &version)) != 0)
+            err(1, "thread_safe_var_set() failed for %s",
+                test_designs[i].name);
+        if ((errno = thread_safe_var_get(var, &v, &version)) != 0)
+            err(1, "thread_safe_var_get() failed for %s",
+                test_designs[i].name);
+        if (v != p || version != 1 || *(uint64_t *)v != MAGIC_INITED)
+            errx(1, "%s var read the wrong value", test_designs[i].name);
+        thread_safe_var_release(var);
+        thread_safe_var_quiescent();
+        thread_safe_var_destroy(var);
+    }
+    printf("Design selection test: %ju designs\n", (uintmax_t)i);
+}
+
+#define HYBRID_READERS  16
+#define HYBRID_ROUNDS   4
+#define HYBRID_WRITES   20      /* per phase; enough to switch */
+#define HYBRID_SLOW_NS  1000000000ULL   /* writes a second apart */
+#define HYBRID_FAST_NS  1ULL            /* back-to-back writes */
+
+static thread_safe_var hybrid_var;
+static volatile uint32_t hybrid_stop;
+static volatile uint32_t nhybrid_started;
+static volatile uint32_t nhybrid_freed;
+
+static void
+hybrid_dtor(void *data)
+{
+    (void) atomic_inc_32_nv(&nhybrid_freed);
+    dtor(data);
+}
+
+static void *
+hybrid_reader(void *data)
+{
+    uint64_t last_version = 0;
+    uint64_t version;
+    size_t n = 0;
+    void *v;
+
+    (void) data;
+    while (!atomic_read_32(&hybrid_stop)) {
+        if ((errno = thread_safe_var_get(hybrid_var, &v, &version)) != 0)
+            err(1, "thread_safe_var_get() failed");
+        if (n++ == 0)
+            (void) atomic_inc_32_nv(&nhybrid_started);
+        if (v != NULL && *(uint64_t *)v != MAGIC_INITED)
+            errx(1, "hybrid var read a freed value");
+        if (version < last_version)
+            errx(1, "hybrid var version went backwards");
+        last_version = version;
+        if (n % 8 == 0)
+            thread_safe_var_release(hybrid_var);
+        sched_yield();
+    }
+    return NULL;
+}
+
+/* Write HYBRID_WRITES values as if ns apart, then check the design */
+static void
+hybrid_phase(uint64_t ns, thread_safe_var_design expected,
+             const char *name)
+{
+    void *p = NULL;
+    size_t i;
+
+    tsv_hybrid_fake_interval(hybrid_var, ns);
+    for (i = 0; i < HYBRID_WRITES; i++) {
+        if ((errno = copy_value(NULL, NULL, &p)) != 0)
+            err(1, "malloc() failed");
+        if ((errno = thread_safe_var_set(hybrid_var, p, NULL)) != 0)
+            err(1, "thread_safe_var_set() failed");
+        sched_yield(); /* let readers race with the switch */
+    }
+    if (tsv_hybrid_active(hybrid_var) != expected)
+        errx(1, "hybrid var did not switch to %s", name);
+}
+
+/*
+ * Hybrid vars switch to slot-list when writes are rare relative to the
+ * number of readers, and back to slot-pair when they're frequent.
+ * Readers racing with the switches must see only live values, in
+ * order, and every value must be destroyed exactly once.  The test
+ * fakes the interval between writes, so the switches don't depend on
+ * how fast this machine is.
+ */
+static void
+hybrid_test(void)
+{
+    pthread_t readers[HYBRID_READERS];
+    thread_safe_var_attr attr;
+    uint32_t nwrites;
+    size_t i;
+
+    (void) thread_safe_var_attr_init(&attr);
+    attr.design = THREAD_SAFE_VAR_DESIGN_HYBRID;
+    if ((errno = thread_safe_var_init_attr(&hybrid_var, hybrid_dtor,
+                                           &attr)) != 0)
+        err(1, "thread_safe_var_init_attr() failed");
+    for (i = 0; i < HYBRID_READERS; i++) {
+        if ((errno = pthread_create(&readers[i], NULL, hybrid_reader,
+                                    NULL)) != 0)
+            err(1, "Failed to create hybrid reader thread");
+    }
+    while (atomic_read_32(&nhybrid_started) < HYBRID_READERS)
+        usleep(1000);
+
+    for (i = 0; i < HYBRID_ROUNDS; i++) {
+        /* Rare writes: slot-list's O(readers) writes are cheap enough */
+        hybrid_phase(HYBRID_SLOW_NS, THREAD_SAFE_VAR_DESIGN_SLOT_LIST,
+                     "slot-list");
+        /* Back-to-back writes: slot-pair's O(1) writes win */
+        hybrid_phase(HYBRID_FAST_NS, THREAD_SAFE_VAR_DESIGN_SLOT_PAIR,
+                     "slot-pair");
+    }
+    nwrites = HYBRID_ROUNDS * 2 * HYBRID_WRITES;
+
+    atomic_write_32(&hybrid_stop, 1);
+    for (i = 0; i < HYBRID_READERS; i++)
+        (void) pthread_join(readers[i], NULL);
+    thread_safe_var_destroy(hybrid_var);
+    if (nhybrid_freed != nwrites)
+        errx(1, "hybrid var destroyed %u of %u values", nhybrid_freed,
+             nwrites);
+    printf("Hybrid switch test: %u writes, %u switches, none leaked\n",
+           nwrites, HYBRID_ROUNDS * 2);
+}
+
+#define NUMA_WRITES     1000
+
+static thread_safe_var numa_var;
+static volatile uint32_t numa_stop;
+static volatile uint32_t nnuma_freed;
+static volatile uint32_t nnuma_clones;
+
+static void
+numa_dtor(void *data)
+{
+    if (*(uint64_t *)data != MAGIC_INITED)
+        errx(1, "NUMA var value destroyed twice");
+    (void) atomic_inc_32_nv(&nnuma_freed);
+    dtor(data);
+}
+
+/* Clone callback: copies a value for another node */
+static void *
+numa_clone(void *data, int node)
+{
+    void *p = NULL;
+
+    if (*(uint64_t *)data != MAGIC_INITED)
+        errx(1, "NUMA var cloned a bad value");
+    if (node < 0 || node >= tsv_numa_nodes())
+        errx(1, "NUMA var cloned a value for a bad node (%d)", node);
+    if (copy_value(NULL, NULL, &p) != 0)
+        return NULL; /* share it */
+    (void) atomic_inc_32_nv(&nnuma_clones);
+    return p;
+}
+
+static void *
+numa_reader(void *data)
+{
+    uint64_t last_version = 0;
+    uint64_t version = 0;
+    void *v;
+    int stop;
+
+    (void) data;
+    do {
+        stop = atomic_read_32(&numa_stop);
+        if ((errno = thread_safe_var_get(numa_var, &v, &version)) != 0)
+            err(1, "thread_safe_var_get() failed");
+        if (v != NULL && *(uint64_t *)v != MAGIC_INITED)
+            errx(1, "NUMA var read a freed value");
+        if (version < last_version)
+            errx(1, "NUMA var version went backwards (%llu < %llu)",
+                 (unsigned long long)version,
+                 (unsigned long long)last_version);
+        last_version = version;
+        thread_safe_var_quiescent();
+        sched_yield();
+    } while (!stop);
+    if (version != NUMA_WRITES)
+        errx(1, "NUMA var did not read the last value written");
+    return NULL;
+}
+
+/* Write NUMA_WRITES values to a NUMA var on nnodes nodes (0 -> real) */
+static void
+numa_run(int nnodes, thread_safe_var_clone_f clone)
+{
+    thread_safe_var_attr attr;
+    pthread_t reader;
+    uint32_t expected;
+    void *p = NULL;
+    size_t i;
+
+    tsv_numa_fake_nodes(nnodes);
+    nnuma_freed = 0;
+    nnuma_clones = 0;
+    atomic_write_32(&numa_stop, 0);
+
+    (void) thread_safe_var_attr_init(&attr);
+    attr.flags = THREAD_SAFE_VAR_NUMA_REPLICAS;
+    attr.clone = clone;
+    if ((errno = thread_safe_var_init_attr(&numa_var, numa_dtor,
+                                           &attr)) != 0)
+        err(1, "thread_safe_var_init_attr() failed");
+    if ((errno = pthread_create(&reader, NULL, numa_reader, NULL)) != 0)
+        err(1, "Failed to create NUMA reader thread");
+    for (i = 0; i < NUMA_WRITES; i++) {
+        if ((errno = copy_value(NULL, NULL, &p)) != 0)
+            err(1, "malloc() failed");
+        if ((errno = thread_safe_var_set(numa_var, p, NULL)) != 0)
+            err(1, "thread_safe_var_set() failed");
+    }
+    atomic_write_32(&numa_stop, 1);
+    (void) pthread_join(reader, NULL);
+    thread_safe_var_destroy(numa_var);
+
+    if (tsv_numa_nodes() > 1 && clone != NULL &&
+        nnuma_clones != NUMA_WRITES * (uint32_t)(tsv_numa_nodes() - 1))
+        errx(1, "NUMA var made %u clones of %u values on %d nodes",
+             nnuma_clones, NUMA_WRITES, tsv_numa_nodes());
+    expected = NUMA_WRITES + nnuma_clones;
+    if (nnuma_freed != expected)
+        errx(1, "NUMA var destroyed %u of %u values", nnuma_freed,
+             expected);
+    printf("NUMA replica test: %u writes on %d node(s)%s, none leaked\n",
+           NUMA_WRITES, tsv_numa_nodes(),
+           clone != NULL ? " with clones" : "");
+    tsv_numa_fake_nodes(0);
+}
+
+/*
+ * NUMA replica vars (a plain var with one node) read, write, and destroy
+ * each value exactly once, on this system's nodes and on fake ones, with
+ * values shared by all replicas or cloned for each node.
+ */
+static void
+numa_test(void)
+{
+    numa_run(0, NULL);
+    numa_run(2, NULL);
+    numa_run(2, numa_clone);
+    numa_run(3, numa_clone);
+}
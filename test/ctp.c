@@ -23,14 +23,22 @@
 #include "../thread_safe_global.h"
 #include "../atomics.h"
 
-#if !defined(USE_TSV_SLOT_PAIR_DESIGN) && !defined(USE_TSV_SUBSCRIPTION_SLOTS_DESIGN)
+#if !defined(USE_TSV_SLOT_PAIR_DESIGN) && \
+    !defined(USE_TSV_SUBSCRIPTION_SLOTS_DESIGN) && \
+    !defined(USE_TSV_LEFT_RIGHT_DESIGN)
 #define USE_TSV_SLOT_PAIR_DESIGN
 #endif
 #ifdef USE_TSV_SLOT_PAIR_DESIGN
 #define TSV_TYPE "slotpair"
+#define TSV_DESIGN THREAD_SAFE_VAR_DESIGN_SLOT_PAIR
 #endif
 #ifdef USE_TSV_SUBSCRIPTION_SLOTS_DESIGN
 #define TSV_TYPE "slotlist"
+#define TSV_DESIGN THREAD_SAFE_VAR_DESIGN_SLOT_LIST
+#endif
+#ifdef USE_TSV_LEFT_RIGHT_DESIGN
+#define TSV_TYPE "leftright"
+#define TSV_DESIGN THREAD_SAFE_VAR_DESIGN_LEFT_RIGHT
 #endif
 
 #define VERBOSE 1  // Set verbosity level
@@ -155,6 +163,7 @@ int main(int argc, char *argv[])
 
     size_t i;
     uint64_t *magic_exit;
+    thread_safe_var_attr attr;
     // Open log files before creating threads
     writer_log = fopen("writer_log.txt", "w");
     if (writer_log == NULL) {
@@ -174,8 +183,10 @@ int main(int argc, char *argv[])
     printf("Will use %ju reader threads and %ju writer threads\n",
            (uintmax_t)num_readers, (uintmax_t)num_writers);
 
-    if ((errno = thread_safe_var_init(&shared_ptr, dtor)) != 0)
-        err(1, "thread_safe_var_init() failed");
+    (void) thread_safe_var_attr_init(&attr);
+    attr.design = TSV_DESIGN;
+    if ((errno = thread_safe_var_init_attr(&shared_ptr, dtor, &attr)) != 0)
+        err(1, "thread_safe_var_init_attr() failed");
 
     if ((magic_exit = malloc(sizeof(*magic_exit))) == NULL)
         err(1, "malloc failed");
@@ -4,8 +4,8 @@ import pandas as pd
 import matplotlib.pyplot as plt
 import numpy as np
 
-num_methods = 7
-method_order = ["qsbr", "bp", "mb", "memb", "signal", "slotpair", "slotlist"]
+num_methods = 8
+method_order = ["qsbr", "bp", "mb", "memb", "signal", "slotpair", "slotlist", "leftright"]
 def parse_perf_output(file_path):
     metrics = {
         'cycles': 0,
@@ -3,7 +3,7 @@ import re
 import pandas as pd
 import matplotlib.pyplot as plt
 
-method_order = ["qsbr", "bp", "mb", "memb", "signal", "slotpair", "slotlist"]
+method_order = ["qsbr", "bp", "mb", "memb", "signal", "slotpair", "slotlist", "leftright"]
 
 def parse_perf_output(file_path):
     metrics = {
@@ -17,6 +17,7 @@ EXECUTABLES=(
     "signal"
     "slotpair"
     "slotlist"
+    "leftright"
 )
 
 
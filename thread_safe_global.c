@@ -40,169 +40,456 @@
  *    implementations below readers never block, not even on uncontended
  *    resources)
  *  - readers do not starve writers; writers do not block readers
+ *
+ * There are several designs, each in its own file (tsv_*.c), with
+ * different trade-offs.  The design of each variable is picked when it
+ * is initialized, from the attributes given to
+ * thread_safe_var_init_attr().  This file has the parts common to all
+ * designs: selection of a design, serialization of writers, version
+ * numbering, waiting for versions, and waiting for old values to be
+ * released (or deferring work until then).
  */
 
 #include <sys/types.h>
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#endif
 
 #include "thread_safe_global.h"
+#include "tsv_impl.h"
 #include "atomics.h"
 
-#if defined(USE_TSV_SLOT_PAIR_DESIGN) && defined(USE_TSV_SUBSCRIPTION_SLOTS_DESIGN)
-#error "Must define only one of USE_TSV_SLOT_PAIR_DESIGN or USE_TSV_SUBSCRIPTION_SLOTS_DESIGN"
+#if (defined(USE_TSV_SLOT_PAIR_DESIGN) + \
+     defined(USE_TSV_SUBSCRIPTION_SLOTS_DESIGN) + \
+     defined(USE_TSV_QSBR_DESIGN) + \
+     defined(USE_TSV_LEFT_RIGHT_DESIGN) + \
+     defined(USE_TSV_HYBRID_DESIGN)) > 1
+#error "Must define only one of USE_TSV_SLOT_PAIR_DESIGN, USE_TSV_SUBSCRIPTION_SLOTS_DESIGN, USE_TSV_QSBR_DESIGN, USE_TSV_LEFT_RIGHT_DESIGN, or USE_TSV_HYBRID_DESIGN"
 #endif
 
-#if !defined(USE_TSV_SLOT_PAIR_DESIGN) && !defined(USE_TSV_SUBSCRIPTION_SLOTS_DESIGN)
-#define USE_TSV_SLOT_PAIR_DESIGN
+/*
+ * The USE_TSV_*_DESIGN macros now only select the design of vars whose
+ * attributes don't call for any particular one.
+ */
+#if defined(USE_TSV_SUBSCRIPTION_SLOTS_DESIGN)
+#define TSV_DEFAULT_OPS tsv_slot_list_ops
+#elif defined(USE_TSV_QSBR_DESIGN)
+#define TSV_DEFAULT_OPS tsv_qsbr_ops
+#define TSV_DEFAULT_QSBR
+#elif defined(USE_TSV_LEFT_RIGHT_DESIGN)
+#define TSV_DEFAULT_OPS tsv_left_right_ops
+#elif defined(USE_TSV_HYBRID_DESIGN)
+#define TSV_DEFAULT_OPS tsv_hybrid_ops
+#else
+#define TSV_DEFAULT_OPS tsv_slot_pair_ops
 #endif
 
-typedef thread_safe_var_dtor_f var_dtor_t;
-
-#ifdef USE_TSV_SLOT_PAIR_DESIGN
 /*
- * There are two designs, but one of them is ommited here.
+ * Live value tracking
  *
- * See https://github.com/nicowilliams/ctp
+ * The lock is only taken by writers (publishing values), by whoever
+ * drops the last reference to a value, and by synchronizers.
  */
+struct tsv_live {
+    pthread_mutex_t         lock;
+    struct tsv_live_entry   *head;  /* oldest */
+    struct tsv_live_entry   *tail;  /* newest */
+    uint32_t                nref;   /* entries, plus one for the var */
+};
+
+/* Deferred callbacks; see thread_safe_var_defer() */
+struct tsv_deferred {
+    struct tsv_deferred     *next;
+    uint64_t                version;    /* run once this is released */
+    thread_safe_var_defer_f fn;
+    void                    *arg;
+};
 
 /*
- * This implements a thread-safe variable.  A thread can read it, and the
- * value it reads will be safe to continue using until it reads it again.
- *
- * Properties:
- *
- *  - writers are serialized
- *  - readers are fast, rarely doing blocking operations, and when they
- *    do, not blocking on contended resources (in one of two
- *    implementations below readers never block, not even on uncontended
- *    resources)
- *  - readers do not starve writers; writers do not block readers
+ * Derived values; see thread_safe_var_derive()
  *
+ * Each version published after derivations are added gets a set of
+ * results, linked newest to oldest, linked in before the version is
+ * published, and freed by a deferred callback once no reader holds that
+ * version.  A reader holding some version walks from the newest set to
+ * its own, and so only ever touches sets that can't be freed yet.
  */
+struct tsv_derivation {
+    thread_safe_var_derive_f    fn;
+    thread_safe_var_dtor_f      dtor;   /* for results */
+    void                        *arg;
+};
 
-/*
- * The design for this implementation uses a pair of slots such that one
- * has a current value for the variable, and the other holds the
- * previous value and will hold the next value.
- *
- * There are several atomic compositions needed to make this work.
- *
- *  - writers have to write two things (a pointer to a struct wrapping
- *    the intended value, and a version number)
- *
- *  - readers have to atomically read a version number, a pointer, and
- *    increment a ref count.
- *
- * These compositions are the challenging part of this.
- *
- * In a way this structure is a lot like a read-write lock that doesn't
- * starve writers.  But since the only thing readers here do with a
- * would-be read-write lock held is grab a reference to a "current"
- * value, this construction can be faster than read-write locks without
- * writer starvation: readers (almost) *never* block on contended
- * resources.  We achieve this by having two value slots: one for the
- * current value, and one for the previous/next value.  Readers can
- * always lock-less-ly find one of the two values.
- *
- * Whereas in the case of a read-write lock without writer starvation,
- * readers arriving after a writer must get held up for the writer who,
- * in turn, is held up by readers.  Therefore, for the typical case
- * where one uses read-write locks (to mediate access to rarely-changing
- * mostly-read-only data, typically configuration data), the API
- * implemented here is superior to read-write locks.
- *
- * We often use atomic CAS with equal new and old values as an atomic
- * read.  We could do better though.  We could use a LoadStore fence
- * around reads instead.
- *
- * NOTE WELL: We assume that atomic operations imply memory barriers.
- *
- *            The general rule is that all things which are to be
- *            atomically modified in some cases are always modified
- *            atomically, except at initialization time, and even then,
- *            in some cases the initialized value is immediately
- *            modified with an atomic operation.  This is to ensure
- *            memory visibility rules (see above), though we may be
- *            trying much too hard in some cases.
- *
- *            The atomic operations from atomics.[ch] provide the necessary
- *            barriers.
- */
+struct tsv_derived_set {
+    struct tsv_derived_set      *older;     /* atomic; link_lock */
+    struct tsv_derived_set      *newer;     /* link_lock */
+    struct tsv_derivations      *derivations;
+    uint64_t                    version;
+    struct tsv_derived {
+        void                    *result;    /* derive_lock */
+        volatile uint32_t       done;       /* atomic; result is set */
+    } results[1];                           /* one per derivation */
+};
 
-/*
- * This design uses a pair of "slots", such that one holds the current value of
- * the thread-safe global variable, while the other holds the previous/next
- * value.
- *
- * Writers make the previous slot into the new current slot, being careful not
- * to step on the toes of a reader that was reading from that slot thinking it
- * was the current slot.
- *
- * Readers are lock-less, except that when a reader is the last reader of a
- * slot it has to signal a writer that might be waiting for that reader to be
- * done with the slot.  Also, readers do call free(), which may acquire locks.
- * Sending that signal requires taking a lock that the writer will have dropped
- * in order to wait, thus it should be an uncontended lock, and if the reader
- * blocks racing with a writer, it should unblock very soon after.  This is
- * never needed when the value has not changed since the previous read.
- *
- * Both, reading, and writing are O(1).
- */
+struct tsv_derivations {
+    pthread_mutex_t             link_lock;
+    pthread_mutex_t             derive_lock;    /* one derivation at once */
+    struct tsv_derivation       *fns;           /* fixed once set */
+    size_t                      n;
+    struct tsv_derived_set      *newest;        /* atomic; write_lock */
+};
 
 /*
- * Values set on a thread-global variable are wrapped with a struct that
- * holds a reference count.
+ * Synchronizers (see thread_safe_var_synchronize()) wait for this to
+ * change.  It's process-wide so that readers releasing values needn't
+ * know which vars have synchronizers.
  */
-struct vwrapper {
-    var_dtor_t          dtor;       /* value destructor */
-    void                *ptr;       /* the actual value */
-    uint64_t            version;    /* version of this data */
-    volatile uint32_t   nref;       /* release when drops to 0 */
+static volatile uint32_t sync_seq;
+static volatile uint32_t nsyncers;
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sync_cv = PTHREAD_COND_INITIALIZER;
+
+/* Change notification fd; see thread_safe_var_notify_fd() */
+struct tsv_notify {
+    int                     rfd;        /* readable after writes */
+    int                     wfd;        /* rfd for eventfds */
+    volatile uint32_t       signalled;  /* atomic; until acked */
+};
+
+/* Retained-bytes budgets; see thread_safe_var_set_sized() */
+struct tsv_budget {
+    pthread_mutex_t         write_lock; /* one sized writer at a time */
+    pthread_mutex_t         lock;       /* retained */
+    uint64_t                max;        /* max_retained_bytes */
+    uint64_t                retained;   /* sized values not destroyed */
+    thread_safe_var_budget_policy policy;
+    thread_safe_var_defer_f over_budget;
+    void                    *over_budget_arg;
+};
+
+/* A sized value's bytes, given back to its budget once it's destroyed */
+struct tsv_budget_charge {
+    struct tsv_budget       *budget;
+    uint64_t                size;
 };
 
-/* This is a slot.  There are two of these. */
-struct var {
-    struct vwrapper     *wrapper;   /* wraps real ptr, has nref */
-    struct var          *other;     /* always points to the other slot */
-    uint64_t            version;    /* version of this slot's data */
-    volatile uint32_t   nreaders;   /* no. of readers active in this slot */
+/* Staleness bounds; see thread_safe_var_attr */
+struct tsv_stale {
+    pthread_key_t           key;        /* struct tsv_stale_reader */
+    uint64_t                ns;         /* max_stale_ns */
+    uint32_t                reads;      /* max_stale_reads */
 };
 
-struct thread_safe_var_s {
-    pthread_key_t       tkey;           /* to detect thread exits */
-    pthread_mutex_t     write_lock;     /* one writer at a time */
-    pthread_mutex_t     waiter_lock;    /* to signal waiters */
-    pthread_cond_t      waiter_cv;      /* to signal waiters */
-    pthread_mutex_t     cv_lock;        /* to signal waiting writer */
-    pthread_cond_t      cv;             /* to signal waiting writer */
-    struct var          vars[2];        /* the two slots */
-    var_dtor_t          dtor;           /* both read this */
-    uint64_t            next_version;   /* both read; writer writes */
+struct tsv_stale_reader {
+    uint64_t                deadline;   /* ns; refresh after */
+    uint32_t                reads;      /* since last refresh */
+    uint32_t                expired;    /* refresh on next read */
 };
 
+/* Bumped by every write to any var; see thread_safe_var_generation() */
+static volatile uint64_t generation;
+
+/* How often synchronizers check anyway, in case they missed a wakeup */
+#define TSV_SYNC_POLL_NS 10000000L
+
+#define THREAD_SAFE_VAR_ALL_FLAGS \
+    (THREAD_SAFE_VAR_READERS_NO_SPIN | THREAD_SAFE_VAR_READERS_NO_FREE | \
+     THREAD_SAFE_VAR_MEMBARRIER | THREAD_SAFE_VAR_NUMA_REPLICAS)
+
+/**
+ * Initialize thread-safe global variable attributes to defaults
+ *
+ * @param attr Pointer to attributes
+ *
+ * @return Returns zero on success, else a system error number
+ */
+int
+thread_safe_var_attr_init(thread_safe_var_attr *attr)
+{
+    memset(attr, 0, sizeof(*attr));
+    attr->design = THREAD_SAFE_VAR_DESIGN_DEFAULT;
+    attr->flags = 0;
+    attr->clone = NULL;
+    attr->max_stale_ns = 0;
+    attr->max_stale_reads = 0;
+    attr->max_retained_bytes = 0;
+    attr->budget_policy = THREAD_SAFE_VAR_BUDGET_BLOCK;
+    attr->over_budget = NULL;
+    attr->over_budget_arg = NULL;
+    return 0;
+}
+
+/*
+ * QSBR readers never hold on to a value between reads (see qsbr_peek()),
+ * so there's no way for them to honor a staleness bound.
+ */
+#define STALE_BOUND(attr) \
+    ((attr)->max_stale_ns != 0 || (attr)->max_stale_reads != 0)
+
+/* Pick a design given attributes; NULL if they are inconsistent */
+static const struct tsv_ops *
+select_design(const thread_safe_var_attr *attr)
+{
+    thread_safe_var_attr replica_attr;
+
+    if ((attr->flags & ~THREAD_SAFE_VAR_ALL_FLAGS) != 0)
+        return NULL;
+
+    if (attr->flags & THREAD_SAFE_VAR_NUMA_REPLICAS) {
+        /*
+         * The replicas are vars of the design picked by the rest of the
+         * attributes.  With only one node there's nothing to replicate.
+         */
+        replica_attr = *attr;
+        replica_attr.flags &= ~THREAD_SAFE_VAR_NUMA_REPLICAS;
+        if (select_design(&replica_attr) == NULL)
+            return NULL;
+        if (tsv_numa_nodes() > 1)
+            return &tsv_numa_ops;
+        attr = &replica_attr;
+    }
+
+    switch (attr->design) {
+    case THREAD_SAFE_VAR_DESIGN_DEFAULT:
+        break;
+    case THREAD_SAFE_VAR_DESIGN_SLOT_PAIR:
+        return (attr->flags & THREAD_SAFE_VAR_MEMBARRIER) ?
+            NULL : &tsv_slot_pair_ops;
+    case THREAD_SAFE_VAR_DESIGN_SLOT_LIST:
+        return &tsv_slot_list_ops;
+    case THREAD_SAFE_VAR_DESIGN_QSBR:
+        return ((attr->flags & THREAD_SAFE_VAR_MEMBARRIER) ||
+                STALE_BOUND(attr)) ? NULL : &tsv_qsbr_ops;
+    case THREAD_SAFE_VAR_DESIGN_LEFT_RIGHT:
+        return (attr->flags & THREAD_SAFE_VAR_MEMBARRIER) ?
+            NULL : &tsv_left_right_ops;
+    case THREAD_SAFE_VAR_DESIGN_HYBRID:
+        return &tsv_hybrid_ops;
+    default:
+        return NULL;
+    }
+
+    /*
+     * No design given; pick one from the caller's preferences.  QSBR
+     * changes the API contract, so we never pick it implicitly.
+     *
+     * Only slot-list readers never free(), and only left-right readers
+     * never loop.  On conflict we give priority to functionality: a
+     * reader that must not free() (e.g., because it holds locks the
+     * value destructor needs) would deadlock, while a reader that loops
+     * merely takes a little longer while racing with writers.
+     */
+    if (attr->flags & (THREAD_SAFE_VAR_READERS_NO_FREE |
+                       THREAD_SAFE_VAR_MEMBARRIER))
+        return &tsv_slot_list_ops;
+    if (attr->flags & THREAD_SAFE_VAR_READERS_NO_SPIN)
+        return &tsv_left_right_ops;
+#ifdef TSV_DEFAULT_QSBR
+    if (STALE_BOUND(attr))
+        return NULL;
+#endif
+    return &TSV_DEFAULT_OPS;
+}
+
+/* Make a live value tracker */
+static int
+live_new(struct tsv_live **livep)
+{
+    struct tsv_live *live;
+    int err;
+
+    if ((*livep = live = calloc(1, sizeof(*live))) == NULL)
+        return errno;
+    live->nref = 1;
+    if ((err = pthread_mutex_init(&live->lock, NULL)) != 0) {
+        free(live);
+        *livep = NULL;
+    }
+    return err;
+}
+
+/* Drop a reference to a live value tracker */
+static void
+live_put(struct tsv_live *live)
+{
+    uint32_t nref;
+
+    (void) pthread_mutex_lock(&live->lock);
+    nref = --live->nref;
+    (void) pthread_mutex_unlock(&live->lock);
+    if (nref > 0)
+        return;
+    pthread_mutex_destroy(&live->lock);
+    free(live);
+}
+
+static int
+stale_new(const thread_safe_var_attr *attr, struct tsv_stale **stalep)
+{
+    struct tsv_stale *stale;
+    int err;
+
+    *stalep = NULL;
+    if (attr->max_stale_ns == 0 && attr->max_stale_reads == 0)
+        return 0;
+    if ((stale = calloc(1, sizeof(*stale))) == NULL)
+        return errno;
+    if ((err = pthread_key_create(&stale->key, free)) != 0) {
+        free(stale);
+        return err;
+    }
+    stale->ns = attr->max_stale_ns;
+    stale->reads = attr->max_stale_reads;
+    *stalep = stale;
+    return 0;
+}
+
+static void
+stale_free(struct tsv_stale *stale)
+{
+    if (stale == NULL)
+        return;
+    /* XXX We leak live threads' struct tsv_stale_reader */
+    (void) pthread_key_delete(stale->key);
+    free(stale);
+}
+
+static int
+budget_new(const thread_safe_var_attr *attr, struct tsv_budget **budgetp)
+{
+    struct tsv_budget *budget;
+    int err;
+
+    *budgetp = NULL;
+    if (attr->max_retained_bytes == 0)
+        return 0;
+    if (attr->budget_policy > THREAD_SAFE_VAR_BUDGET_NOTIFY ||
+        (attr->budget_policy == THREAD_SAFE_VAR_BUDGET_NOTIFY &&
+         attr->over_budget == NULL))
+        return EINVAL;
+    if ((budget = calloc(1, sizeof(*budget))) == NULL)
+        return errno;
+    if ((err = pthread_mutex_init(&budget->write_lock, NULL)) != 0) {
+        free(budget);
+        return err;
+    }
+    if ((err = pthread_mutex_init(&budget->lock, NULL)) != 0) {
+        pthread_mutex_destroy(&budget->write_lock);
+        free(budget);
+        return err;
+    }
+    budget->max = attr->max_retained_bytes;
+    budget->policy = attr->budget_policy;
+    budget->over_budget = attr->over_budget;
+    budget->over_budget_arg = attr->over_budget_arg;
+    *budgetp = budget;
+    return 0;
+}
 
 static void
-wrapper_free(struct vwrapper *wrapper)
+budget_free(struct tsv_budget *budget)
 {
-    if (wrapper == NULL)
+    if (budget == NULL)
         return;
-    if (atomic_dec_32_nv(&wrapper->nref) > 0)
+    pthread_mutex_destroy(&budget->write_lock);
+    pthread_mutex_destroy(&budget->lock);
+    free(budget);
+}
+
+/* Count bytes as retained under a budget, or give them back */
+static void
+budget_charge(struct tsv_budget *budget, uint64_t size, int give_back)
+{
+    (void) pthread_mutex_lock(&budget->lock);
+    if (give_back)
+        budget->retained -= size;
+    else
+        budget->retained += size;
+    (void) pthread_mutex_unlock(&budget->lock);
+}
+
+/* Deferred callback giving a destroyed value's bytes back */
+static void
+budget_uncharge(void *arg)
+{
+    struct tsv_budget_charge *charge = arg;
+
+    budget_charge(charge->budget, charge->size, 1);
+    free(charge);
+}
+
+static void
+notify_close(struct tsv_notify *n)
+{
+    if (n == NULL)
         return;
-    if (wrapper->dtor != NULL)
-        wrapper->dtor(wrapper->ptr);
-    free(wrapper);
+    (void) close(n->rfd);
+    if (n->wfd != n->rfd)
+        (void) close(n->wfd);
+    free(n);
+}
+
+/* Run and free a list of deferred callbacks */
+static void
+run_callbacks(struct tsv_deferred *d)
+{
+    struct tsv_deferred *next;
+
+    for (; d != NULL; d = next) {
+        next = d->next;
+        d->fn(d->arg);
+        free(d);
+    }
+}
+
+/* Unlink and free a set of derived results (a deferred callback) */
+static void
+derived_set_free(void *arg)
+{
+    struct tsv_derived_set *set = arg;
+    struct tsv_derivations *d = set->derivations;
+    size_t i;
+
+    (void) pthread_mutex_lock(&d->link_lock);
+    if (set->older != NULL)
+        set->older->newer = set->newer;
+    if (set->newer != NULL)
+        atomic_write_ptr((volatile void **)&set->newer->older, set->older);
+    else
+        atomic_write_ptr((volatile void **)&d->newest, set->older);
+    (void) pthread_mutex_unlock(&d->link_lock);
+
+    for (i = 0; i < d->n; i++) {
+        if (set->results[i].done && d->fns[i].dtor != NULL)
+            d->fns[i].dtor(set->results[i].result);
+    }
+    free(set);
 }
 
-/* For the thread-specific key */
+/* Free derivations, once their var's deferred callbacks have run */
 static void
-var_dtor_wrapper(void *wrapper)
+derivations_free(struct tsv_derivations *d)
 {
-    wrapper_free(wrapper);
+    if (d == NULL)
+        return;
+    while (d->newest != NULL)
+        derived_set_free(d->newest);
+    pthread_mutex_destroy(&d->link_lock);
+    pthread_mutex_destroy(&d->derive_lock);
+    free(d->fns);
+    free(d);
 }
 
 /**
@@ -212,86 +499,94 @@ var_dtor_wrapper(void *wrapper)
  * void, which may be set and read.  A value read from a thread-safe
  * global variable will be valid in the thread that read it, and will
  * remain valid until released or until the thread-safe global variable
- * is read again in the same thread.  New values may be set.  Values
- * will be destroyed with the destructor provided when no references
- * remain.
+ * is read again in the same thread (or, for QSBR vars, until that
+ * thread next calls thread_safe_var_quiescent()).  New values may be
+ * set.  Values will be destroyed with the destructor provided when no
+ * references remain.
  *
  * @param var Pointer to thread-safe global variable
  * @param dtor Pointer to thread-safe global value destructor function
+ * @param attr Pointer (may be NULL) to attributes
  *
  * @return Returns zero on success, else a system error number
  */
 int
-thread_safe_var_init(thread_safe_var *vpp,
-                     thread_safe_var_dtor_f dtor)
+thread_safe_var_init_attr(thread_safe_var *vpp,
+                          thread_safe_var_dtor_f dtor,
+                          const thread_safe_var_attr *attr)
 {
+    thread_safe_var_attr defattr;
+    const struct tsv_ops *ops;
     thread_safe_var vp;
     int err;
 
     *vpp = NULL;
+
+    if (attr == NULL) {
+        (void) thread_safe_var_attr_init(&defattr);
+        attr = &defattr;
+    }
+    if ((ops = select_design(attr)) == NULL)
+        return EINVAL;
+
     if ((vp = calloc(1, sizeof(*vp))) == NULL)
         return errno;
 
-    /*
-     * The thread-local key is used to hold a reference for destruction
-     * at thread-exit time, if the thread does not explicitly drop the
-     * reference before then.
-     *
-     * There's no pthread_key_destroy(), so we leak these.  We ought to
-     * have a single global thread key whose values point to a
-     * counted-length array of keys, with a global counter that we
-     * snapshot here and use as an index into that array (and which is
-     * realloc()'ed as needed).
-     */
-    if ((err = pthread_key_create(&vp->tkey, var_dtor_wrapper)) != 0) {
+    vp->ops = ops;
+    vp->impl = NULL;
+    vp->dtor = dtor;
+    vp->version = 0;
+    vp->flags = attr->flags;
+
+    if ((err = pthread_mutex_init(&vp->write_lock, NULL)) != 0) {
         free(vp);
         return err;
     }
-    if ((err = pthread_mutex_init(&vp->write_lock, NULL)) != 0) {
+    if ((err = pthread_mutex_init(&vp->waiter_lock, NULL)) != 0) {
+        pthread_mutex_destroy(&vp->write_lock);
         free(vp);
         return err;
     }
-    if ((err = pthread_mutex_init(&vp->waiter_lock, NULL)) != 0) {
+    if ((err = pthread_cond_init(&vp->waiter_cv, NULL)) != 0) {
         pthread_mutex_destroy(&vp->write_lock);
+        pthread_mutex_destroy(&vp->waiter_lock);
         free(vp);
         return err;
     }
-    if ((err = pthread_mutex_init(&vp->cv_lock, NULL)) != 0) {
+    if ((err = live_new(&vp->live)) != 0) {
         pthread_mutex_destroy(&vp->write_lock);
-        pthread_mutex_destroy(&vp->cv_lock);
+        pthread_mutex_destroy(&vp->waiter_lock);
+        pthread_cond_destroy(&vp->waiter_cv);
         free(vp);
         return err;
     }
-    if ((err = pthread_cond_init(&vp->cv, NULL)) != 0) {
+    if ((err = stale_new(attr, &vp->stale)) != 0) {
         pthread_mutex_destroy(&vp->write_lock);
         pthread_mutex_destroy(&vp->waiter_lock);
-        pthread_mutex_destroy(&vp->cv_lock);
+        pthread_cond_destroy(&vp->waiter_cv);
+        live_put(vp->live);
         free(vp);
         return err;
     }
-    if ((err = pthread_cond_init(&vp->waiter_cv, NULL)) != 0) {
+    if ((err = budget_new(attr, &vp->budget)) != 0) {
         pthread_mutex_destroy(&vp->write_lock);
         pthread_mutex_destroy(&vp->waiter_lock);
-        pthread_mutex_destroy(&vp->cv_lock);
-        pthread_cond_destroy(&vp->cv);
+        pthread_cond_destroy(&vp->waiter_cv);
+        live_put(vp->live);
+        stale_free(vp->stale);
+        free(vp);
+        return err;
+    }
+    if ((err = ops->init(vp, attr)) != 0) {
+        pthread_mutex_destroy(&vp->write_lock);
+        pthread_mutex_destroy(&vp->waiter_lock);
+        pthread_cond_destroy(&vp->waiter_cv);
+        live_put(vp->live);
+        stale_free(vp->stale);
+        budget_free(vp->budget);
         free(vp);
         return err;
     }
-
-    /*
-     * vp->next_version is a 64-bit unsigned int.  If ever we can't get
-     * atomics to deal with it on 32-bit platforms we could have a
-     * pointer to one of two version numbers which are not atomically
-     * updated, and instead atomically update the pointer.
-     */
-    vp->next_version = 0;
-    vp->vars[0].nreaders = 0;
-    vp->vars[0].wrapper = NULL;
-    vp->vars[0].other = &vp->vars[1]; /* other pointer never changes */
-    vp->vars[1].nreaders = 0;
-    vp->vars[1].wrapper = NULL;
-    vp->vars[1].other = &vp->vars[0]; /* other pointer never changes */
-    vp->dtor = dtor;
 
     /*
      * Acquiring and dropping the lock functions as a trivial memory
@@ -303,6 +598,56 @@ thread_safe_var_init(thread_safe_var *vpp,
     return 0;
 }
 
+/*
+ * Finish setting up a statically-initialized var (see
+ * THREAD_SAFE_VAR_INITIALIZER()).  Only writers need to: until the
+ * first write readers find no ops, and so no value.
+ */
+static int
+setup(thread_safe_var vp)
+{
+    thread_safe_var_attr attr;
+    const struct tsv_ops *ops;
+    int err;
+
+    if (atomic_read_ptr((volatile void **)&vp->ops) != NULL)
+        return 0;
+
+    if ((err = pthread_mutex_lock(&vp->write_lock)) != 0)
+        return err;
+    if (vp->ops == NULL) {
+        (void) thread_safe_var_attr_init(&attr);
+        ops = select_design(&attr);
+        if ((err = live_new(&vp->live)) == 0 &&
+            (err = ops->init(vp, &attr)) != 0) {
+            live_put(vp->live);
+            vp->live = NULL;
+        }
+        /* Publish the design last; readers check for it */
+        if (err == 0)
+            atomic_write_ptr((volatile void **)&vp->ops, (void *)ops);
+    }
+    (void) pthread_mutex_unlock(&vp->write_lock);
+    return err;
+}
+
+/**
+ * Initialize a thread-safe global variable with default attributes
+ *
+ * See thread_safe_var_init_attr().
+ *
+ * @param var Pointer to thread-safe global variable
+ * @param dtor Pointer to thread-safe global value destructor function
+ *
+ * @return Returns zero on success, else a system error number
+ */
+int
+thread_safe_var_init(thread_safe_var *vpp,
+                     thread_safe_var_dtor_f dtor)
+{
+    return thread_safe_var_init_attr(vpp, dtor, NULL);
+}
+
 /**
  * Destroy a thread-safe global variable
  *
@@ -314,42 +659,124 @@ thread_safe_var_init(thread_safe_var *vpp,
 void
 thread_safe_var_destroy(thread_safe_var vp)
 {
+    struct tsv_derivations *derived;
+    struct tsv_deferred *deferred;
+    struct tsv_notify *notify;
+    struct tsv_live *live;
+    thread_safe_var_dtor_f dtor;
+    void *pending;
+
     if (vp == 0)
         return;
 
-    thread_safe_var_release(vp);
     pthread_mutex_lock(&vp->write_lock); /* There'd better not be readers */
-    pthread_cond_destroy(&vp->cv);
-    pthread_mutex_destroy(&vp->cv_lock);
-    wrapper_free(vp->vars[0].wrapper);
-    wrapper_free(vp->vars[1].wrapper);
-    vp->vars[0].other = &vp->vars[1];
-    vp->vars[1].other = &vp->vars[0];
-    vp->vars[0].wrapper = NULL;
-    vp->vars[1].wrapper = NULL;
-    vp->dtor = NULL;
+    if (vp->ops != NULL)
+        vp->ops->destroy(vp);
+    vp->ops = NULL;
+    vp->impl = NULL;
+    deferred = vp->deferred;
+    vp->deferred = NULL;
+    live = vp->live;
+    vp->live = NULL;
+    derived = vp->derived;
+    vp->derived = NULL;
+    pending = vp->pending;
+    vp->pending = NULL;
+    notify = vp->notify;
+    vp->notify = NULL;
+    dtor = vp->dtor;
+    if (vp->static_init)
+        atomic_write_64(&vp->version, 0);
+    else
+        vp->dtor = NULL;
     pthread_mutex_unlock(&vp->write_lock);
+
+    /* A thread_safe_var_set_async() value never published */
+    if (pending != NULL && dtor != NULL)
+        dtor(pending);
+
+    /* With no readers left, all deferred callbacks are due */
+    run_callbacks(deferred);
+    derivations_free(derived);
+    notify_close(notify);
+    if (live != NULL)
+        live_put(live);
+
+    /* Statically-initialized vars go back to their initial state */
+    if (vp->static_init)
+        return;
+    stale_free(vp->stale);
+    budget_free(vp->budget);
     pthread_mutex_destroy(&vp->write_lock);
+    pthread_mutex_destroy(&vp->waiter_lock);
+    pthread_cond_destroy(&vp->waiter_cv);
     free(vp);
-    /* Remaining references will be released by the thread key destructor */
-    /* XXX We leak var->tkey!  See note in initiator above. */
 }
 
+/*
+ * Read a var with a staleness bound: keep serving this thread's value
+ * while within the bound, else read the var and start a new bound.
+ */
 static int
-signal_writer(thread_safe_var vp)
+get_stale(thread_safe_var vp, const struct tsv_ops *ops, void **res,
+          uint64_t *version)
 {
+    struct tsv_stale *stale = vp->stale;
+    struct tsv_stale_reader *r;
+    struct timespec ts;
+    uint64_t now = 0;
     int err;
 
-    if ((err = pthread_mutex_lock(&vp->cv_lock)) != 0)
+    if ((r = pthread_getspecific(stale->key)) == NULL) {
+        if ((r = calloc(1, sizeof(*r))) == NULL)
+            return errno;
+        if ((err = pthread_setspecific(stale->key, r)) != 0) {
+            free(r);
+            return err;
+        }
+    } else if (!r->expired &&
+               (stale->reads == 0 || r->reads < stale->reads)) {
+        if (stale->ns != 0 && clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+            now = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+        if ((stale->ns == 0 || now < r->deadline) &&
+            ops->peek(vp, res, version) == 0) {
+            r->reads++;
+            return 0;
+        }
+    }
+
+    if ((err = ops->get(vp, res, version)) != 0)
         return err;
-    if ((err = pthread_cond_signal(&vp->cv)) != 0)
-        abort();
-    return pthread_mutex_unlock(&vp->cv_lock);
+    if (stale->ns != 0 && now == 0 &&
+        clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+        now = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    r->deadline = now + stale->ns;
+    r->reads = 0;
+    r->expired = 0;
+    return 0;
+}
+
+/*
+ * End the calling thread's staleness bound on a var, if any, so that its
+ * next read looks at the var.
+ */
+static void
+stale_expire(thread_safe_var vp)
+{
+    struct tsv_stale_reader *r;
+
+    if (vp->stale != NULL &&
+        (r = pthread_getspecific(vp->stale->key)) != NULL)
+        r->expired = 1;
 }
 
 /**
  * Get the most up to date value of the given cf var.
  *
+ * For vars with a staleness bound (see thread_safe_var_attr) this can
+ * output the value the calling thread last read instead, within the
+ * bound.
+ *
  * @param [in] var Pointer to a cf var
  * @param [out] res Pointer to location where the variable's value will be output
  * @param [out] version Pointer (may be NULL) to 64-bit integer where the current version will be output
@@ -359,981 +786,1578 @@ signal_writer(thread_safe_var vp)
 int
 thread_safe_var_get(thread_safe_var vp, void **res, uint64_t *version)
 {
-    int err = 0;
-    int err2 = 0;
-    uint32_t nref;
-    struct var *v;
+    const struct tsv_ops *ops;
     uint64_t vers;
-    struct vwrapper *wrapper;
 
     if (version == NULL)
         version = &vers;
     *version = 0;
-
     *res = NULL;
-
-    if ((wrapper = pthread_getspecific(vp->tkey)) != NULL &&
-        wrapper->version == atomic_read_64(&vp->next_version) - 1) {
-
-        /* Fast path */
-        *version = wrapper->version;
-        *res = wrapper->ptr;
+    /* NULL until a statically-initialized var is first written */
+    if ((ops = atomic_read_ptr((volatile void **)&vp->ops)) == NULL)
         return 0;
-    }
-
-    /* Busy loop to get current slot.  Races with writers. */
-    for (;;) {
-        /* Get the current next_version */
-        *version = atomic_read_64(&vp->next_version);
-        if (*version == 0)
-            return 0;
-        (*version)--; /* The current version is one less than next_version */
-
-        /* Get what we hope is still the current slot */
-        v = &vp->vars[(*version) & 0x1];
-
-        /*
-         * We picked a slot, but we could just have lost against one or more
-         * writers.  So far nothing we've done would block any number of
-         * them.
-         *
-         * We increment nreaders for the slot we picked to keep out
-         * subsequent writers; we can then lose one more race at most.
-         */
-        (void) atomic_inc_32_nv(&v->nreaders);
-        /* Repeat until we're done losing any races */
-        if (atomic_read_64(&vp->next_version) == (*version + 1))
-            break;
-        if (atomic_dec_32_nv(&v->nreaders) == 0)
-            (void) signal_writer(vp);
-    }
-
-    assert(v->wrapper != NULL);
-    assert(*version + 1 == atomic_read_64(&vp->next_version) ||
-           *version + 2 == atomic_read_64(&vp->next_version));
-
-    /* Take the wrapped value for the slot we chose */
-    nref = atomic_inc_32_nv(&v->wrapper->nref);
-    assert(nref > 1);
-    *version = v->wrapper->version;
-    *res = v->wrapper->ptr;
-
-
-    /*
-     * Release the slot and signal any possible waiting writer if the slot's
-     * nreaders drops to zero (that's what the writer will be waiting for).
-     *
-     * The one blocking operation done by readers happens in
-     * signal_writer(), but that one blocking operation is for a lock
-     * that the writer will have or will soon have released, so it's
-     * a practically uncontended blocking operation.
-     */
-    wrapper = v->wrapper;
-    if (atomic_dec_32_nv(&v->nreaders) == 0 &&
-        atomic_read_64(&vp->next_version) != (*version + 1))
-        err2 = signal_writer(vp);
-
-    /*
-     * Release the value previously read in this thread, if any.
-     *
-     * Note that we call free() here, which means that we might take a
-     * lock in free().  The application's value destructor also can do
-     * the same.
-     *
-     * TODO We could use a lock-less queue/stack to queue up wrappers
-     *      for destruction by writers, then readers could be even more
-     *      light-weight.  But then while synchronous value destruction could
-     *      be valuable.
-     */
-    if (wrapper != pthread_getspecific(vp->tkey))
-        thread_safe_var_release(vp);
-
-    /* Recall this value we just read */
-    err = pthread_setspecific(vp->tkey, wrapper);
-    return (err2 == 0) ? err : err2;
+    if (vp->stale != NULL)
+        return get_stale(vp, ops, res, version);
+    return ops->get(vp, res, version);
 }
 
 /**
- * Release this thread's reference (if it holds one) to the current
- * value of the given thread-safe global variable.
+ * Get the most up to date values of many vars at once.
  *
- * @param vp [in] A thread-safe global variable
+ * This is equivalent to calling thread_safe_var_get() on each var, in
+ * order, but cheaper for readers that read many vars per unit of work.
+ * Each value is the var's current value at some point during the call;
+ * values of different vars need not be from any one moment (use a
+ * thread_safe_var_group for that).
+ *
+ * @param vps [in] Array of vars
+ * @param n [in] Number of vars
+ * @param values [out] Array where the vars' values will be output
+ * @param versions [out] Array (may be NULL) where the values' versions will be output
+ *
+ * @return Zero on success, a system error code otherwise (values not
+ * read are output as NULL)
+ */
+int
+thread_safe_var_get_many(const thread_safe_var *vps, size_t n, void **values,
+                         uint64_t *versions)
+{
+    const struct tsv_ops *ops;
+    uint64_t vers;
+    size_t i;
+    int err = 0;
+
+    for (i = 0; i < n; i++)
+        values[i] = NULL;
+    for (i = 0; i < n && err == 0; i++) {
+        vers = 0;
+        if ((ops = atomic_read_ptr((volatile void **)&vps[i]->ops)) != NULL)
+            err = vps[i]->stale != NULL ?
+                get_stale(vps[i], ops, &values[i], &vers) :
+                ops->get(vps[i], &values[i], &vers);
+        if (versions != NULL)
+            versions[i] = vers;
+    }
+    for (; i < n && versions != NULL; i++)
+        versions[i] = 0;
+    return err;
+}
+
+/**
+ * Check whether a var has been set since the given version was read.
+ *
+ * This is one load of the var's published version: it takes no
+ * reference and writes nothing, so it is cheaper than
+ * thread_safe_var_get() for readers that only act on changes.  Once this
+ * returns non-zero, thread_safe_var_get() outputs a newer value.
+ *
+ * @param vp [in] A thread-safe global variable
+ * @param version [in] The last version read (zero if none)
+ *
+ * @return Non-zero if the var's version is newer than the given version
+ */
+int
+thread_safe_var_changed(thread_safe_var vp, uint64_t version)
+{
+    /*
+     * Readers can see a value before vp->version catches up with it
+     * (see set_prepared()), so only a newer version is a change.
+     */
+    return atomic_read_64(&vp->version) > version;
+}
+
+/**
+ * Get the process-wide write generation, which every write to any var
+ * (including POD vars) increments after publishing its new value.
+ *
+ * A reader of many vars can remember the generation as of its last look
+ * at them and skip looking again while it's unchanged.  This is one
+ * load.
+ *
+ * @return The current generation
+ */
+uint64_t
+thread_safe_var_generation(void)
+{
+    return atomic_read_64(&generation);
+}
+
+/**
+ * Release this thread's reference (if it holds one) to the current
+ * value of the given thread-safe global variable.
+ *
+ * @param vp [in] A thread-safe global variable
  */
 void
 thread_safe_var_release(thread_safe_var vp)
 {
-    struct vwrapper *wrapper = pthread_getspecific(vp->tkey);
+    const struct tsv_ops *ops;
 
-    if (wrapper == NULL)
-        return;
-    if (pthread_setspecific(vp->tkey, NULL) != 0)
-        abort();
-    assert(pthread_getspecific(vp->tkey) == NULL);
-    wrapper_free(wrapper);
+    if ((ops = atomic_read_ptr((volatile void **)&vp->ops)) != NULL)
+        ops->release(vp);
 }
 
 /**
- * Set new data on a thread-safe global variable
+ * Get the current value of a thread-safe global variable as a
+ * reference that can be handed to and used by other threads, and that
+ * stays valid until put with thread_safe_var_ref_put().
  *
- * @param [in] var Pointer to thread-safe global variable
- * @param [in] cfdata New value for the thread-safe global variable
- * @param [out] new_version New version number
+ * This costs about as much as thread_safe_var_get(), which it also
+ * counts as, plus an atomic increment.  References must all be put
+ * before the variable is destroyed.
  *
- * @return 0 on success, or a system error such as ENOMEM.
+ * @param vp [in] A thread-safe global variable
+ * @param ref [out] Pointer to reference (its value is NULL if the var has none)
+ *
+ * @return Zero on success, else a system error
  */
 int
-thread_safe_var_set(thread_safe_var vp, void *cfdata,
-                    uint64_t *new_version)
+thread_safe_var_acquire(thread_safe_var vp, thread_safe_var_ref *ref)
 {
-    int err;
-    size_t i;
-    struct var *v;
-    struct vwrapper *old_wrapper = NULL;
-    struct vwrapper *wrapper;
-    struct vwrapper *tmp;
-    uint64_t vers;
-    uint64_t tmp_version;
-    uint64_t nref;
+    const struct tsv_ops *ops;
 
-    if (cfdata == NULL)
-        return EINVAL;
+    ref->var = vp;
+    ref->value = NULL;
+    ref->version = 0;
+    ref->handle = NULL;
+    if ((ops = atomic_read_ptr((volatile void **)&vp->ops)) == NULL)
+        return 0;
+    return ops->acquire(vp, &ref->handle, &ref->value, &ref->version);
+}
 
-    if (new_version == NULL)
-        new_version = &vers;
+/**
+ * Copy a reference, adding a reference to its value
+ *
+ * @param ref [in] A reference from thread_safe_var_acquire()
+ * @param dup [out] The copy, to be put separately
+ */
+void
+thread_safe_var_ref_dup(const thread_safe_var_ref *ref,
+                        thread_safe_var_ref *dup)
+{
+    *dup = *ref;
+    if (ref->handle != NULL)
+        ref->var->ops->ref_dup(ref->var, ref->handle);
+}
 
-    *new_version = 0;
+/**
+ * Put a reference, which may destroy its value
+ *
+ * @param ref [in] A reference from thread_safe_var_acquire() or thread_safe_var_ref_dup() (put references are left with no value)
+ */
+void
+thread_safe_var_ref_put(thread_safe_var_ref *ref)
+{
+    if (ref->handle != NULL)
+        ref->var->ops->ref_put(ref->var, ref->handle);
+    ref->value = NULL;
+    ref->version = 0;
+    ref->handle = NULL;
+}
+
+/*
+ * Waiting for words to change
+ *
+ * On Linux we wait with futexes, and elsewhere with a condition
+ * variable (and its mutex) that goes with the word.  Wakers increment
+ * the word before waking.
+ */
+static void
+word_wake(volatile uint32_t *word, pthread_mutex_t *lock, pthread_cond_t *cv)
+{
+#ifdef __linux__
+    (void) lock;
+    (void) cv;
+    (void) syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT32_MAX,
+                   NULL, NULL, 0);
+#else
+    (void) pthread_mutex_lock(lock);
+    (void) pthread_cond_broadcast(cv);
+    (void) pthread_mutex_unlock(lock);
+#endif
+}
+
+/*
+ * Wait for *word to change from val, until the deadline, if any (see
+ * make_deadline()).  Returns zero if it may have changed, else
+ * ETIMEDOUT or a system error.
+ */
+static int
+word_wait(volatile uint32_t *word, uint32_t val,
+          const struct timespec *deadline,
+          pthread_mutex_t *lock, pthread_cond_t *cv)
+{
+#ifdef __linux__
+    (void) lock;
+    (void) cv;
+    if (syscall(SYS_futex, word, FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG,
+                val, deadline, NULL, FUTEX_BITSET_MATCH_ANY) == 0)
+        return 0;
+    if (errno == EAGAIN || errno == EINTR)
+        return 0;
+    return errno;
+#else
+    int err = 0;
+
+    if ((err = pthread_mutex_lock(lock)) != 0)
+        return err;
+    while (err == 0 && atomic_read_32(word) == val) {
+        if (deadline == NULL)
+            err = pthread_cond_wait(cv, lock);
+        else
+            err = pthread_cond_timedwait(cv, lock, deadline);
+    }
+    (void) pthread_mutex_unlock(lock);
+    return err;
+#endif
+}
 
-    /* Build a wrapper for the new value */
-    if ((wrapper = calloc(1, sizeof(*wrapper))) == NULL)
+/* Absolute deadline for word_wait() from a relative timeout */
+static int
+make_deadline(const struct timespec *timeout, struct timespec *deadline)
+{
+#ifdef __linux__
+    if (clock_gettime(CLOCK_MONOTONIC, deadline) != 0)
+        return errno;
+#else
+    if (clock_gettime(CLOCK_REALTIME, deadline) != 0)
         return errno;
+#endif
+    deadline->tv_sec += timeout->tv_sec;
+    deadline->tv_nsec += timeout->tv_nsec;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+    return 0;
+}
 
-    /*
-     * The var itself holds a reference to the current value, thus its
-     * nref starts at 1, but that is made so further below.
-     */
-    wrapper->dtor = vp->dtor;
-    wrapper->nref = 0;
-    wrapper->ptr = cfdata;
+/*
+ * Waiting for versions
+ *
+ * Waiters wait for vp->seq, which writers increment after publishing a
+ * new version, to change.  Writers only wake waiters if there are any:
+ * waiters increment vp->nwaiters before reading vp->seq, and writers
+ * read vp->nwaiters after incrementing vp->seq, both with full memory
+ * barriers, so that either the writer sees the waiter or the waiter
+ * sees the new vp->seq (and won't wait).
+ */
+static void
+version_wake(thread_safe_var vp)
+{
+    word_wake(&vp->seq, &vp->waiter_lock, &vp->waiter_cv);
+}
 
-    /* This functions as a memory barrier for the above writes */
-    if ((err = pthread_mutex_lock(&vp->write_lock)) != 0) {
-        free(wrapper);
+static int
+version_wait(thread_safe_var vp, uint32_t seq, const struct timespec *deadline)
+{
+    return word_wait(&vp->seq, seq, deadline, &vp->waiter_lock,
+                     &vp->waiter_cv);
+}
+
+/*
+ * Notification fds
+ *
+ * Writers signal a var's notification fd, if it has one, after
+ * publishing a new version, but only the first write after
+ * thread_safe_var_notify_ack() does: later writes make no system calls
+ * until the next ack.
+ */
+static int
+notify_new(struct tsv_notify **np)
+{
+    struct tsv_notify *n;
+    int fds[2];
+    int err;
+
+    *np = NULL;
+    if ((n = calloc(1, sizeof(*n))) == NULL)
+        return errno;
+#ifdef __linux__
+    if ((n->rfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) != -1) {
+        n->wfd = n->rfd;
+        *np = n;
+        return 0;
+    }
+#endif
+    /* Elsewhere, or with no eventfd in this kernel, use a pipe */
+    if (pipe(fds) == -1) {
+        err = errno;
+        free(n);
+        return err;
+    }
+    n->rfd = fds[0];
+    n->wfd = fds[1];
+    if (fcntl(n->rfd, F_SETFL, O_NONBLOCK) == -1 ||
+        fcntl(n->wfd, F_SETFL, O_NONBLOCK) == -1 ||
+        fcntl(n->rfd, F_SETFD, FD_CLOEXEC) == -1 ||
+        fcntl(n->wfd, F_SETFD, FD_CLOEXEC) == -1) {
+        err = errno;
+        notify_close(n);
         return err;
     }
+    *np = n;
+    return 0;
+}
+
+static void
+notify_wake(thread_safe_var vp)
+{
+    struct tsv_notify *n;
+    uint64_t one = 1;
+
+    if ((n = atomic_read_ptr((volatile void **)&vp->notify)) == NULL ||
+        atomic_cas_32(&n->signalled, 0, 1) != 0)
+        return;
+    /* A full pipe or eventfd is readable already */
+    if (n->wfd == n->rfd)
+        (void) write(n->wfd, &one, sizeof(one));
+    else
+        (void) write(n->wfd, "", 1);
+}
+
+/* Queue a deferred callback; the caller holds the write_lock */
+static void
+defer_locked(thread_safe_var vp, struct tsv_deferred *d)
+{
+    struct tsv_deferred **p;
 
-    /* vp->next_version is stable because we hold the write_lock */
-    *new_version = wrapper->version = atomic_read_64(&vp->next_version);
+    for (p = &vp->deferred; *p != NULL && (*p)->version <= d->version;
+         p = &(*p)->next)
+        ;
+    d->next = *p;
+    *p = d;
+}
 
-    /* Grab the next slot */
-    v = vp->vars[(*new_version + 1) & 0x1].other;
-    old_wrapper = atomic_read_ptr((volatile void **)&v->wrapper);
+/*
+ * Link in a set for a version's derived results before it's published;
+ * the caller holds the write_lock.  A set left by a failed publish is
+ * reused.  Also outputs a callback to free the previous set, for once
+ * the version is published.
+ */
+static int
+derived_set_new(thread_safe_var vp, uint64_t version,
+                struct tsv_deferred **deferredp)
+{
+    struct tsv_derivations *d = vp->derived;
+    struct tsv_derived_set *set = d->newest;
+    struct tsv_derived_set *prev;
+    struct tsv_deferred *dfr = NULL;
+    int err;
 
-    if (*new_version == 0) {
-        /* This is the first write; set wrapper on both slots */
+    *deferredp = NULL;
+    prev = (set != NULL && set->version == version) ? set->older : set;
+    if (prev != NULL && (dfr = calloc(1, sizeof(*dfr))) == NULL)
+        return errno;
 
-        for (i = 0; i < sizeof(vp->vars)/sizeof(vp->vars[0]); i++) {
-            v = &vp->vars[i];
-            nref = atomic_inc_32_nv(&wrapper->nref);
-            v->version = 0;
-            /* This functions as a memory barrier for the above writes */
-            tmp = atomic_cas_ptr((volatile void **)&v->wrapper,
-                                 old_wrapper, wrapper);
-            assert(tmp == old_wrapper && tmp == NULL);
+    if (set == NULL || set->version != version) {
+        if ((set = calloc(1, sizeof(*set) +
+                             (d->n - 1) * sizeof(set->results[0]))) == NULL) {
+            err = errno;
+            free(dfr);
+            return err;
         }
+        set->derivations = d;
+        set->version = version;
+        (void) pthread_mutex_lock(&d->link_lock);
+        set->older = d->newest;
+        if (d->newest != NULL)
+            d->newest->newer = set;
+        atomic_write_ptr((volatile void **)&d->newest, set);
+        (void) pthread_mutex_unlock(&d->link_lock);
+    }
 
-        assert(nref > 1);
+    if (dfr != NULL) {
+        dfr->version = prev->version;
+        dfr->fn = derived_set_free;
+        dfr->arg = prev;
+    }
+    *deferredp = dfr;
+    return 0;
+}
 
-        tmp_version = atomic_inc_64_nv(&vp->next_version);
-        assert(tmp_version == 1);
+/* Run the deferred callbacks for versions older than the given one */
+static void
+run_deferred(thread_safe_var vp, uint64_t oldest)
+{
+    struct tsv_deferred *ready = NULL;
+    struct tsv_deferred **tailp = &ready;
 
-        /* Signal waiters */
-        (void) pthread_mutex_lock(&vp->waiter_lock);
-        (void) pthread_cond_signal(&vp->waiter_cv); /* no thundering herd */
-        (void) pthread_mutex_unlock(&vp->waiter_lock);
-        return pthread_mutex_unlock(&vp->write_lock);
+    if (pthread_mutex_lock(&vp->write_lock) != 0)
+        return;
+    while (vp->deferred != NULL && vp->deferred->version < oldest) {
+        *tailp = vp->deferred;
+        tailp = &vp->deferred->next;
+        vp->deferred = vp->deferred->next;
     }
+    *tailp = NULL;
+    (void) pthread_mutex_unlock(&vp->write_lock);
+    run_callbacks(ready);
+}
 
-    nref = atomic_inc_32_nv(&wrapper->nref);
-    assert(nref == 1);
+/* Take a var's write lock, giving up at the deadline, if any */
+static int
+lock_for_write(thread_safe_var vp, const struct timespec *deadline)
+{
+    if (deadline == NULL)
+        return pthread_mutex_lock(&vp->write_lock);
+    return pthread_mutex_timedlock(&vp->write_lock, deadline);
+}
 
-    assert(old_wrapper != NULL && atomic_read_32(&old_wrapper->nref) > 0);
+/* Publish a prepared write, if the current version is *expected */
+static int
+set_prepared(thread_safe_var vp, void *cookie, const uint64_t *expected,
+             const struct timespec *deadline, uint64_t *new_version)
+{
+    struct tsv_deferred *set_free = NULL;
+    void *garbage = NULL;
+    uint64_t version;
+    uint64_t oldest;
+    uint64_t vers;
+    int deferred;
+    int err;
 
-    /* Wait until that slot is quiescent before mutating it */
-    if ((err = pthread_mutex_lock(&vp->cv_lock)) != 0) {
-        (void) pthread_mutex_unlock(&vp->write_lock);
-        free(wrapper);
+    if (new_version == NULL)
+        new_version = &vers;
+    *new_version = 0;
+
+    if ((err = lock_for_write(vp, deadline)) != 0) {
+        vp->ops->abort(vp, cookie);
         return err;
     }
-    while (atomic_read_32(&v->nreaders) > 0) {
-        /*
-         * We have a separate lock for writing vs. waiting so that no
-         * other writer can steal our march.  All writers will enter,
-         * all writers will finish.  We got here by winning the race for
-         * the writer lock, so we'll hold onto it, and thus avoid having
-         * to restart here.
-         */
-        if ((err = pthread_cond_wait(&vp->cv, &vp->cv_lock)) != 0) {
-            (void) pthread_mutex_unlock(&vp->cv_lock);
-            (void) pthread_mutex_unlock(&vp->write_lock);
-            free(wrapper);
-            return err;
-        }
+
+    /* vp->version is stable because we hold the write_lock */
+    version = atomic_read_64(&vp->version) + 1;
+    if (expected != NULL && version - 1 != *expected) {
+        (void) pthread_mutex_unlock(&vp->write_lock);
+        vp->ops->abort(vp, cookie);
+        *new_version = version - 1;
+        return EAGAIN;
     }
-    if ((err = pthread_mutex_unlock(&vp->cv_lock)) != 0) {
+    if (vp->derived != NULL &&
+        (err = derived_set_new(vp, version, &set_free)) != 0) {
         (void) pthread_mutex_unlock(&vp->write_lock);
-        free(wrapper);
+        vp->ops->abort(vp, cookie);
         return err;
     }
+    if ((err = vp->ops->publish(vp, cookie, version, deadline,
+                                &garbage)) != 0) {
+        (void) pthread_mutex_unlock(&vp->write_lock);
+        vp->ops->abort(vp, cookie);
+        free(set_free);
+        return err;
+    }
+    if (set_free != NULL)
+        defer_locked(vp, set_free);
+    atomic_write_64(&vp->version, version);
+    (void) atomic_inc_64_nv(&generation);
+    (void) atomic_inc_32_nv(&vp->seq); /* Barrier before nwaiters read */
+    *new_version = version;
+    deferred = (vp->deferred != NULL);
 
-    /* Update that now quiescent slot; these are the release operations */
-    tmp = atomic_cas_ptr((volatile void **)&v->wrapper, old_wrapper, wrapper);
-    assert(tmp == old_wrapper);
-    v->version = *new_version;
-    tmp_version = atomic_inc_64_nv(&vp->next_version); /* Memory barrier */
-    assert(tmp_version == *new_version + 1);
-    assert(v->version > v->other->version);
-
-    /* Release the old cf */
-    assert(old_wrapper != NULL && atomic_read_32(&old_wrapper->nref) > 0);
-    wrapper_free(old_wrapper);
+    err = pthread_mutex_unlock(&vp->write_lock);
 
-    /* Done */
-    return pthread_mutex_unlock(&vp->write_lock);
-}
+    if (atomic_read_32(&vp->nwaiters) > 0)
+        version_wake(vp);
+    notify_wake(vp);
 
-#else /* USE_TSV_SLOT_PAIR_DESIGN */
+    /* Release old values now, holding no locks */
+    vp->ops->reclaim(vp, garbage);
 
-#include <sched.h>
+    /* Writes are when deferred callbacks get to run, if due */
+    if (deferred && tsv_oldest(vp, &oldest) == 0)
+        run_deferred(vp, oldest);
+    return err;
+}
 
-/*
- * Subscription Slot Design
- *
- * Here we have a linked list of extant values where the head has the
- * current value and where the head and the next pointers are the only
- * things written to by the writer; all readers "subscribe" and thence
- * their state consists of a single pointer to what was at read-time the
- * head of that linked list, with that pointer held where the writers
- * can find it (in "subscription" slots) so they can garbage collect in
- * order to release no-longer referenced values.
- *
- * Subscription is lock-less.  There's an index into a logical array of
- * subscription slots.  New reader threads increment a counter to
- * determine their index into this array.  If the array index goes past
- * the allocated array size, then the array is grown lock-less-ly.  The
- * array is maintained as a linked list of array chunks; when a reader
- * goes to grow it, it will either win a race to grow it or lose it,
- * using an atomic CAS operation to perform the growth; losers free
- * their chunk and then look for their slot in the winner's chunk and
- * possibly retry the array growth operation.
- *
- * Once subcribed, readers only ever do an acquire-fenced read on the
- * head of the linked list of values, and write that to their slot with
- * a release-fenced write.
- *
- * Writers only add new values at the head of the list, with the
- * previous head as the next pointer of the new element.
- *
- * Writers also mark-and-sweep garbage collect the extant value list by
- * reading every subscribed thread's pointer with an acquire-fenced
- * read, marking all in-use values as such, then the writer releases and
- * removes from the list those elements not marked as in-used.  Readers
- * never read the next pointers of the list's elements.
- *
- * Readers do two fenced memory operations.  Writers do N fenced memory
- * operations plus the writer lock acquire/release and any locks
- * required to allocate and free list elements.  Readers may have to
- * allocate the first time they read, but not thereafter.
+/**
+ * Set new data on a thread-safe global variable
+ *
+ * @param [in] var Pointer to thread-safe global variable
+ * @param [in] cfdata New value for the thread-safe global variable
+ * @param [out] new_version New version number
+ *
+ * @return 0 on success, or a system error such as ENOMEM.
  */
+int
+thread_safe_var_set(thread_safe_var vp, void *cfdata,
+                    uint64_t *new_version)
+{
+    return tsv_set(vp, cfdata, NULL, new_version);
+}
 
-/*
- * Design #2: Value list + per-reader thread slots.
- *
- * This design uses a list of referenced values and a set of slots, one per
- * thread that has read this thread-safe global variable.
+/**
+ * Set new data on a thread-safe global variable, giving up if that
+ * takes too long
  *
- * Readers "subscribe" the first time they read a thread-safe global variable,
- * allocating a slot.  Thereafter readers are very fast, using two fenced
- * memory operations to get the newest value of the thread-safe global
- * variable.
+ * Writers wait for other writers, and, in some designs (slot-pair and
+ * left-right), for readers to stop reading an old value.  This gives up
+ * waiting at the timeout, leaving the var as it was.
  *
- * Writers add new values to the head of a linked list, then garbage collect
- * the list by visiting all the reader subscription slots to mark the list then
- * sweep it.
+ * NUMA-replicated vars apply the timeout to every replica's write, but
+ * only a timeout on the first replica fails the set.  The first replica
+ * has the new value after that, so the write has happened, and readers
+ * on nodes whose replicas timed out read the first replica instead until
+ * a later write catches theirs up.
  *
- * Readers never ever block and never call into the allocator.  First time
- * readers are O(N), else they are O(1).  Compare to the two-slot design where
- * readers may block briefly but are always O(1).
+ * @param [in] var Pointer to thread-safe global variable
+ * @param [in] cfdata New value for the thread-safe global variable
+ * @param [in] timeout Pointer (may be NULL -> forever) to how long to wait
+ * @param [out] new_version Pointer (may be NULL) to new version number
  *
- * Writers are serialized but do not block while holding the lock.  Writers do
- * not call the allocator while holding the lock.  Writers are O(N).  Compare to
- * the two-slot design, where writers are O(1).
+ * @return 0 on success, ETIMEDOUT on timeout (the caller keeps cfdata),
+ * or a system error
  */
+int
+thread_safe_var_timed_set(thread_safe_var vp, void *cfdata,
+                          const struct timespec *timeout,
+                          uint64_t *new_version)
+{
+    struct timespec deadline;
 
-/* This is an element on the list of referenced values */
-struct value {
-    volatile struct value   *next;      /* previous (still ref'd) value */
-    void                    *value;     /* actual value */
-    volatile uint64_t       version;    /* version number */
-    volatile uint32_t       referenced; /* for mark and sweep */
-};
+    if (timeout == NULL)
+        return tsv_set(vp, cfdata, NULL, new_version);
 
-/*
- * Each thread that has read this thread-safe global variable gets one
- * of these.
- */
-struct slot {
-    volatile struct value       *value; /* reference to last value read */
-    volatile uint32_t           in_use; /* atomic */
-    thread_safe_var             vp;     /* for cleanup from thread key dtor */
-    /* We could add a pthread_t here */
-};
+    /* pthread_mutex_timedlock() and friends want CLOCK_REALTIME */
+    if (clock_gettime(CLOCK_REALTIME, &deadline) != 0)
+        return errno;
+    deadline.tv_sec += timeout->tv_sec;
+    deadline.tv_nsec += timeout->tv_nsec;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    return tsv_set(vp, cfdata, &deadline, new_version);
+}
 
-/*
- * Slots are allocated in arrays that are linked into one larger logical
- * array.
+/**
+ * Set new data on a thread-safe global variable if that can be done
+ * without waiting for other writers or for readers
+ *
+ * @param [in] var Pointer to thread-safe global variable
+ * @param [in] cfdata New value for the thread-safe global variable
+ * @param [out] new_version Pointer (may be NULL) to new version number
+ *
+ * @return 0 on success, EBUSY if the write would have had to wait (the
+ * caller keeps cfdata), or a system error
  */
-struct slots {
-    volatile struct slots   *next;      /* atomic */
-    struct slot             *slot_array;/* atomic */
-    volatile uint32_t       slot_count; /* atomic */
-    uint32_t                slot_base;  /* logical index of slot_array[0] */
-};
+int
+thread_safe_var_try_set(thread_safe_var vp, void *cfdata,
+                        uint64_t *new_version)
+{
+    static const struct timespec past = { 0, 0 };
+    int err;
 
-struct thread_safe_var_s {
-    pthread_key_t           tkey;           /* to detect thread exits */
-    pthread_mutex_t         write_lock;     /* one writer at a time */
-    pthread_mutex_t         waiter_lock;    /* to signal waiters */
-    pthread_cond_t          waiter_cv;      /* to signal waiters */
-    var_dtor_t              dtor;           /* value destructor */
-    volatile struct value   *values;        /* atomic ref'd value list head */
-    volatile struct slots   *slots;         /* atomic reader subscription slots */
-    volatile uint32_t       next_slot_idx;  /* atomic index of next new slot */
-    volatile uint32_t       slots_in_use;   /* atomic count of live readers */
-    uint32_t                nvalues;        /* writer-only; for housekeeping */
-};
+    if ((err = tsv_set(vp, cfdata, &past, new_version)) == ETIMEDOUT)
+        return EBUSY;
+    return err;
+}
 
-/*
- * Lock-less utility that scans through logical slot array looking for a
- * free slot to reuse.
+/**
+ * Set new data on a thread-safe global variable, counting its size
+ * against the var's retained-bytes budget (see thread_safe_var_attr)
+ * until it's destroyed.
+ *
+ * Values stay alive, and count against the budget, until no reader
+ * holds them.  A write that would take the var over budget while values
+ * older than the current one are still held does what the var's
+ * budget_policy says: it waits for readers to release them (as with
+ * thread_safe_var_synchronize(), which see), fails, or calls the
+ * var's over_budget() function (e.g., to tell readers to release) and
+ * writes anyway.  With no older values held there's nothing to wait
+ * for, and the write goes ahead even if the current and new values
+ * alone are over budget.  On vars with no budget this is just
+ * thread_safe_var_set().
+ *
+ * @param [in] var Pointer to thread-safe global variable
+ * @param [in] cfdata New value for the thread-safe global variable
+ * @param [in] size The new value's size, in bytes
+ * @param [out] new_version Pointer (may be NULL) to new version number
+ *
+ * @return 0 on success, ENOMEM if over budget (the caller keeps cfdata),
+ * or a system error
  */
-static struct slot *
-get_free_slot(thread_safe_var vp)
+int
+thread_safe_var_set_sized(thread_safe_var vp, void *cfdata, size_t size,
+                          uint64_t *new_version)
 {
-    struct slots *slots;
-    struct slot *slot;
-    size_t i;
+    struct tsv_budget *budget = vp->budget;
+    struct tsv_budget_charge *charge;
+    struct tsv_deferred *d;
+    uint64_t retained;
+    uint64_t current;
+    uint64_t oldest;
+    uint64_t vers;
+    int err;
+
+    if (budget == NULL)
+        return tsv_set(vp, cfdata, NULL, new_version);
+
+    if (new_version == NULL)
+        new_version = &vers;
+    *new_version = 0;
+
+    /* Allocate now so that a value, once written, always gets uncharged */
+    if ((charge = calloc(1, sizeof(*charge))) == NULL)
+        return errno;
+    if ((d = calloc(1, sizeof(*d))) == NULL) {
+        err = errno;
+        free(charge);
+        return err;
+    }
+    charge->budget = budget;
+    charge->size = size;
+    d->fn = budget_uncharge;
+    d->arg = charge;
+
+    if ((err = pthread_mutex_lock(&budget->write_lock)) != 0) {
+        free(d);
+        free(charge);
+        return err;
+    }
+    for (;;) {
+        /* Destroy what readers are done with, then count what's left */
+        current = atomic_read_64(&vp->version);
+        if ((err = tsv_oldest(vp, &oldest)) != 0)
+            break;
+        run_deferred(vp, oldest);
+        (void) pthread_mutex_lock(&budget->lock);
+        retained = budget->retained;
+        (void) pthread_mutex_unlock(&budget->lock);
+        if (retained + size <= budget->max || oldest >= current)
+            break;
 
-    for (slots = atomic_read_ptr((volatile void **)&vp->slots);
-         slots != NULL;
-         slots = atomic_read_ptr((volatile void **)&slots->next)) {
-        for (i = 0; i < slots->slot_count; i++) {
-            slot = &slots->slot_array[i];
-            if (atomic_cas_32(&slot->in_use, 0, 1) == 0)
-                return slot;
+        if (budget->policy == THREAD_SAFE_VAR_BUDGET_FAIL) {
+            err = ENOMEM;
+            break;
         }
+        if (budget->policy == THREAD_SAFE_VAR_BUDGET_NOTIFY) {
+            budget->over_budget(budget->over_budget_arg);
+            break;
+        }
+        /* Wait for the oldest value held to go, then count again */
+        if ((err = thread_safe_var_synchronize(vp, oldest + 1, NULL)) != 0)
+            break;
+    }
+
+    if (err == 0) {
+        budget_charge(budget, size, 0);
+        if ((err = tsv_set(vp, cfdata, NULL, new_version)) != 0)
+            budget_charge(budget, size, 1);
+    }
+    if (err == 0) {
+        /* Uncharge once this version is destroyed */
+        d->version = *new_version;
+        (void) pthread_mutex_lock(&vp->write_lock);
+        defer_locked(vp, d);
+        (void) pthread_mutex_unlock(&vp->write_lock);
+        d = NULL;
+        charge = NULL;
     }
-    return NULL;
+    (void) pthread_mutex_unlock(&budget->write_lock);
+    free(d);
+    free(charge);
+    return err;
 }
 
-/* Lock-less utility to get nth slot */
-static struct slot *
-get_slot(thread_safe_var vp, uint32_t slot_idx)
+/* Swap a pointer, outputting the old one */
+static void *
+swap_ptr(volatile void **p, void *v)
 {
-    struct slots *slots;
-    uint32_t nslots = 0;
+    void *old;
+
+    do {
+        old = atomic_read_ptr(p);
+    } while (atomic_cas_ptr(p, old, v) != old);
+    return old;
+}
+
+/**
+ * Set new data on a thread-safe global variable without waiting, where
+ * only the latest value matters.
+ *
+ * The value is left for whichever thread is publishing values set this
+ * way; if there's none, the caller becomes that thread.  The publisher
+ * publishes only the latest value left, and values superseded before
+ * they're published are destroyed with the var's destructor, so writers
+ * setting values faster than they can be published mostly don't
+ * publish them at all.
+ *
+ * The value belongs to the var once this is called: values that fail
+ * to be published are destroyed too.
+ *
+ * @param [in] vp Pointer to thread-safe global variable
+ * @param [in] cfdata New value for the thread-safe global variable
+ *
+ * @return 0 on success, or the system error from the first value that
+ * failed to publish while the caller was the publisher (which may be
+ * the caller's value or one left by another writer)
+ */
+int
+thread_safe_var_set_async(thread_safe_var vp, void *cfdata)
+{
+    void *old;
+    int err = 0;
+    int ret;
+
+    if (cfdata == NULL)
+        return EINVAL;
 
-    for (slots = atomic_read_ptr((volatile void **)&vp->slots);
-         slots != NULL;
-         slots = atomic_read_ptr((volatile void **)&slots->next)) {
-        nslots += slots->slot_count;
-        if (nslots > slot_idx)
+    if ((old = swap_ptr((volatile void **)&vp->pending, cfdata)) != NULL &&
+        vp->dtor != NULL)
+        vp->dtor(old);  /* superseded */
+
+    /*
+     * Whoever sees a pending value after the publisher stops publishing
+     * gets to publish it: either we become the publisher, or the
+     * publisher hasn't stopped yet and will look again.
+     */
+    while (atomic_cas_32(&vp->publishing, 0, 1) == 0) {
+        while ((cfdata = swap_ptr((volatile void **)&vp->pending,
+                                  NULL)) != NULL) {
+            if ((ret = thread_safe_var_set(vp, cfdata, NULL)) == 0)
+                continue;
+            if (vp->dtor != NULL)
+                vp->dtor(cfdata);
+            if (err == 0)
+                err = ret;
+        }
+        (void) atomic_cas_32(&vp->publishing, 1, 0);
+        if (atomic_read_ptr((volatile void **)&vp->pending) == NULL)
             break;
     }
+    return err;
+}
 
-    if (nslots <= slot_idx)
-        return NULL;
+/**
+ * Set new data on a thread-safe global variable if its current version
+ * is the expected one
+ *
+ * This allows optimistic read-modify-write updates: read the var, make
+ * a new value from the one read, and set it if the version read is
+ * still current, else retry.  Conflicts are detected with the write
+ * lock held, so no other lock is needed.
+ *
+ * @param [in] var Pointer to thread-safe global variable
+ * @param [in] expected_version Version that must be current (0 -> no value yet)
+ * @param [in] cfdata New value for the thread-safe global variable
+ * @param [out] new_version Pointer (may be NULL) to new version number, or, on conflict, the current version number
+ *
+ * @return 0 on success, EAGAIN if the current version is not the
+ * expected one (the caller keeps cfdata), or a system error
+ *
+ * On EAGAIN the calling thread's next read of a var with a staleness
+ * bound (see thread_safe_var_attr) reads the current value, so retry
+ * loops see the write they lost to.
+ */
+int
+thread_safe_var_set_if(thread_safe_var vp, uint64_t expected_version,
+                       void *cfdata, uint64_t *new_version)
+{
+    void *cookie = NULL;
+    uint64_t vers;
+    int err;
+
+    if (cfdata == NULL)
+        return EINVAL;
+
+    if (new_version == NULL)
+        new_version = &vers;
+    *new_version = 0;
+
+    /*
+     * Don't bother preparing a write that's already lost.  Readers can
+     * see a value before its write finishes, and so before vp->version
+     * catches up; the write lock waits for that, so only a newer version
+     * means we've lost.
+     */
+    if ((*new_version = atomic_read_64(&vp->version)) > expected_version) {
+        stale_expire(vp);
+        return EAGAIN;
+    }
 
-    assert(slot_idx - slots->slot_base < slots->slot_count);
-    return &slots->slot_array[slot_idx - slots->slot_base];
+    if ((err = setup(vp)) != 0)
+        return err;
+    if ((err = vp->ops->prepare(vp, cfdata, &cookie)) != 0)
+        return err;
+    if ((err = set_prepared(vp, cookie, &expected_version, NULL,
+                            new_version)) == EAGAIN)
+        stale_expire(vp);
+    return err;
 }
 
-/* Lock-less utility to grow the logical slot array */
-static int
-grow_slots(thread_safe_var vp, uint32_t slot_idx, int tries)
+/**
+ * Read-copy-update a thread-safe global variable
+ *
+ * Reads the current value, calls the given function to make a new value
+ * from it, and sets that if no other write happened in the meantime,
+ * else retries.  New values that lose to other writes are destroyed
+ * with the var's value destructor, so the function must always make a
+ * new value rather than, say, modify the current one.  No locks are
+ * held while the function runs.
+ *
+ * An update retries only when another write succeeds, so some writer
+ * always makes progress, but an updater can starve if other writers
+ * keep winning.
+ *
+ * Updates ignore the calling thread's staleness bound, if any (see
+ * thread_safe_var_attr): the function is given the current value.
+ *
+ * @param [in] var Pointer to thread-safe global variable
+ * @param [in] fn Function to make a new value from the current value
+ * @param [in] arg Argument for fn
+ * @param [out] new_version Pointer (may be NULL) to new version number
+ *
+ * @return 0 on success, the error returned by fn, or a system error
+ */
+int
+thread_safe_var_update(thread_safe_var vp, thread_safe_var_update_f fn,
+                       void *arg, uint64_t *new_version)
 {
-    uint32_t nslots = 0;
-    uint32_t additions;
-    uint32_t i;
-    volatile struct slots **slotsp;
-    struct slots *new_slots;
+    void *current;
+    void *data;
+    uint64_t version;
+    uint64_t vers;
+    int err;
 
-    for (slotsp = &vp->slots;
-         atomic_read_ptr((volatile void **)slotsp) != NULL;
-         slotsp = &((struct slots *)atomic_read_ptr((volatile void **)slotsp))->next)
-        nslots += (*slotsp)->slot_count;
+    if (new_version == NULL)
+        new_version = &vers;
+    *new_version = 0;
 
-    if (nslots > slot_idx)
-        return 0;
+    for (;;) {
+        /* Make the new value from the current one, not a stale one */
+        stale_expire(vp);
+        if ((err = thread_safe_var_get(vp, &current, &version)) != 0)
+            return err;
+        data = NULL;
+        if ((err = fn(arg, current, &data)) != 0)
+            return err;
+        if (data == NULL)
+            return EINVAL;
+        if ((err = thread_safe_var_set_if(vp, version, data,
+                                          new_version)) == 0)
+            return 0;
+        /* We lost, or failed; either way the new value is ours */
+        if (vp->dtor != NULL)
+            vp->dtor(data);
+        if (err != EAGAIN)
+            return err;
+    }
+}
 
-    if (tries < 1)
-        return EAGAIN; /* shouldn't happen; XXX assert? */
+/**
+ * Publish a write prepared with vp->ops->prepare()
+ *
+ * The cookie is consumed (aborted on failure).  Designs made of child
+ * TSVs use this to prepare writes to all the children before
+ * publishing any.
+ *
+ * @param [in] var Pointer to thread-safe global variable
+ * @param [in] cookie Output of vp->ops->prepare()
+ * @param [out] new_version Pointer (may be NULL) to new version number
+ *
+ * @return 0 on success, or a system error
+ */
+int
+tsv_set_prepared(thread_safe_var vp, void *cookie,
+                 const struct timespec *deadline, uint64_t *new_version)
+{
+    return set_prepared(vp, cookie, NULL, deadline, new_version);
+}
 
-    if ((new_slots = calloc(1, sizeof(*new_slots))) == NULL)
-        return errno;
+/**
+ * Set new data on a thread-safe global variable, giving up at the
+ * given deadline
+ *
+ * @param [in] var Pointer to thread-safe global variable
+ * @param [in] cfdata New value for the thread-safe global variable
+ * @param [in] deadline Pointer (may be NULL) to an absolute CLOCK_REALTIME time
+ * @param [out] new_version Pointer (may be NULL) to new version number
+ *
+ * @return 0 on success, ETIMEDOUT at the deadline, or a system error
+ */
+int
+tsv_set(thread_safe_var vp, void *cfdata, const struct timespec *deadline,
+        uint64_t *new_version)
+{
+    void *cookie = NULL;
+    uint64_t vers;
+    int err;
 
-    additions = (nslots == 0) ? 4 : nslots + nslots / 2;
-    while (slot_idx >= nslots + additions) {
-        additions += additions + additions / 2;
-        tries++;
-    }
-    assert(slot_idx - nslots < additions);
+    if (cfdata == NULL)
+        return EINVAL;
 
-    new_slots->slot_array = calloc(additions, sizeof(*new_slots->slot_array));
-    if (new_slots->slot_array == NULL) {
-        free(new_slots);
-        return errno;
-    }
-    new_slots->slot_count = additions;
-    new_slots->slot_base = nslots;
-    for (i = 0; i < additions; i++) {
-        new_slots->slot_array[i].in_use = 0;
-        new_slots->slot_array[i].value = 0;
-        new_slots->slot_array[i].vp = vp;
-    }
+    if (new_version == NULL)
+        new_version = &vers;
+    *new_version = 0;
 
-    /* Reserve the slot we wanted (new slots not added yet) */
-    atomic_write_32(&new_slots->slot_array[slot_idx - nslots].in_use, 1);
+    if ((err = setup(vp)) != 0)
+        return err;
 
-    /* Add new slots to logical array of slots */
-    if (atomic_cas_ptr((volatile void **)slotsp, NULL, new_slots) != NULL) {
-        /*
-         * We lost the race to grow the array.  The index we wanted is
-         * not guaranteed to be covered by the array as grown by the
-         * winner.  We fall through to recurse to repeat.
-         *
-         * See commentary above where tries is incremented.
-         */
-        free(new_slots->slot_array);
-        free(new_slots);
-        grow_slots(vp, slot_idx, tries);
-    }
+    /* Designs allocate here, not with the write lock held */
+    if ((err = vp->ops->prepare(vp, cfdata, &cookie)) != 0)
+        return err;
+    return tsv_set_prepared(vp, cookie, deadline, new_version);
+}
 
-    /*
-     * If we won the race to grow the array then the index we wanted is
-     * guaranteed to be present and recursing here is cheap.  If we lost
-     * the race we need to retry.  We could goto the top of the function
-     * though, just in case there's no tail call optimization.
-     */
-    return 0;
+/**
+ * Release a reference to a boxed value
+ *
+ * @param data [in] A struct tsv_box pointer, or NULL
+ */
+void
+tsv_box_release(void *data)
+{
+    struct tsv_box *box = data;
+
+    if (box == NULL)
+        return;
+    if (atomic_dec_32_nv(&box->nref) > 0)
+        return;
+    if (box->dtor != NULL)
+        box->dtor(box->value);
+    tsv_live_remove(&box->live);
+    free(box);
 }
 
-/* Utility to destroy a thread-safe global variable */
-static void
-destroy_var(thread_safe_var vp)
+/**
+ * Track a newly published value
+ *
+ * @param live [in] The var's live value tracker (vp->live)
+ * @param entry [in] The value's entry
+ * @param version [in] The value's version
+ */
+void
+tsv_live_add(struct tsv_live *live, struct tsv_live_entry *entry,
+             uint64_t version)
 {
-    struct slots *slots;
-    struct value *val;
+    entry->version = version;
+    entry->live = live;
+    entry->next = NULL;
+    (void) pthread_mutex_lock(&live->lock);
+    entry->prev = live->tail;
+    if (live->tail != NULL)
+        live->tail->next = entry;
+    else
+        live->head = entry;
+    live->tail = entry;
+    live->nref++;
+    (void) pthread_mutex_unlock(&live->lock);
+}
 
-    if (vp == 0)
+/**
+ * Stop tracking a value, once it's been destroyed
+ *
+ * @param entry [in] The value's entry (may never have been added)
+ */
+void
+tsv_live_remove(struct tsv_live_entry *entry)
+{
+    struct tsv_live *live = entry->live;
+    int was_oldest;
+
+    if (live == NULL)
         return;
+    entry->live = NULL;
 
-    pthread_mutex_lock(&vp->write_lock);
+    (void) pthread_mutex_lock(&live->lock);
+    was_oldest = (live->head == entry);
+    if (entry->prev != NULL)
+        entry->prev->next = entry->next;
+    else
+        live->head = entry->next;
+    if (entry->next != NULL)
+        entry->next->prev = entry->prev;
+    else
+        live->tail = entry->prev;
+    (void) pthread_mutex_unlock(&live->lock);
 
-    while (vp->values != NULL) {
-        val = atomic_read_ptr((volatile void **)&vp->values);
-        vp->values = val->next;
-        if (vp->dtor != NULL)
-            vp->dtor(val->value);
-        free(val);
+    if (was_oldest)
+        tsv_sync_notify();
+    live_put(live);
+}
+
+/* Oldest tracked live version, or UINT64_MAX */
+static uint64_t
+live_oldest(struct tsv_live *live)
+{
+    uint64_t oldest = UINT64_MAX;
+
+    (void) pthread_mutex_lock(&live->lock);
+    if (live->head != NULL)
+        oldest = live->head->version;
+    (void) pthread_mutex_unlock(&live->lock);
+    return oldest;
+}
+
+/**
+ * Wake synchronizers, if there are any, after dropping a reference
+ */
+void
+tsv_sync_notify(void)
+{
+    if (atomic_read_32(&nsyncers) == 0)
+        return;
+    (void) atomic_inc_32_nv(&sync_seq);
+    word_wake(&sync_seq, &sync_lock, &sync_cv);
+}
+
+/**
+ * Find the oldest live version of a var
+ *
+ * Designs drop any references the var itself holds to values no reader
+ * holds, so those get destroyed first.
+ *
+ * @param vp [in] A thread-safe global variable
+ * @param oldest [out] Oldest version still referenced (UINT64_MAX if none)
+ *
+ * @return Zero on success, else a system error
+ */
+int
+tsv_oldest(thread_safe_var vp, uint64_t *oldest)
+{
+    void *garbage = NULL;
+    uint64_t live;
+    int err;
+
+    *oldest = UINT64_MAX;
+    if (atomic_read_ptr((volatile void **)&vp->ops) == NULL)
+        return 0;   /* never written */
+    if ((err = pthread_mutex_lock(&vp->write_lock)) != 0)
+        return err;
+    *oldest = vp->ops->oldest(vp, &garbage);
+    err = pthread_mutex_unlock(&vp->write_lock);
+    vp->ops->reclaim(vp, garbage);
+
+    live = live_oldest(vp->live);
+    if (live < *oldest)
+        *oldest = live;
+    return err;
+}
+
+/**
+ * Wait for a var to have its first value set.
+ *
+ * All waiters are woken at once by the first write (see
+ * thread_safe_var_wait_version()).
+ *
+ * @param vp [in] The vp to wait for
+ *
+ * @return Zero on success, else a system error
+ */
+int
+thread_safe_var_wait(thread_safe_var vp)
+{
+    return thread_safe_var_wait_version(vp, 1, NULL);
+}
+
+/**
+ * Wait for a var to have a value of at least the given version.
+ *
+ * Waiters block in the kernel (they don't poll) and writers wake them
+ * when they publish a new version.  Pass the last version seen plus one
+ * to wait for a new value.
+ *
+ * @param vp [in] The vp to wait for
+ * @param min_version [in] The version to wait for
+ * @param timeout [in] Pointer (may be NULL -> forever) to how long to wait
+ *
+ * @return Zero on success, ETIMEDOUT on timeout, else a system error
+ */
+int
+thread_safe_var_wait_version(thread_safe_var vp, uint64_t min_version,
+                             const struct timespec *timeout)
+{
+    struct timespec deadline;
+    uint32_t seq;
+    int err = 0;
+
+    if (atomic_read_64(&vp->version) >= min_version)
+        return 0;
+
+    if (timeout != NULL && (err = make_deadline(timeout, &deadline)) != 0)
+        return err;
+
+    (void) atomic_inc_32_nv(&vp->nwaiters);
+    for (;;) {
+        seq = atomic_read_32(&vp->seq);
+        if (atomic_read_64(&vp->version) >= min_version) {
+            err = 0;
+            break;
+        }
+        if ((err = version_wait(vp, seq,
+                                timeout == NULL ? NULL : &deadline)) != 0)
+            break;
     }
-    while (vp->slots != NULL) {
-        slots = atomic_read_ptr((volatile void **)&vp->slots);
-        vp->slots = slots->next;
-        free(slots->slot_array);
-        free(slots);
+    (void) atomic_dec_32_nv(&vp->nwaiters);
+
+    if (err == ETIMEDOUT && atomic_read_64(&vp->version) >= min_version)
+        return 0;
+    return err;
+}
+
+/**
+ * Get a file descriptor that becomes readable when a var is set, for
+ * event loops (select(), poll(), epoll, kqueue) that can't block in
+ * thread_safe_var_wait_version().
+ *
+ * The fd is an eventfd on Linux, else the read end of a pipe.  It
+ * belongs to the var (don't read or close it) and is closed when the
+ * var is destroyed.  Writes coalesce: after the first write makes the
+ * fd readable, it stays readable until thread_safe_var_notify_ack(),
+ * and later writes make no system calls.  Every call returns the same
+ * fd.
+ *
+ * @param vp [in] A thread-safe global variable
+ * @param fd [out] The notification fd
+ *
+ * @return Zero on success, else a system error
+ */
+int
+thread_safe_var_notify_fd(thread_safe_var vp, int *fd)
+{
+    struct tsv_notify *n;
+    int err;
+
+    *fd = -1;
+    if ((n = atomic_read_ptr((volatile void **)&vp->notify)) != NULL) {
+        *fd = n->rfd;
+        return 0;
     }
-    vp->dtor = NULL;
 
-    pthread_mutex_unlock(&vp->write_lock);
-    pthread_mutex_destroy(&vp->write_lock);
-    pthread_mutex_destroy(&vp->waiter_lock);
-    pthread_cond_destroy(&vp->waiter_cv);
-    /* XXX We leak var->tkey! */
+    if ((err = pthread_mutex_lock(&vp->write_lock)) != 0)
+        return err;
+    if ((n = vp->notify) == NULL && (err = notify_new(&n)) == 0)
+        atomic_write_ptr((volatile void **)&vp->notify, n);
+    (void) pthread_mutex_unlock(&vp->write_lock);
+    if (err == 0)
+        *fd = n->rfd;
+    return err;
 }
 
-/* Thread specific key destructor for handling thread exit */
+/**
+ * Acknowledge a var's notification fd, making it not readable until
+ * the var is next set.
+ *
+ * Call this when the fd polls readable, then read the var: writes that
+ * race with this either signal the fd again or are seen by that read.
+ *
+ * @param vp [in] A thread-safe global variable
+ */
 void
-release_slot(void *data)
+thread_safe_var_notify_ack(thread_safe_var vp)
 {
-    struct slot *slot = data;
+    struct tsv_notify *n;
+    char buf[64];
 
-    if (slot == NULL)
+    if ((n = atomic_read_ptr((volatile void **)&vp->notify)) == NULL)
         return;
+    /* Drain, then ack, so that a racing write isn't lost in the drain */
+    while (read(n->rfd, buf, sizeof(buf)) > 0)
+        ;
+    (void) atomic_cas_32(&n->signalled, 1, 0);
+}
+
+/**
+ * Wait until no reader holds a value of a var older than the given
+ * version.
+ *
+ * This is what a writer needs to know before it can tear down anything
+ * the old values refer to but don't own.  Pass the version returned by
+ * thread_safe_var_set() to wait for all the values it replaced.
+ *
+ * The caller's own reference, if any, is released first, except that
+ * callers that read QSBR vars must call thread_safe_var_quiescent()
+ * first, else they might wait for themselves.  Readers' references are
+ * released when they read the var again or call
+ * thread_safe_var_release() (or, for QSBR vars,
+ * thread_safe_var_quiescent()), so this can wait forever for readers
+ * that do neither; use a timeout if that matters.
+ *
+ * Old values are destroyed by the time this returns zero, and deferred
+ * callbacks that are due have been run (see thread_safe_var_defer()).
+ * Readers don't take locks just to let synchronizers know, so
+ * synchronizers may notice a release a few milliseconds late.
+ *
+ * @param vp [in] A thread-safe global variable
+ * @param version [in] The oldest version readers may still hold
+ * @param timeout [in] Pointer (may be NULL -> forever) to how long to wait
+ *
+ * @return Zero on success, ETIMEDOUT on timeout, else a system error
+ */
+int
+thread_safe_var_synchronize(thread_safe_var vp, uint64_t version,
+                            const struct timespec *timeout)
+{
+    static const struct timespec poll_interval = { 0, TSV_SYNC_POLL_NS };
+    struct timespec deadline;
+    struct timespec poll;
+    uint64_t oldest;
+    uint32_t seq;
+    int last = 0;
+    int err = 0;
 
-    /* Release value */
-    atomic_write_ptr((volatile void **)&slot->value, NULL);
+    if (timeout != NULL && (err = make_deadline(timeout, &deadline)) != 0)
+        return err;
 
-    /* Release slot */
-    atomic_write_32(&slot->in_use, 0);
+    thread_safe_var_release(vp);
 
-    /*
-     * If the thread-safe global was destroyed while we held the last
-     * slot then it falls to us to complete the destruction.
-     */
-    if (atomic_dec_32_nv(&slot->vp->slots_in_use) == 0)
-        destroy_var(slot->vp);
+    (void) atomic_inc_32_nv(&nsyncers);
+    for (;;) {
+        seq = atomic_read_32(&sync_seq);
+        if ((err = tsv_oldest(vp, &oldest)) != 0)
+            break;
+        if (oldest >= version) {
+            run_deferred(vp, oldest);
+            break;
+        }
+        if (last) {
+            err = ETIMEDOUT;
+            break;
+        }
+        if ((err = make_deadline(&poll_interval, &poll)) != 0)
+            break;
+        if (timeout != NULL &&
+            (deadline.tv_sec < poll.tv_sec ||
+             (deadline.tv_sec == poll.tv_sec &&
+              deadline.tv_nsec <= poll.tv_nsec))) {
+            poll = deadline;
+            last = 1;
+        }
+        err = word_wait(&sync_seq, seq, &poll, &sync_lock, &sync_cv);
+        if (err != 0 && err != ETIMEDOUT)
+            break;
+        /* Check once more at the deadline before giving up */
+        if (err == 0)
+            last = 0;
+    }
+    (void) atomic_dec_32_nv(&nsyncers);
+    return err;
 }
 
 /**
- * Initialize a thread-safe global variable
+ * Defer a call until no reader holds the given version of a var, or any
+ * older one.
  *
- * A thread-safe global variable stores a current value, a pointer to
- * void, which may be set and read.  A value read from a thread-safe
- * global variable will be valid in the thread that read it, and will
- * remain valid until released or until the thread-safe global variable
- * is read again in the same thread.  New values may be set.  Values
- * will be destroyed with the destructor provided when no references
- * remain.
+ * This is for releasing things that values refer to but don't own, such
+ * as a value's share of a resource that the next value doesn't use:
+ * set the next value, then defer the release to when readers are done
+ * with the version that was current.  Neither the caller nor readers
+ * wait.
  *
- * @param var Pointer to thread-safe global variable
- * @param dtor Pointer to thread-safe global value destructor function
+ * Due callbacks run in batches, in version order, at the end of later
+ * writes to the var, or in thread_safe_var_synchronize(), or when the
+ * var is destroyed, in the thread doing that and holding no locks.  So
+ * if there are no more writes, a callback can be left pending until the
+ * var is destroyed unless something calls thread_safe_var_synchronize().
+ * A callback for a version that readers are already done with runs
+ * right away, in the calling thread, after any others that are due.
  *
- * @return Returns zero on success, else a system error number
+ * @param vp [in] A thread-safe global variable
+ * @param version [in] The version readers must be done with
+ * @param fn [in] The function to call
+ * @param arg [in] The argument for fn
+ *
+ * @return Zero on success, else a system error
  */
 int
-thread_safe_var_init(thread_safe_var *vpp,
-                     thread_safe_var_dtor_f dtor)
+thread_safe_var_defer(thread_safe_var vp, uint64_t version,
+                      thread_safe_var_defer_f fn, void *arg)
 {
-    thread_safe_var vp;
+    struct tsv_deferred *d;
+    uint64_t oldest;
     int err;
 
-    *vpp = NULL;
-    if ((vp = calloc(1, sizeof(*vp))) == NULL)
-        return errno;
-
-    vp->values = NULL;
-    vp->slots = NULL;
-    vp->dtor = dtor;
-    vp->slots_in_use = 1; /* decremented upon destruction */
-    vp->nvalues = 0;
+    if (fn == NULL)
+        return EINVAL;
 
-    if ((err = pthread_key_create(&vp->tkey, release_slot)) != 0) {
-        memset(vp, 0, sizeof(*vp));
-        return err;
-    }
-    if ((err = pthread_mutex_init(&vp->write_lock, NULL)) != 0) {
-        memset(vp, 0, sizeof(*vp));
-        return err;
-    }
-    if ((err = pthread_mutex_init(&vp->waiter_lock, NULL)) != 0) {
-        pthread_mutex_destroy(&vp->write_lock);
-        memset(vp, 0, sizeof(*vp));
-        return err;
-    }
-    if ((err = pthread_cond_init(&vp->waiter_cv, NULL)) != 0) {
-        pthread_mutex_destroy(&vp->write_lock);
-        pthread_mutex_destroy(&vp->waiter_lock);
-        memset(vp, 0, sizeof(*vp));
-        return err;
+    /* Only versions older than the current one can be done with */
+    if (version < atomic_read_64(&vp->version) &&
+        tsv_oldest(vp, &oldest) == 0 && version < oldest) {
+        run_deferred(vp, oldest);
+        fn(arg);
+        return 0;
     }
 
-    if ((err = grow_slots(vp, 3, 1)) != 0) {
-        thread_safe_var_destroy(vp);
+    if ((d = calloc(1, sizeof(*d))) == NULL)
+        return errno;
+    d->version = version;
+    d->fn = fn;
+    d->arg = arg;
+
+    if ((err = pthread_mutex_lock(&vp->write_lock)) != 0) {
+        free(d);
         return err;
     }
-
-    assert(get_slot(vp, 0) != NULL);
-
-    /*
-     * Acquiring and dropping the lock functions as a trivial memory
-     * barrier.
-     */
-    pthread_mutex_lock(&vp->write_lock);
-    *vpp = vp;
-    pthread_mutex_unlock(&vp->write_lock);
-    *vpp = vp;
-    return 0;
+    defer_locked(vp, d);
+    return pthread_mutex_unlock(&vp->write_lock);
 }
 
 /**
- * Destroy a thread-safe global variable
+ * Add a derivation to a var: something that readers need to compute
+ * from each value (e.g., a compiled form or an index of it), computed
+ * once per version by the first reader to ask for it with
+ * thread_safe_var_get_derived() rather than once per reader, and
+ * destroyed with the given destructor once no reader holds that version.
  *
- * It is the caller's responsibility to ensure that no thread is using
- * this var and that none will use it again.
+ * Derivations must be added before the var's first value is set.
+ * Destroying a statically-initialized var removes its derivations.
  *
- * @param [in] var The thread-safe global variable to destroy
+ * @param vp [in] A thread-safe global variable
+ * @param fn [in] The derivation function
+ * @param dtor [in] Destructor (may be NULL) for derived results
+ * @param arg [in] The argument for fn
+ * @param keyp [out] Key for thread_safe_var_get_derived()
+ *
+ * @return Zero on success, EBUSY if the var has a value, else a system
+ * error
  */
-void
-thread_safe_var_destroy(thread_safe_var vp)
+int
+thread_safe_var_derive(thread_safe_var vp, thread_safe_var_derive_f fn,
+                       thread_safe_var_dtor_f dtor, void *arg, size_t *keyp)
 {
-    if (vp == 0)
-        return;
-    if (atomic_dec_32_nv(&vp->slots_in_use) > 0)
-        return;     /* defer to last reader slot release via thread key dtor */
-    destroy_var(vp);/* we're the last, destroy now */
+    struct tsv_derivations *d;
+    struct tsv_derivation *fns;
+    int err;
+
+    if (fn == NULL)
+        return EINVAL;
+    if ((err = setup(vp)) != 0 ||
+        (err = pthread_mutex_lock(&vp->write_lock)) != 0)
+        return err;
+    if (atomic_read_64(&vp->version) != 0) {
+        (void) pthread_mutex_unlock(&vp->write_lock);
+        return EBUSY;
+    }
+    if ((d = vp->derived) == NULL) {
+        if ((d = calloc(1, sizeof(*d))) == NULL) {
+            err = errno;
+            (void) pthread_mutex_unlock(&vp->write_lock);
+            return err;
+        }
+        if ((err = pthread_mutex_init(&d->link_lock, NULL)) != 0) {
+            free(d);
+            (void) pthread_mutex_unlock(&vp->write_lock);
+            return err;
+        }
+        if ((err = pthread_mutex_init(&d->derive_lock, NULL)) != 0) {
+            pthread_mutex_destroy(&d->link_lock);
+            free(d);
+            (void) pthread_mutex_unlock(&vp->write_lock);
+            return err;
+        }
+        vp->derived = d;
+    }
+    if ((fns = realloc(d->fns, (d->n + 1) * sizeof(*fns))) == NULL) {
+        err = errno;
+        (void) pthread_mutex_unlock(&vp->write_lock);
+        return err;
+    }
+    fns[d->n].fn = fn;
+    fns[d->n].dtor = dtor;
+    fns[d->n].arg = arg;
+    d->fns = fns;
+    *keyp = d->n++;
+    return pthread_mutex_unlock(&vp->write_lock);
 }
 
 /**
- * Get the most up to date value of the given cf var.
+ * Get a var's value's derived result for the given derivation (see
+ * thread_safe_var_derive()), deriving it if no reader has yet.
  *
- * @param [in] var Pointer to a cf var
- * @param [out] res Pointer to location where the variable's value will be output
- * @param [out] version Pointer (may be NULL) to 64-bit integer where the current version will be output
+ * This reads the var like thread_safe_var_get(), and the result is
+ * valid for as long as the value read is.
  *
- * @return Zero on success, a system error code otherwise
+ * @param vp [in] A thread-safe global variable
+ * @param key [in] A key output by thread_safe_var_derive()
+ * @param res [out] The derived result (NULL if the var has no value)
+ * @param version [out] Pointer (may be NULL) to the value's version
+ *
+ * @return Zero on success, else an error from the derivation function
+ * or a system error
  */
 int
-thread_safe_var_get(thread_safe_var vp, void **res, uint64_t *version)
+thread_safe_var_get_derived(thread_safe_var vp, size_t key, void **res,
+                            uint64_t *version)
 {
-    int err = 0;
-    uint32_t slot_idx;
-    uint32_t slots_in_use;
+    struct tsv_derivations *d;
+    struct tsv_derived_set *set;
+    struct tsv_derived *r;
     uint64_t vers;
-    struct slot *slot;
-    struct value *newest;
+    void *value;
+    int err;
 
     if (version == NULL)
         version = &vers;
-    *version = 0;
     *res = NULL;
+    if ((err = thread_safe_var_get(vp, &value, version)) != 0 ||
+        *version == 0)
+        return err;
 
-    if ((slot = pthread_getspecific(vp->tkey)) == NULL) {
-        /* First time for this thread -> O(N) slow path (subscribe thread) */
-        slot_idx = atomic_inc_32_nv(&vp->next_slot_idx) - 1;
-        if ((slot = get_free_slot(vp)) == NULL) {
-            /* Slower path still: grow slots array list */
-            err = grow_slots(vp, slot_idx, 2);  /* O(log N) */
-            assert(err == 0);
-            slot = get_slot(vp, slot_idx);      /* O(N) */
-            assert(slot != NULL);
-            atomic_write_32(&slot->in_use, 1);
-        }
-        assert(slot->vp == vp);
-        slots_in_use = atomic_inc_32_nv(&vp->slots_in_use);
-        assert(slots_in_use > 1);
-        if ((err = pthread_setspecific(vp->tkey, slot)) != 0)
+    /* Derivations were set up before any value was published */
+    if ((d = vp->derived) == NULL || key >= d->n)
+        return EINVAL;
+    for (set = atomic_read_ptr((volatile void **)&d->newest);
+         set != NULL && set->version != *version;
+         set = atomic_read_ptr((volatile void **)&set->older))
+        ;
+    if (set == NULL)
+        return ENOENT;  /* can't happen */
+
+    r = &set->results[key];
+    if (!atomic_read_32(&r->done)) {
+        if ((err = pthread_mutex_lock(&d->derive_lock)) != 0)
+            return err;
+        if (!r->done &&
+            (err = d->fns[key].fn(d->fns[key].arg, value,
+                                  &r->result)) == 0)
+            atomic_write_32(&r->done, 1);
+        (void) pthread_mutex_unlock(&d->derive_lock);
+        if (err != 0)
             return err;
     }
-
-    /*
-     * Else/then fast path: one acquire read, one release write, no
-     * free()s.  O(1).
-     *
-     * We have to loop because we could read one value in the
-     * conditional and that value could get freed if a writer runs
-     * between the read in the conditional and the assignment to
-     * slot->value with no other readers also succeeding in capturing
-     * that value before that writer completes.
-     *
-     * This loop will run just once if there are no writers, and will
-     * run as many times as writers can run between the conditional and
-     * the body.  This loop can only be an infinite loop if there's an
-     * infinite number of writers who run with higher priority than this
-     * thread.  This is why writers sched_yield() before dropping their
-     * write lock.
-     *
-     * Note that in the body of this loop we can write a soon-to-become-
-     * invalid value to our slot because many writers can write between
-     * the loop condition and the body.  The writer has to jump through
-     * some hoops to deal with this.
-     */
-    while (atomic_read_ptr((volatile void **)&slot->value) !=
-           (newest = atomic_read_ptr((volatile void **)&vp->values)))
-        atomic_write_ptr((volatile void **)&slot->value, newest);
-
-    if (newest != NULL) {
-        *res = newest->value;
-        *version = newest->version;
-    }
-
+    *res = r->result;
     return 0;
 }
 
-/**
- * Release this thread's reference (if it holds one) to the current
- * value of the given thread-safe global variable.
+/*
+ * Plain-old-data (POD) TSVs
  *
- * @param vp [in] A thread-safe global variable
+ * For small, fixed-size values (a few counters, thresholds, and so on)
+ * the pointer, wrapper, reference counting, and value destructor
+ * machinery of TSVs is pure overhead.  Instead, a POD TSV holds a copy
+ * of the value, and readers copy it out under a sequence lock: no
+ * allocation, no reference counts, no thread-specifics, and nothing is
+ * left pinned by readers.
+ *
+ * The sequence counter is odd while a writer is updating the value in
+ * place.  Readers read the counter, copy the value, then re-read the
+ * counter, retrying if a writer was or may have been active.  Readers
+ * may spin briefly while racing with a writer, but writers, which are
+ * serialized, never wait for readers.  The version of a POD TSV's value
+ * is half its sequence counter.
  */
-void
-thread_safe_var_release(thread_safe_var vp)
-{
-    struct slot *slot;
-
-    /* Always fast; never free()s.  O(1) */
-    if ((slot = pthread_getspecific(vp->tkey)) == NULL)
-        return;
-    atomic_write_ptr((volatile void **)&slot->value, NULL);
-    atomic_write_32(&slot->in_use, 0);
-}
-
-static volatile struct value *mark_values(thread_safe_var);
+struct thread_safe_pod_var_s {
+    pthread_mutex_t     write_lock; /* one writer at a time */
+    volatile uint64_t   seq;        /* atomic; odd -> write in progress */
+    size_t              size;       /* size of value */
+    unsigned char       *data;      /* value; follows this struct */
+};
 
 /**
- * Set new data on a thread-safe global variable
+ * Initialize a POD thread-safe global variable
  *
- * @param [in] var Pointer to thread-safe global variable
- * @param [in] cfdata New value for the thread-safe global variable
- * @param [out] new_version New version number
+ * The initial value is all zero bytes, with version zero.
  *
- * @return 0 on success, or a system error such as ENOMEM.
+ * @param vpp Pointer to POD thread-safe global variable
+ * @param size Size of the variable's value
+ *
+ * @return Returns zero on success, else a system error number
  */
 int
-thread_safe_var_set(thread_safe_var vp, void *data,
-                    uint64_t *new_version)
+thread_safe_var_init_pod(thread_safe_pod_var *vpp, size_t size)
 {
-    struct value *new_value;
-    volatile struct value *old_values = NULL;
-    volatile struct value *value;
-    uint64_t vers;
+    thread_safe_pod_var vp;
     int err;
 
-    if (new_version == NULL)
-        new_version = &vers;
-    *new_version = 0;
-
-    if ((new_value = calloc(1, sizeof(*new_value))) == NULL)
+    *vpp = NULL;
+    if (size == 0)
+        return EINVAL;
+    if ((vp = calloc(1, sizeof(*vp) + size)) == NULL)
         return errno;
-
-    if ((err = pthread_mutex_lock(&vp->write_lock)) != 0) {
-        free(new_value);
+    if ((err = pthread_mutex_init(&vp->write_lock, NULL)) != 0) {
+        free(vp);
         return err;
     }
+    vp->seq = 0;
+    vp->size = size;
+    vp->data = (unsigned char *)(vp + 1);
 
     /*
-     * No allocations/free()s done with write lock held -> higher write
-     * throughput.
-     */
-
-    new_value->value = data;
-    new_value->next = atomic_read_ptr((volatile void **)&vp->values);
-    if (new_value->next == NULL)
-        new_value->version = 1;
-    else
-        new_value->version = new_value->next->version + 1;
-
-    *new_version = new_value->version;
-
-    /* Publish the new value */
-    atomic_write_ptr((volatile void **)&vp->values, new_value);
-    vp->nvalues++;
-
-    if (*new_version < 2) {
-        /* Signal waiters */
-        (void) pthread_mutex_lock(&vp->waiter_lock);
-        (void) pthread_cond_signal(&vp->waiter_cv); /* no thundering herd */
-        (void) pthread_mutex_unlock(&vp->waiter_lock);
-    }
-
-    /* Now comes the slow part: garbage collect vp->values */
-    old_values = mark_values(vp);
-
-    /*
-     * Because readers must loop, and could be kept from reading by a
-     * long sequence of back-to-back higher-priority writers (presumably
-     * all threads of a process will run with the same priority, but we
-     * don't know that here), we yield the CPU before releasing the
-     * write lock.  Hopefully we yield to a reader.
+     * Acquiring and dropping the lock functions as a trivial memory
+     * barrier.
      */
-    sched_yield();
-    err = pthread_mutex_unlock(&vp->write_lock);
-
-    /* Free old values now, holding no locks */
-    for (value = old_values; value != NULL; value = old_values) {
-        if (vp->dtor)
-            vp->dtor(value->value);
-        old_values = value->next;
-        free((void *)value);
-    }
-    return err;
-}
-
-int
-value_cmp(const void *a, const void *b)
-{
-    if (*(const struct value **)a < *(const struct value **)b)
-        return -1;
-    if (*(const struct value **)a > *(const struct value **)b)
-        return 1;
+    pthread_mutex_lock(&vp->write_lock);
+    *vpp = vp;
+    pthread_mutex_unlock(&vp->write_lock);
     return 0;
 }
 
-volatile struct value *
-value_binary_search(volatile struct value **seen, size_t n, volatile struct value *v)
+/**
+ * Destroy a POD thread-safe global variable
+ *
+ * It is the caller's responsibility to ensure that no thread is using
+ * this var and that none will use it again.
+ *
+ * @param [in] vp The POD thread-safe global variable to destroy
+ */
+void
+thread_safe_var_destroy_pod(thread_safe_pod_var vp)
 {
-    size_t left = 0;
-
-    while (n > left) {
-        size_t mid;
-
-        /* Two or more array elements */
-        mid = (left + n - 1) >> 1;
-        if (seen[mid] < v)
-            left = mid + 1; /* search right */
-        else if (seen[mid] > v)
-            n = mid;        /* search left */
-        else
-            return v; /* seen[mid] == v -> so we found v */
-    }
-    return NULL;
+    if (vp == NULL)
+        return;
+    pthread_mutex_destroy(&vp->write_lock);
+    free(vp);
 }
 
-/* Mark half of mark-and-sweep GC */
-static volatile struct value *
-mark_values(thread_safe_var vp)
+/**
+ * Copy out the current value of a POD thread-safe global variable
+ *
+ * @param [in] vp A POD thread-safe global variable
+ * @param [out] buf Buffer of the variable's size to copy the value into
+ * @param [out] version Pointer (may be NULL) to 64-bit integer where the current version will be output
+ *
+ * @return Zero on success, a system error code otherwise
+ */
+int
+thread_safe_var_get_copy(thread_safe_pod_var vp, void *buf,
+                         uint64_t *version)
 {
-    volatile struct value **old_values_array;
-    volatile struct value * volatile *p;
-    volatile struct value *old_values = NULL;
-    volatile struct value *v, *v2;
-    volatile struct slots *slots;
-    struct slot *slot;
-    size_t i;
-
-    old_values_array = calloc(vp->nvalues, sizeof(old_values_array[0]));
-
-    /*
-     * XXX There should be no need to atomically read vp->values here,
-     * as we are the writer and hold a lock.
-     */
-    for (i = 0, v = atomic_read_ptr((volatile void **)&vp->values);
-         i < vp->nvalues && v != NULL;
-         v = v->next, i++)
-        old_values_array[i] = v;
-    assert(i == vp->nvalues && v == NULL);
-    qsort(old_values_array, vp->nvalues, sizeof(old_values_array[0]),
-          value_cmp);
-    /* Assert that qsort() sorted */
-    for (i = 1; i < vp->nvalues; i++)
-        assert(old_values_array[i-1] < old_values_array[i]);
-
-    /*
-     * Mark. This is O(N log(M)) where N is the number of subscribed
-     * threads and M is the number of values, but with the optimizations
-     * below, and with a bit of luck, this is more like O(N) than like
-     * O(N log(M)).
-     */
-    vp->values->referenced = 1; /* curr value is always in use */
-
-    for (i = 0, slots = atomic_read_ptr((volatile void **)&vp->slots);
-         slots != NULL;
-         i++) {
-        assert(slots != NULL);
-        assert(i >= slots->slot_base);
-        assert(i <= slots->slot_base + slots->slot_count);
-        if (i == slots->slot_base + slots->slot_count) {
-            slots = slots->next;
-            if (slots == NULL)
-                break;
-        }
-        assert(slots->slot_count > 0);
-        assert(i >= slots->slot_base);
-        assert(i < slots->slot_base + slots->slot_count);
-        slot = &slots->slot_array[i - slots->slot_base];
-        v = atomic_read_ptr((volatile void **)&slot->value);
-
-        /*
-         * Optimization: ignore slots with a NULL value.  The owner of
-         * that slot may be about to write a value that we're about to
-         * free, but they will notice that multiple writers went by and
-         * re-read vp->value.
-         *
-         * Also ignore slots with the current value.
-         */
-        if (v == NULL || v == vp->values)
-            continue;
+    uint64_t seq;
 
-        /*
-         * We can't just dereference v->referenced because there's a
-         * window in the get-side where we can set the slot's value to
-         * an immediately-after free()'ed value, and we could be seeing
-         * such a value, which means we can't dereference it.
-         *
-         * Instead we search for v in the old_values_array[].  If it's
-         * found then it's safe to write to v->referenced because it is
-         * stable through the execution of this function and won't be
-         * free()'ed until after.
-         */
-        if ((value_binary_search(old_values_array,
-                                 vp->nvalues, v)) != NULL) {
-            v->referenced = 1;  /* so v is valid, safe to deref */
-            continue;
-        }
-
-#ifndef NDEBUG
-        for (v2 = vp->values; v2 != NULL; v2 = v2->next)
-            assert(v2 != v);
-#endif
-    }
-    free(old_values_array);
-
-    /* Sweep; O(N) where N is the number of referenced values */
-    for (p = &vp->values; *p != NULL;) {
-        v = *p;
-
-        if (!v->referenced) {
-            assert(v != vp->values);
-
-            /* Remove from list and setup to continue at v->next */
-            *p = v->next;
-            /* Prepend v to old_values list */
-            v->next = old_values;
-            old_values = v;
-            vp->nvalues--;
-
-            /* Sweep the remainder of the list */
-            continue;
-        }
-
-        /* Step into this value's next sub-list */
-        v->referenced = 0;
-        p = &v->next;
-        assert(p != &vp->values);
+    for (;;) {
+        if (((seq = atomic_read_64(&vp->seq)) & 0x1) != 0)
+            continue; /* Writer active */
+        memcpy(buf, vp->data, vp->size);
+        membar_consumer(); /* Order the copy before the re-read */
+        if (atomic_read_64(&vp->seq) == seq)
+            break;
     }
-
-    errno = 0;
-    return old_values;
+    if (version != NULL)
+        *version = seq >> 1;
+    return 0;
 }
 
-#endif /* USE_TSV_SLOT_PAIR_DESIGN */
-
-/* Code common to both implementations */
-
 /**
- * Wait for a var to have its first value set.
+ * Set a new value on a POD thread-safe global variable
  *
- * @param vp [in] The vp to wait for
+ * @param [in] vp A POD thread-safe global variable
+ * @param [in] data New value, of the variable's size
+ * @param [out] new_version Pointer (may be NULL) to 64-bit integer where the new version will be output
  *
- * @return Zero on success, else a system error
+ * @return 0 on success, or a system error
  */
 int
-thread_safe_var_wait(thread_safe_var vp)
+thread_safe_var_set_copy(thread_safe_pod_var vp, const void *data,
+                         uint64_t *new_version)
 {
-    void *junk;
+    uint64_t seq;
     int err;
 
-    if ((err = thread_safe_var_get(vp, &junk, NULL)) == 0 && junk != NULL)
-        return 0;
+    if (data == NULL)
+        return EINVAL;
 
-    if ((err = pthread_mutex_lock(&vp->waiter_lock)) != 0)
+    if ((err = pthread_mutex_lock(&vp->write_lock)) != 0)
         return err;
 
-    while ((err = thread_safe_var_get(vp, &junk, NULL)) == 0 &&
-           junk == NULL) {
-        if ((err = pthread_cond_wait(&vp->waiter_cv,
-                                     &vp->waiter_lock)) != 0) {
-            (void) pthread_mutex_unlock(&vp->waiter_lock);
-            return err;
-        }
-    }
+    seq = atomic_inc_64_nv(&vp->seq);   /* Odd: writer active */
+    assert((seq & 0x1) == 1);
+    membar_producer(); /* Order the odd count before the update */
+    memcpy(vp->data, data, vp->size);
+    seq = atomic_inc_64_nv(&vp->seq);   /* Even: update complete */
+    (void) atomic_inc_64_nv(&generation);
 
-    /*
-     * The first writer signals, rather than broadcast, to avoid a
-     * thundering herd.  We propagate the signal here so the rest of the
-     * herd wakes, one at a time.
-     */
-    (void) pthread_cond_signal(&vp->waiter_cv);
-    if ((err = pthread_mutex_unlock(&vp->waiter_lock)) != 0)
-        return err;
-    return err;
+    if (new_version != NULL)
+        *new_version = seq >> 1;
+    return pthread_mutex_unlock(&vp->write_lock);
 }
@@ -34,6 +34,7 @@
 #include <sys/types.h>
 #include <stdint.h>
 #include <pthread.h>
+#include <time.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -57,13 +58,223 @@ typedef struct thread_safe_var_s *thread_safe_var;
 
 typedef void (*thread_safe_var_dtor_f)(void *);
 
+/**
+ * Copies a value into memory local to the given NUMA node, returning
+ * NULL if it can't.  Copies are destroyed with the var's destructor.
+ */
+typedef void *(*thread_safe_var_clone_f)(void *, int);
+
+/**
+ * Makes a new value from an argument and the current value (which may
+ * be NULL), for thread_safe_var_update().  Returns zero and outputs a
+ * new value, or returns a system error to abandon the update.
+ */
+typedef int (*thread_safe_var_update_f)(void *, void *, void **);
+
+/**
+ * Derives something from a value (e.g., an index of it), for
+ * thread_safe_var_derive(), given an argument and the value.  Returns
+ * zero and outputs the derived result, or returns a system error.
+ */
+typedef int (*thread_safe_var_derive_f)(void *, void *, void **);
+
+/**
+ * A reference to a value of a TSV that, unlike the values output by
+ * thread_safe_var_get(), any thread can use, and that stays valid until
+ * put.  Copy with thread_safe_var_ref_dup(), not by assignment.
+ */
+typedef struct thread_safe_var_ref_s {
+    thread_safe_var         var;
+    void                    *value;     /* NULL if no value */
+    uint64_t                version;
+    void                    *handle;    /* private */
+} thread_safe_var_ref;
+
+/* Keeps what readers read off of the cache lines that writers write */
+#define TSV_CACHE_LINE_SIZE     64
+
+struct tsv_ops;
+struct tsv_live;
+struct tsv_deferred;
+struct tsv_derivations;
+struct tsv_stale;
+struct tsv_notify;
+struct tsv_budget;
+
+/*
+ * This is private, and only here for THREAD_SAFE_VAR_INITIALIZER().
+ */
+struct thread_safe_var_s {
+    /* Read-mostly; all that readers touch here */
+    const struct tsv_ops    *ops;           /* atomic; design */
+    void                    *impl;          /* design-specific state */
+    thread_safe_var_dtor_f  dtor;           /* value destructor */
+    uint32_t                flags;          /* THREAD_SAFE_VAR_* attributes */
+    uint32_t                static_init;    /* THREAD_SAFE_VAR_INITIALIZER() */
+    struct tsv_stale        *stale;         /* staleness bound, if any */
+    char                    pad[TSV_CACHE_LINE_SIZE];
+    /* Written by writers */
+    pthread_mutex_t         write_lock;     /* one writer at a time */
+    pthread_mutex_t         waiter_lock;    /* waiters, where no futexes */
+    pthread_cond_t          waiter_cv;      /* waiters, where no futexes */
+    volatile uint64_t       version;        /* atomic; current version */
+    volatile uint32_t       seq;            /* atomic; bumped by writes */
+    volatile uint32_t       nwaiters;       /* atomic; version waiters */
+    struct tsv_live         *live;          /* live values, if tracked */
+    struct tsv_deferred     *deferred;      /* write_lock; by version */
+    struct tsv_derivations  *derived;       /* see thread_safe_var_derive() */
+    void                    *pending;       /* atomic; set_async() value */
+    volatile uint32_t       publishing;     /* atomic; set_async() combiner */
+    struct tsv_notify       *notify;        /* atomic; see notify_fd() */
+    struct tsv_budget       *budget;        /* see set_sized() */
+};
+
+/**
+ * Static initializer for TSVs with default attributes, as in:
+ *
+ *  static struct thread_safe_var_s config = THREAD_SAFE_VAR_INITIALIZER(dtor);
+ *
+ * then pass &config where a thread_safe_var is called for.  Nothing is
+ * allocated until the first write, and there's no need to call
+ * thread_safe_var_init().  Destroying a statically-initialized var
+ * returns it to its initial state.
+ */
+#define THREAD_SAFE_VAR_INITIALIZER(dtor) \
+    { 0, 0, (dtor), 0, 1, 0, { 0 }, \
+      PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, \
+      PTHREAD_COND_INITIALIZER, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }
+
+/**
+ * Callback for thread_safe_var_defer(), given its argument.
+ */
+typedef void (*thread_safe_var_defer_f)(void *);
+
+/**
+ * Designs, with different trade-offs; see README.md.  The default design
+ * is chosen at build time, or from the attribute flags below.
+ */
+typedef enum thread_safe_var_design_e {
+    THREAD_SAFE_VAR_DESIGN_DEFAULT = 0,
+    THREAD_SAFE_VAR_DESIGN_SLOT_PAIR,
+    THREAD_SAFE_VAR_DESIGN_SLOT_LIST,
+    THREAD_SAFE_VAR_DESIGN_QSBR,        /* see thread_safe_var_quiescent() */
+    THREAD_SAFE_VAR_DESIGN_LEFT_RIGHT,
+    THREAD_SAFE_VAR_DESIGN_HYBRID       /* slot-pair/slot-list, adaptive */
+} thread_safe_var_design;
+
+/* Attribute flags; with the default design these pick a design */
+#define THREAD_SAFE_VAR_READERS_NO_SPIN     0x01 /* readers must not loop */
+#define THREAD_SAFE_VAR_READERS_NO_FREE     0x02 /* readers must not free() */
+#define THREAD_SAFE_VAR_MEMBARRIER          0x04 /* fence-less slot-list reads */
+#define THREAD_SAFE_VAR_NUMA_REPLICAS       0x08 /* one replica per NUMA node */
+
+/*
+ * What thread_safe_var_set_sized() does when a write would take a var
+ * over its max_retained_bytes while older values are still held.
+ */
+typedef enum thread_safe_var_budget_policy_e {
+    THREAD_SAFE_VAR_BUDGET_BLOCK = 0,   /* wait for readers to release */
+    THREAD_SAFE_VAR_BUDGET_FAIL,        /* fail with ENOMEM */
+    THREAD_SAFE_VAR_BUDGET_NOTIFY       /* call over_budget(), then write */
+} thread_safe_var_budget_policy;
+
+/*
+ * Readers of a var with a staleness bound keep reading the value they
+ * last read, without looking at the var, until it's older than
+ * max_stale_ns or they've read it max_stale_reads times since (zero ->
+ * no such bound).  Releasing the value ends that early, as does a
+ * thread_safe_var_set_if() that fails with EAGAIN, so read-modify-write
+ * loops see the write they lost to on their next read.  QSBR readers
+ * always read the current value, so QSBR vars (including NUMA vars with
+ * QSBR replicas) can't have a staleness bound: thread_safe_var_init_attr()
+ * fails with EINVAL.
+ *
+ * Vars with a max_retained_bytes (zero -> no budget) bound the bytes of
+ * values set with thread_safe_var_set_sized() that aren't yet destroyed,
+ * per budget_policy.
+ */
+typedef struct thread_safe_var_attr_s {
+    thread_safe_var_design  design;
+    uint32_t                flags;
+    thread_safe_var_clone_f clone;      /* optional; for NUMA replicas */
+    uint64_t                max_stale_ns;
+    uint32_t                max_stale_reads;
+    uint64_t                max_retained_bytes;
+    thread_safe_var_budget_policy budget_policy;
+    thread_safe_var_defer_f over_budget;  /* for ..._BUDGET_NOTIFY */
+    void                    *over_budget_arg;
+} thread_safe_var_attr;
+
+int  thread_safe_var_attr_init(thread_safe_var_attr *);
+
 int  thread_safe_var_init(thread_safe_var *, thread_safe_var_dtor_f);
+int  thread_safe_var_init_attr(thread_safe_var *, thread_safe_var_dtor_f,
+                               const thread_safe_var_attr *);
 void thread_safe_var_destroy(thread_safe_var);
 
 int  thread_safe_var_get(thread_safe_var, void **, uint64_t *);
+int  thread_safe_var_get_many(const thread_safe_var *, size_t, void **,
+                              uint64_t *);
 int  thread_safe_var_wait(thread_safe_var);
+int  thread_safe_var_wait_version(thread_safe_var, uint64_t,
+                                  const struct timespec *);
+int  thread_safe_var_notify_fd(thread_safe_var, int *);
+void thread_safe_var_notify_ack(thread_safe_var);
 int  thread_safe_var_set(thread_safe_var, void *, uint64_t *);
+int  thread_safe_var_set_if(thread_safe_var, uint64_t, void *, uint64_t *);
+int  thread_safe_var_set_async(thread_safe_var, void *);
+int  thread_safe_var_try_set(thread_safe_var, void *, uint64_t *);
+int  thread_safe_var_timed_set(thread_safe_var, void *,
+                               const struct timespec *, uint64_t *);
+int  thread_safe_var_set_sized(thread_safe_var, void *, size_t, uint64_t *);
+int  thread_safe_var_update(thread_safe_var, thread_safe_var_update_f,
+                            void *, uint64_t *);
 void thread_safe_var_release(thread_safe_var);
+int  thread_safe_var_changed(thread_safe_var, uint64_t);
+uint64_t thread_safe_var_generation(void);
+int  thread_safe_var_acquire(thread_safe_var, thread_safe_var_ref *);
+void thread_safe_var_ref_dup(const thread_safe_var_ref *,
+                             thread_safe_var_ref *);
+void thread_safe_var_ref_put(thread_safe_var_ref *);
+void thread_safe_var_quiescent(void);
+int  thread_safe_var_synchronize(thread_safe_var, uint64_t,
+                                 const struct timespec *);
+int  thread_safe_var_defer(thread_safe_var, uint64_t,
+                           thread_safe_var_defer_f, void *);
+int  thread_safe_var_derive(thread_safe_var, thread_safe_var_derive_f,
+                            thread_safe_var_dtor_f, void *, size_t *);
+int  thread_safe_var_get_derived(thread_safe_var, size_t, void **,
+                                 uint64_t *);
+
+/**
+ * A thread_safe_var_group is a set of TSVs ("members") that readers read
+ * consistent snapshots of, and that writers write atomically, setting
+ * new values on any number of members with one version bump.
+ */
+typedef struct thread_safe_var_group_s *thread_safe_var_group;
+
+int  thread_safe_var_group_init(thread_safe_var_group *, size_t,
+                                const thread_safe_var_dtor_f *,
+                                const thread_safe_var_attr *);
+void thread_safe_var_group_destroy(thread_safe_var_group);
+int  thread_safe_var_group_get(thread_safe_var_group, void **, uint64_t *);
+int  thread_safe_var_group_set(thread_safe_var_group, void * const *,
+                               uint64_t *);
+void thread_safe_var_group_release(thread_safe_var_group);
+
+/**
+ * A thread_safe_pod_var is a TSV for small, fixed-size, plain-old-data
+ * values, which are copied in and out under a sequence lock rather than
+ * referenced.  Readers do not allocate, do not pin values, and never
+ * block, though they may spin while racing with a writer.
+ */
+typedef struct thread_safe_pod_var_s *thread_safe_pod_var;
+
+int  thread_safe_var_init_pod(thread_safe_pod_var *, size_t);
+void thread_safe_var_destroy_pod(thread_safe_pod_var);
+
+int  thread_safe_var_get_copy(thread_safe_pod_var, void *, uint64_t *);
+int  thread_safe_var_set_copy(thread_safe_pod_var, const void *, uint64_t *);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,276 @@
+/*
+ * Copyright (c) 2015 Cryptonector LLC
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "thread_safe_global.h"
+#include "tsv_impl.h"
+#include "atomics.h"
+
+/*
+ * TSV Groups
+ *
+ * Values that must change together (say, a routing table and the ACLs
+ * that refer to it) can't live in separate TSVs, as readers could see a
+ * new value of one and an old value of another.  Packing them into one
+ * value means copying all of it to change any part of it.
+ *
+ * A group is a TSV whose values are snapshots: arrays of boxed member
+ * values (see tsv_impl.h).  A write makes a new snapshot that shares the
+ * boxes of the members it doesn't change, which costs a pointer per
+ * member rather than a copy of each member's value, and publishes it as
+ * one write to that TSV, with one version.  Readers read a snapshot, so
+ * all the member values they see come from the same write.
+ *
+ * Group writers build on the current snapshot, so they're serialized by
+ * the group's own lock (as well as by the TSV's).
+ */
+
+struct group_snapshot {
+    size_t                  nmembers;
+    struct tsv_box          *members[1];    /* really nmembers */
+};
+
+struct thread_safe_var_group_s {
+    thread_safe_var         snapshots;      /* of struct group_snapshot */
+    pthread_mutex_t         write_lock;     /* one group writer at a time */
+    struct group_snapshot   *current;       /* write_lock; the TSV's ref */
+    size_t                  nmembers;
+    thread_safe_var_dtor_f  *dtors;         /* member value destructors */
+};
+
+/* The snapshot TSV's value destructor */
+static void
+snapshot_free(void *data)
+{
+    struct group_snapshot *snap = data;
+    size_t i;
+
+    for (i = 0; i < snap->nmembers; i++)
+        tsv_box_release(snap->members[i]);
+    free(snap);
+}
+
+/**
+ * Initialize a group of thread-safe variables
+ *
+ * @param gp [out] Pointer to group
+ * @param nmembers [in] Number of member variables
+ * @param dtors [in] Pointer (may be NULL) to nmembers value destructors (each may be NULL)
+ * @param attr [in] Pointer (may be NULL) to attributes (no clone function)
+ *
+ * @return Returns zero on success, else a system error number
+ */
+int
+thread_safe_var_group_init(thread_safe_var_group *gp, size_t nmembers,
+                           const thread_safe_var_dtor_f *dtors,
+                           const thread_safe_var_attr *attr)
+{
+    thread_safe_var_group g;
+    size_t i;
+    int err;
+
+    *gp = NULL;
+    if (nmembers == 0 || (attr != NULL && attr->clone != NULL))
+        return EINVAL;
+
+    if ((g = calloc(1, sizeof(*g))) == NULL)
+        return errno;
+    if ((g->dtors = calloc(nmembers, sizeof(g->dtors[0]))) == NULL) {
+        err = errno;
+        free(g);
+        return err;
+    }
+    g->nmembers = nmembers;
+    for (i = 0; dtors != NULL && i < nmembers; i++)
+        g->dtors[i] = dtors[i];
+
+    if ((err = pthread_mutex_init(&g->write_lock, NULL)) != 0) {
+        free(g->dtors);
+        free(g);
+        return err;
+    }
+    if ((err = thread_safe_var_init_attr(&g->snapshots, snapshot_free,
+                                         attr)) != 0) {
+        pthread_mutex_destroy(&g->write_lock);
+        free(g->dtors);
+        free(g);
+        return err;
+    }
+    *gp = g;
+    return 0;
+}
+
+/**
+ * Destroy a group of thread-safe variables
+ *
+ * As with thread_safe_var_destroy(), no thread may be using the group.
+ *
+ * @param g [in] The group to destroy
+ */
+void
+thread_safe_var_group_destroy(thread_safe_var_group g)
+{
+    if (g == NULL)
+        return;
+    thread_safe_var_destroy(g->snapshots);
+    pthread_mutex_destroy(&g->write_lock);
+    free(g->dtors);
+    free(g);
+}
+
+/**
+ * Get a consistent snapshot of the values of a group's members
+ *
+ * The values remain valid as for thread_safe_var_get(): until this
+ * thread next reads the group or releases it.
+ *
+ * @param g [in] A group
+ * @param values [out] Array of as many pointers as there are members, where the members' values (NULL if never set) will be output
+ * @param version [out] Pointer (may be NULL) to the version of the snapshot
+ *
+ * @return Zero on success, else a system error
+ */
+int
+thread_safe_var_group_get(thread_safe_var_group g, void **values,
+                          uint64_t *version)
+{
+    struct group_snapshot *snap;
+    size_t i;
+    int err;
+
+    for (i = 0; i < g->nmembers; i++)
+        values[i] = NULL;
+    if ((err = thread_safe_var_get(g->snapshots, (void **)&snap,
+                                   version)) != 0 || snap == NULL)
+        return err;
+    for (i = 0; i < g->nmembers; i++) {
+        if (snap->members[i] != NULL)
+            values[i] = snap->members[i]->value;
+    }
+    return 0;
+}
+
+/**
+ * Release this thread's reference to the last snapshot it read
+ *
+ * @param g [in] A group
+ */
+void
+thread_safe_var_group_release(thread_safe_var_group g)
+{
+    thread_safe_var_release(g->snapshots);
+}
+
+/**
+ * Atomically set new values on some or all of a group's members
+ *
+ * Readers see either all of the new values or none of them.  Members
+ * not being set keep their current values, which are not copied.  On
+ * failure the caller keeps the new values.
+ *
+ * @param g [in] A group
+ * @param values [in] Array of as many pointers as there are members, with the members' new values, or NULL for members to leave as they are
+ * @param new_version [out] Pointer (may be NULL) to the new version of the group
+ *
+ * @return Zero on success, EINVAL if no new values are given, else a system error
+ */
+int
+thread_safe_var_group_set(thread_safe_var_group g, void * const *values,
+                          uint64_t *new_version)
+{
+    struct group_snapshot *current;
+    struct group_snapshot *snap;
+    struct tsv_box *box;
+    size_t nnew = 0;
+    size_t i;
+    int err;
+
+    if ((snap = calloc(1, sizeof(*snap) +
+                          (g->nmembers - 1) * sizeof(snap->members[0]))) ==
+        NULL)
+        return errno;
+    snap->nmembers = g->nmembers;
+
+    /* Box the new values; allocate here, not with the lock held */
+    for (i = 0; i < g->nmembers; i++) {
+        if (values[i] == NULL)
+            continue;
+        if ((box = calloc(1, sizeof(*box))) == NULL) {
+            err = errno;
+            goto fail;
+        }
+        box->dtor = g->dtors[i];
+        box->value = values[i];
+        box->nref = 1;
+        snap->members[i] = box;
+        nnew++;
+    }
+    if (nnew == 0) {
+        err = EINVAL;
+        goto fail;
+    }
+
+    if ((err = pthread_mutex_lock(&g->write_lock)) != 0)
+        goto fail;
+
+    /*
+     * Share the boxes of the members that aren't changing.  The current
+     * snapshot can't go away: only group writers replace it, and we
+     * hold the lock.
+     */
+    for (i = 0; (current = g->current) != NULL && i < g->nmembers; i++) {
+        if (snap->members[i] != NULL || (box = current->members[i]) == NULL)
+            continue;
+        (void) atomic_inc_32_nv(&box->nref);
+        snap->members[i] = box;
+    }
+    if ((err = thread_safe_var_set(g->snapshots, snap, new_version)) == 0)
+        g->current = snap;
+    (void) pthread_mutex_unlock(&g->write_lock);
+    if (err == 0)
+        return 0;
+
+fail:
+    /* The caller keeps its values; shared boxes just lose a reference */
+    for (i = 0; i < g->nmembers; i++) {
+        if (values[i] != NULL)
+            free(snap->members[i]);
+        else
+            tsv_box_release(snap->members[i]);
+    }
+    free(snap);
+    return err;
+}
@@ -0,0 +1,496 @@
+/*
+ * Copyright (c) 2015 Cryptonector LLC
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "thread_safe_global.h"
+#include "tsv_impl.h"
+#include "atomics.h"
+
+/*
+ * Hybrid Design
+ *
+ * The slot-pair design has O(1) writers, but readers of a new value do
+ * several atomic read-modify-write operations on cache lines shared by
+ * all readers, and may free() and signal writers.  The slot-list design
+ * has nearly free readers, but writers are O(N) in the number of
+ * readers.  Which is better depends on how often the variable is
+ * written relative to how many threads read it, and that changes over
+ * a variable's lifetime (e.g., write-heavy during a rollout, then
+ * read-only for days).
+ *
+ * A hybrid TSV has one child TSV of each of those two designs, and an
+ * index of the active one, which readers read from and writers write
+ * to.  Values are boxed, with a reference count, so that the same value
+ * can be held by both children.
+ *
+ * Writers keep an exponentially-weighted moving average of the interval
+ * between writes, and readers count themselves the first time they read
+ * the TSV.  At each write the writer compares the two to pick a design:
+ * slot-list when the cost of its O(N) writes is small relative to the
+ * interval between writes, slot-pair otherwise, with hysteresis and a
+ * minimum number of writes between switches to avoid flapping.  Note
+ * that we never switch while no writes happen, but then neither design
+ * has any reader overhead to speak of: both fast paths are a load and a
+ * compare.
+ *
+ * To switch, the writer (holding the write lock, so no other writer can
+ * interfere) sets the current value on the other child, makes that the
+ * active one, then sets a "moved" sentinel value on the previously
+ * active child.  Readers never block: a reader that raced with a switch
+ * and reads the sentinel from the previously active child re-reads the
+ * active index and tries again, while one that read the previously
+ * active child before the sentinel was set gets the current value.
+ * Thus readers never see versions go backwards.  Readers do loop, but
+ * only when racing with a switch, and switches are rare.
+ *
+ * Readers also remember which child they last read, so that they can
+ * drop their reference in the previously active child once a switch
+ * has happened.
+ */
+
+#define HYBRID_SLOT_PAIR        0
+#define HYBRID_SLOT_LIST        1
+
+/*
+ * Slot-list writes cost on the order of this many nanoseconds per reader
+ * thread; we want them to take no more than a small fraction of the
+ * interval between writes.
+ */
+#define HYBRID_NS_PER_READER    5000
+/* Don't switch more often than once every this many writes */
+#define HYBRID_MIN_WRITES       8
+
+struct hybrid_var {
+    pthread_key_t       tkey;           /* child last read by this thread */
+    thread_safe_var     children[2];    /* slot-pair and slot-list */
+    volatile uint32_t   active;         /* atomic; child to read/write */
+    volatile uint32_t   nreaders;       /* atomic; live reader threads */
+    volatile uint32_t   nrefs;          /* atomic; nreaders + 1 */
+    unsigned char       tags[2];        /* thread-specific values */
+    struct tsv_box      *current;       /* writer-only */
+    uint64_t            last_write;     /* writer-only; ns */
+    uint64_t            interval;       /* writer-only; EWMA of ns */
+    volatile uint64_t   fake_interval;  /* atomic; for tests; 0 -> none */
+    uint32_t            writes;         /* writer-only; since last switch */
+};
+
+/* Set on the previously active child when switching */
+static struct tsv_box moved;
+
+/* Children's value destructor; values are boxed (see tsv_impl.h) */
+static void
+hbox_release(void *data)
+{
+    if (data != &moved)
+        tsv_box_release(data);
+}
+
+static void
+hybrid_unref(struct hybrid_var *vp)
+{
+    if (atomic_dec_32_nv(&vp->nrefs) > 0)
+        return;
+    /* XXX We leak vp->tkey! */
+    free(vp);
+}
+
+/* Thread specific key destructor for handling thread exit */
+static void
+hybrid_reader_exit(void *data)
+{
+    unsigned char *tag = data;
+    struct hybrid_var *vp;
+
+    if (tag == NULL)
+        return;
+    tag -= *tag;
+    vp = (struct hybrid_var *)((char *)tag - offsetof(struct hybrid_var, tags));
+    (void) atomic_dec_32_nv(&vp->nreaders);
+    hybrid_unref(vp);
+}
+
+static int
+hybrid_init(thread_safe_var tsv, const thread_safe_var_attr *attr)
+{
+    struct hybrid_var *vp;
+    thread_safe_var_attr child_attr;
+    int err;
+
+    (void) attr;
+
+    if ((vp = calloc(1, sizeof(*vp))) == NULL)
+        return errno;
+
+    vp->active = HYBRID_SLOT_PAIR;
+    vp->nreaders = 0;
+    vp->nrefs = 1; /* decremented upon destruction */
+    vp->tags[0] = 0;
+    vp->tags[1] = 1;
+    vp->current = NULL;
+
+    (void) thread_safe_var_attr_init(&child_attr);
+    child_attr.flags = tsv->flags & THREAD_SAFE_VAR_MEMBARRIER;
+    child_attr.design = THREAD_SAFE_VAR_DESIGN_SLOT_LIST;
+    if ((err = thread_safe_var_init_attr(&vp->children[HYBRID_SLOT_LIST],
+                                         hbox_release, &child_attr)) != 0) {
+        free(vp);
+        return err;
+    }
+    child_attr.flags = 0;
+    child_attr.design = THREAD_SAFE_VAR_DESIGN_SLOT_PAIR;
+    if ((err = thread_safe_var_init_attr(&vp->children[HYBRID_SLOT_PAIR],
+                                         hbox_release, &child_attr)) != 0) {
+        thread_safe_var_destroy(vp->children[HYBRID_SLOT_LIST]);
+        free(vp);
+        return err;
+    }
+    if ((err = pthread_key_create(&vp->tkey, hybrid_reader_exit)) != 0) {
+        thread_safe_var_destroy(vp->children[HYBRID_SLOT_LIST]);
+        thread_safe_var_destroy(vp->children[HYBRID_SLOT_PAIR]);
+        free(vp);
+        return err;
+    }
+    tsv->impl = vp;
+    return 0;
+}
+
+static void
+hybrid_destroy(thread_safe_var tsv)
+{
+    struct hybrid_var *vp = tsv->impl;
+
+    thread_safe_var_destroy(vp->children[HYBRID_SLOT_PAIR]);
+    thread_safe_var_destroy(vp->children[HYBRID_SLOT_LIST]);
+    hbox_release(vp->current);
+    vp->current = NULL;
+    hybrid_unref(vp);   /* defer to last reader's exit, if any */
+}
+
+/* Reads the active child; the box stays alive until our next read */
+static int
+hybrid_read(struct hybrid_var *vp, struct tsv_box **boxp)
+{
+    unsigned char *tag;
+    struct tsv_box *box;
+    uint32_t active;
+    int err;
+
+    /* Loops only when racing with a switch of active child */
+    do {
+        active = atomic_read_32(&vp->active);
+        if ((err = thread_safe_var_get(vp->children[active],
+                                       (void **)&box, NULL)) != 0)
+            return err;
+    } while (box == &moved);
+
+    if ((tag = pthread_getspecific(vp->tkey)) == NULL) {
+        /* First time for this thread; count it */
+        (void) atomic_inc_32_nv(&vp->nrefs);
+        (void) atomic_inc_32_nv(&vp->nreaders);
+    } else if (*tag != active) {
+        /* Drop our reference in the previously active child */
+        thread_safe_var_release(vp->children[*tag]);
+    }
+    if ((tag == NULL || *tag != active) &&
+        (err = pthread_setspecific(vp->tkey, &vp->tags[active])) != 0)
+        return err;
+
+    *boxp = box;
+    return 0;
+}
+
+static int
+hybrid_get(thread_safe_var tsv, void **res, uint64_t *version)
+{
+    struct tsv_box *box;
+    int err;
+
+    if ((err = hybrid_read(tsv->impl, &box)) != 0)
+        return err;
+    if (box != NULL) {
+        *res = box->value;
+        *version = box->version;
+    }
+    return 0;
+}
+
+static void
+hybrid_release(thread_safe_var tsv)
+{
+    struct hybrid_var *vp = tsv->impl;
+    unsigned char *tag;
+
+    if ((tag = pthread_getspecific(vp->tkey)) != NULL)
+        thread_safe_var_release(vp->children[*tag]);
+}
+
+static int
+hybrid_prepare(thread_safe_var tsv, void *data, void **cookiep)
+{
+    struct tsv_box *box;
+
+    /* The hybrid var's reference; children take their own */
+    if ((*cookiep = box = calloc(1, sizeof(*box))) == NULL)
+        return errno;
+    box->dtor = tsv->dtor;
+    box->value = data;
+    box->nref = 1;
+    return 0;
+}
+
+/* Set a box on a child, which then holds a reference to it */
+static int
+hybrid_set_child(thread_safe_var child, struct tsv_box *box,
+                 const struct timespec *deadline)
+{
+    int err;
+
+    if (box != &moved)
+        (void) atomic_inc_32_nv(&box->nref);
+    if ((err = tsv_set(child, box, deadline, NULL)) != 0 && box != &moved)
+        (void) atomic_dec_32_nv(&box->nref);
+    return err;
+}
+
+/* Pick the child that should be active given recent writes */
+static uint32_t
+hybrid_policy(struct hybrid_var *vp)
+{
+    struct timespec ts;
+    uint64_t now;
+    uint64_t fake;
+    uint64_t budget;
+    uint32_t nreaders;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+        return vp->active;
+    now = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    if (vp->last_write != 0)
+        vp->interval = vp->interval - (vp->interval >> 3) +
+                       ((now - vp->last_write) >> 3);
+    vp->last_write = now;
+    if ((fake = atomic_read_64(&vp->fake_interval)) != 0)
+        vp->interval = fake;
+
+    if (++vp->writes < HYBRID_MIN_WRITES)
+        return vp->active;
+
+    if ((nreaders = atomic_read_32(&vp->nreaders)) == 0)
+        nreaders = 1;
+    budget = (uint64_t)nreaders * HYBRID_NS_PER_READER;
+    if (vp->active == HYBRID_SLOT_PAIR && vp->interval > 2 * budget)
+        return HYBRID_SLOT_LIST;
+    if (vp->active == HYBRID_SLOT_LIST && vp->interval < budget)
+        return HYBRID_SLOT_PAIR;
+    return vp->active;
+}
+
+static int
+hybrid_publish(thread_safe_var tsv, void *cookie, uint64_t new_version,
+               const struct timespec *deadline, void **garbagep)
+{
+    struct hybrid_var *vp = tsv->impl;
+    struct tsv_box *box = cookie;
+    uint32_t active = vp->active;
+    uint32_t next;
+    int err;
+
+    *garbagep = NULL;
+    box->version = new_version;
+
+    next = hybrid_policy(vp);
+    if (next != active &&
+        (vp->current == NULL ||
+         hybrid_set_child(vp->children[next], vp->current,
+                          deadline) == 0)) {
+        /*
+         * Switch.  Readers that read the sentinel from the previously
+         * active child will re-read vp->active and find the new one.
+         * If we can't set the sentinel we switch back; both children
+         * have the current value, so readers can't tell.
+         */
+        atomic_write_32(&vp->active, next);
+        if (vp->current == NULL ||
+            hybrid_set_child(vp->children[active], &moved,
+                             deadline) == 0) {
+            vp->writes = 0;
+            active = next;
+        } else {
+            atomic_write_32(&vp->active, active);
+        }
+    }
+
+    if ((err = hybrid_set_child(vp->children[active], box,
+                                deadline)) != 0)
+        return err;
+    /* Our reference keeps it alive until it's tracked */
+    tsv_live_add(tsv->live, &box->live, new_version);
+    *garbagep = vp->current;
+    vp->current = box;
+    return 0;
+}
+
+static void
+hybrid_abort(thread_safe_var tsv, void *cookie)
+{
+    (void) tsv;
+    free(cookie);
+}
+
+/* Release the hybrid var's reference to the previous value */
+static void
+hybrid_reclaim(thread_safe_var tsv, void *garbage)
+{
+    (void) tsv;
+    hbox_release(garbage);
+}
+
+/* Have the children release what they hold that no reader does */
+static uint64_t
+hybrid_oldest(thread_safe_var tsv, void **garbagep)
+{
+    struct hybrid_var *vp = tsv->impl;
+    uint64_t oldest;
+
+    *garbagep = NULL;
+    (void) tsv_oldest(vp->children[HYBRID_SLOT_PAIR], &oldest);
+    (void) tsv_oldest(vp->children[HYBRID_SLOT_LIST], &oldest);
+    return UINT64_MAX;  /* boxes are in tsv->live */
+}
+
+static int
+hybrid_acquire(thread_safe_var tsv, void **handlep, void **res,
+               uint64_t *version)
+{
+    struct tsv_box *box;
+    int err;
+
+    /* Our reference in the child keeps the box alive while we add one */
+    if ((err = hybrid_read(tsv->impl, &box)) != 0 || box == NULL)
+        return err;
+    (void) atomic_inc_32_nv(&box->nref);
+    *handlep = box;
+    *res = box->value;
+    *version = box->version;
+    return 0;
+}
+
+static void
+hybrid_ref_dup(thread_safe_var tsv, void *handle)
+{
+    (void) tsv;
+    (void) atomic_inc_32_nv(&((struct tsv_box *)handle)->nref);
+}
+
+static void
+hybrid_ref_put(thread_safe_var tsv, void *handle)
+{
+    (void) tsv;
+    tsv_box_release(handle);
+}
+
+/* Output this thread's value from the child it last read */
+static int
+hybrid_peek(thread_safe_var tsv, void **res, uint64_t *version)
+{
+    struct hybrid_var *vp = tsv->impl;
+    thread_safe_var child;
+    struct tsv_box *box;
+    unsigned char *tag;
+    uint64_t vers;
+
+    if ((tag = pthread_getspecific(vp->tkey)) == NULL)
+        return ENOENT;
+    child = vp->children[*tag];
+    if (child->ops->peek(child, (void **)&box, &vers) != 0 ||
+        box == NULL || box == &moved)
+        return ENOENT;
+    *res = box->value;
+    *version = box->version;
+    return 0;
+}
+
+/**
+ * Which design a hybrid var's active child has (for tests)
+ *
+ * @param tsv [in] A hybrid var
+ *
+ * @return THREAD_SAFE_VAR_DESIGN_SLOT_PAIR or THREAD_SAFE_VAR_DESIGN_SLOT_LIST
+ */
+thread_safe_var_design
+tsv_hybrid_active(thread_safe_var tsv)
+{
+    struct hybrid_var *vp = tsv->impl;
+
+    if (atomic_read_32(&vp->active) == HYBRID_SLOT_LIST)
+        return THREAD_SAFE_VAR_DESIGN_SLOT_LIST;
+    return THREAD_SAFE_VAR_DESIGN_SLOT_PAIR;
+}
+
+/**
+ * Make a hybrid var's writes act as if they came this many nanoseconds
+ * apart, whatever the clock says (for tests)
+ *
+ * @param tsv [in] A hybrid var
+ * @param ns [in] Interval between writes, or 0 to measure it again
+ */
+void
+tsv_hybrid_fake_interval(thread_safe_var tsv, uint64_t ns)
+{
+    struct hybrid_var *vp = tsv->impl;
+
+    atomic_write_64(&vp->fake_interval, ns);
+}
+
+const struct tsv_ops tsv_hybrid_ops = {
+    "hybrid",
+    hybrid_init,
+    hybrid_destroy,
+    hybrid_get,
+    hybrid_release,
+    hybrid_prepare,
+    hybrid_publish,
+    hybrid_abort,
+    hybrid_reclaim,
+    hybrid_oldest,
+    hybrid_acquire,
+    hybrid_ref_dup,
+    hybrid_ref_put,
+    hybrid_peek,
+};
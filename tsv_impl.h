@@ -0,0 +1,173 @@
+/*
+ * Copyright (c) 2015 Cryptonector LLC
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Interface between the thread-safe variable API (thread_safe_global.c)
+ * and the designs that implement it (tsv_*.c).  Not installed.
+ */
+
+#ifndef TSV_IMPL_H
+#define TSV_IMPL_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "thread_safe_global.h"
+
+typedef thread_safe_var_dtor_f var_dtor_t;
+
+/*
+ * The common layer owns the write lock, version numbering (versions
+ * start at 1, with 0 meaning "no value yet"), and waking up waiters.
+ * Designs own the representation of values and of reader state, which
+ * hangs off of vp->impl.
+ *
+ * A write goes like this:
+ *
+ *  - prepare() allocates whatever the write needs, without the write
+ *    lock held;
+ *  - publish() makes the new value current, with the write lock held,
+ *    and outputs whatever garbage the write produced; if it has to wait
+ *    for readers it gives up at the given deadline (an absolute
+ *    CLOCK_REALTIME time, or NULL for none) with ETIMEDOUT, leaving the
+ *    var as it was;
+ *  - reclaim() disposes of that garbage after the write lock is
+ *    dropped;
+ *  - abort() undoes prepare() if the write fails.
+ *
+ * For thread_safe_var_synchronize(), oldest() (called with the write
+ * lock held) drops whatever references the var itself holds to values
+ * older than the current one that no reader can still be reading,
+ * outputting them as garbage for reclaim(), and returns the oldest
+ * version it knows to be live (UINT64_MAX if it knows of none).
+ * Designs that track values in vp->live (see below) need only report
+ * what they don't track there.
+ *
+ * For thread_safe_var_acquire(), acquire() reads the var like get() and
+ * also outputs a handle that keeps the value alive until ref_put(), from
+ * any thread; ref_dup() adds a reference to a handle.
+ *
+ * For bounded-staleness reads (see thread_safe_var_attr), peek() outputs
+ * the value this thread last read without touching anything shared, or
+ * returns ENOENT if the thread holds none (or the design can't say).
+ */
+struct tsv_ops {
+    const char  *name;
+    int         (*init)(thread_safe_var, const thread_safe_var_attr *);
+    void        (*destroy)(thread_safe_var);
+    int         (*get)(thread_safe_var, void **, uint64_t *);
+    void        (*release)(thread_safe_var);
+    int         (*prepare)(thread_safe_var, void *, void **);
+    int         (*publish)(thread_safe_var, void *, uint64_t,
+                           const struct timespec *, void **);
+    void        (*abort)(thread_safe_var, void *);
+    void        (*reclaim)(thread_safe_var, void *);
+    uint64_t    (*oldest)(thread_safe_var, void **);
+    int         (*acquire)(thread_safe_var, void **, void **, uint64_t *);
+    void        (*ref_dup)(thread_safe_var, void *);
+    void        (*ref_put)(thread_safe_var, void *);
+    int         (*peek)(thread_safe_var, void **, uint64_t *);
+};
+
+/*
+ * struct thread_safe_var_s is in thread_safe_global.h, for
+ * THREAD_SAFE_VAR_INITIALIZER().  Its ops are NULL until the first write
+ * to a statically-initialized var.
+ */
+
+/*
+ * Live value tracking, for thread_safe_var_synchronize()
+ *
+ * Designs whose values readers can release in any order embed one of
+ * these in each value's record, add it to vp->live when publishing the
+ * value, and remove it once the value is destroyed.  Values are added
+ * in version order, so the oldest live value is always at the head.
+ * The list outlives the var until its last value is destroyed.
+ */
+struct tsv_live_entry {
+    struct tsv_live_entry   *prev;
+    struct tsv_live_entry   *next;
+    struct tsv_live         *live;      /* NULL if not added */
+    uint64_t                version;
+};
+
+void     tsv_live_add(struct tsv_live *, struct tsv_live_entry *, uint64_t);
+void     tsv_live_remove(struct tsv_live_entry *);
+
+/* Wake synchronizers, if any, because some reference was dropped */
+void     tsv_sync_notify(void);
+
+/* Oldest live version of a var, running vp->ops->oldest() */
+int      tsv_oldest(thread_safe_var, uint64_t *);
+
+/*
+ * Values boxed with a reference count, for designs made of child TSVs
+ * that share values (the children's value destructor is
+ * tsv_box_release()).
+ */
+struct tsv_box {
+    var_dtor_t          dtor;       /* value destructor */
+    void                *value;     /* the actual value */
+    uint64_t            version;    /* version of this value */
+    volatile uint32_t   nref;       /* release when drops to 0 */
+    struct tsv_live_entry live;     /* in the owner's vp->live */
+};
+
+void tsv_box_release(void *);
+
+/*
+ * Finish a write given a cookie from vp->ops->prepare(), or write a
+ * value, giving up at the given deadline (see publish() above)
+ */
+int  tsv_set_prepared(thread_safe_var, void *, const struct timespec *,
+                      uint64_t *);
+int  tsv_set(thread_safe_var, void *, const struct timespec *, uint64_t *);
+
+/* Number of NUMA nodes (1 if unknown) and the caller's current node */
+int  tsv_numa_nodes(void);
+int  tsv_numa_node(void);
+
+/* Pretend there are nnodes NUMA nodes, or 0 for the real ones (for tests) */
+void tsv_numa_fake_nodes(int);
+
+/* The design of a hybrid var's active child (for tests) */
+thread_safe_var_design tsv_hybrid_active(thread_safe_var);
+
+/* Fix a hybrid var's estimate of the ns between writes (for tests) */
+void tsv_hybrid_fake_interval(thread_safe_var, uint64_t);
+
+extern const struct tsv_ops tsv_slot_pair_ops;
+extern const struct tsv_ops tsv_slot_list_ops;
+extern const struct tsv_ops tsv_qsbr_ops;
+extern const struct tsv_ops tsv_left_right_ops;
+extern const struct tsv_ops tsv_hybrid_ops;
+extern const struct tsv_ops tsv_numa_ops;
+
+#endif /* TSV_IMPL_H */
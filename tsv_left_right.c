@@ -0,0 +1,414 @@
+/*
+ * Copyright (c) 2015 Cryptonector LLC
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "thread_safe_global.h"
+#include "tsv_impl.h"
+#include "atomics.h"
+
+/*
+ * Left-Right Design
+ *
+ * This is the Left-Right concurrency control technique of Ramalhete and
+ * Correia applied to a TSV.  There are two instances of the variable
+ * (here each instance is just a pointer to a reference-counted wrapped
+ * value), a left_right index telling readers which instance to read, and
+ * two read indicators, with a version_index telling readers which read
+ * indicator to arrive at and depart from.
+ *
+ * Readers arrive at a read indicator, read the instance indicated by
+ * left_right, take a reference to the value found there, and depart.
+ * That's a fixed number of atomic operations: readers never loop, never
+ * block, and never signal writers, so reads are wait-free population
+ * oblivious.  Compare to the slot-list design, where readers may loop
+ * while racing with writers, and the slot-pair design, where readers
+ * may have to signal (thus lock a mutex shared with) a waiting writer.
+ *
+ * Writers are serialized.  A writer writes the instance readers are not
+ * reading, then toggles left_right so that new readers read it.
+ * Readers that read left_right before the toggle may still be reading
+ * the other instance, so before the next writer can overwrite that
+ * instance it must wait for them to depart.  It does so by toggling
+ * version_index and waiting for both read indicators to drain in turn,
+ * spinning (and yielding the CPU) as needed.
+ *
+ * We do that waiting at the start of the next write rather than at the
+ * end of the current one: by then readers have usually departed, so
+ * writers rarely wait at all.  The cost is that the value previous to
+ * the current one is kept referenced until the next write (or until
+ * thread_safe_var_synchronize() needs it released).
+ *
+ * Readers release values, thus call free() and the value destructor,
+ * as in the slot-pair design.  Reading and writing are O(1), but
+ * writers may wait for readers.
+ */
+
+/*
+ * Values set on a thread-global variable are wrapped with a struct that
+ * holds a reference count.
+ */
+struct vwrapper {
+    var_dtor_t          dtor;       /* value destructor */
+    void                *ptr;       /* the actual value */
+    uint64_t            version;    /* version of this data */
+    volatile uint32_t   nref;       /* release when drops to 0 */
+    struct tsv_live_entry live;     /* for thread_safe_var_synchronize() */
+};
+
+struct lr_var {
+    pthread_key_t       tkey;           /* to detect thread exits */
+    struct vwrapper     *instances[2];  /* atomic; the two instances */
+    volatile uint32_t   left_right;     /* atomic; instance to read */
+    volatile uint32_t   version_index;  /* atomic; indicator to arrive at */
+    volatile uint32_t   readers[2];     /* atomic; read indicators */
+    volatile uint64_t   version;        /* atomic; current version */
+};
+
+static void
+wrapper_free(struct vwrapper *wrapper)
+{
+    if (wrapper == NULL)
+        return;
+    if (atomic_dec_32_nv(&wrapper->nref) > 0)
+        return;
+    if (wrapper->dtor != NULL)
+        wrapper->dtor(wrapper->ptr);
+    tsv_live_remove(&wrapper->live);
+    free(wrapper);
+}
+
+/* For the thread-specific key */
+static void
+var_dtor_wrapper(void *wrapper)
+{
+    wrapper_free(wrapper);
+}
+
+static int
+lr_init(thread_safe_var tsv, const thread_safe_var_attr *attr)
+{
+    struct lr_var *vp;
+    int err;
+
+    (void) attr;
+
+    if ((vp = calloc(1, sizeof(*vp))) == NULL)
+        return errno;
+
+    /* XXX We leak these; see the note in the slot-pair initiator. */
+    if ((err = pthread_key_create(&vp->tkey, var_dtor_wrapper)) != 0) {
+        free(vp);
+        return err;
+    }
+
+    vp->instances[0] = NULL;
+    vp->instances[1] = NULL;
+    vp->left_right = 0;
+    vp->version_index = 0;
+    vp->readers[0] = 0;
+    vp->readers[1] = 0;
+    vp->version = 0;
+    tsv->impl = vp;
+    return 0;
+}
+
+static void lr_release(thread_safe_var);
+
+static void
+lr_destroy(thread_safe_var tsv)
+{
+    struct lr_var *vp = tsv->impl;
+
+    lr_release(tsv);
+    wrapper_free(vp->instances[0]);
+    wrapper_free(vp->instances[1]);
+    free(vp);
+    /* Remaining references will be released by the thread key destructor */
+    /* XXX We leak vp->tkey!  See note in initiator above. */
+}
+
+static int
+lr_get(thread_safe_var tsv, void **res, uint64_t *version)
+{
+    struct lr_var *vp = tsv->impl;
+    struct vwrapper *wrapper;
+    uint32_t vi;
+    uint32_t nref;
+
+    if ((wrapper = pthread_getspecific(vp->tkey)) != NULL &&
+        wrapper->version == atomic_read_64(&vp->version)) {
+
+        /* Fast path */
+        *version = wrapper->version;
+        *res = wrapper->ptr;
+        return 0;
+    }
+
+    /*
+     * Arrive, read the instance readers are meant to read, take a
+     * reference to its value, and depart.  No loops, no locks.
+     */
+    vi = atomic_read_32(&vp->version_index) & 0x1;
+    (void) atomic_inc_32_nv(&vp->readers[vi]);
+    wrapper = atomic_read_ptr((volatile void **)
+        &vp->instances[atomic_read_32(&vp->left_right) & 0x1]);
+    if (wrapper != NULL) {
+        nref = atomic_inc_32_nv(&wrapper->nref);
+        assert(nref > 1);
+    }
+    (void) atomic_dec_32_nv(&vp->readers[vi]);
+
+    if (wrapper == NULL)
+        return 0; /* No value set yet */
+
+    *version = wrapper->version;
+    *res = wrapper->ptr;
+
+    /* Release the value previously read in this thread, if any */
+    lr_release(tsv);
+
+    /* Recall this value we just read */
+    return pthread_setspecific(vp->tkey, wrapper);
+}
+
+static void
+lr_release(thread_safe_var tsv)
+{
+    struct lr_var *vp = tsv->impl;
+    struct vwrapper *wrapper = pthread_getspecific(vp->tkey);
+
+    if (wrapper == NULL)
+        return;
+    if (pthread_setspecific(vp->tkey, NULL) != 0)
+        abort();
+    wrapper_free(wrapper);
+}
+
+/* Wait for a read indicator to drain */
+static int
+lr_wait_for_readers(struct lr_var *vp, uint32_t vi,
+                    const struct timespec *deadline)
+{
+    struct timespec now;
+    uint32_t spins = 0;
+
+    while (atomic_read_32(&vp->readers[vi]) > 0) {
+        /* Readers depart promptly, so check the time only now and then */
+        if (deadline != NULL && (spins++ & 0x3f) == 0 &&
+            clock_gettime(CLOCK_REALTIME, &now) == 0 &&
+            (now.tv_sec > deadline->tv_sec ||
+             (now.tv_sec == deadline->tv_sec &&
+              now.tv_nsec >= deadline->tv_nsec)))
+            return ETIMEDOUT;
+        sched_yield();
+    }
+    return 0;
+}
+
+/*
+ * Wait until no reader can be reading the instance other than lr.
+ * Readers that read left_right before the previous write toggled it may
+ * still be reading it.  Wait for them to depart: toggle version_index
+ * so that new readers arrive at the other read indicator, with a wait
+ * before and after so that we can't miss readers that arrived at either
+ * one.
+ *
+ * Giving up at the deadline leaves things as they'd be had a drain
+ * finished and the write not happened: a later drain waits for both
+ * read indicators all over again.
+ */
+static int
+lr_drain(struct lr_var *vp, const struct timespec *deadline)
+{
+    uint32_t vi;
+    int err;
+
+    vi = atomic_read_32(&vp->version_index) & 0x1;
+    if ((err = lr_wait_for_readers(vp, vi ^ 0x1, deadline)) != 0)
+        return err;
+    (void) atomic_cas_32(&vp->version_index, vi, vi ^ 0x1);
+    return lr_wait_for_readers(vp, vi, deadline);
+}
+
+static int
+lr_prepare(thread_safe_var tsv, void *cfdata, void **cookiep)
+{
+    struct vwrapper *wrapper;
+
+    /* Build a wrapper for the new value; the var holds one reference */
+    if ((*cookiep = wrapper = calloc(1, sizeof(*wrapper))) == NULL)
+        return errno;
+    wrapper->dtor = tsv->dtor;
+    wrapper->ptr = cfdata;
+    wrapper->nref = 1;
+    return 0;
+}
+
+static int
+lr_publish(thread_safe_var tsv, void *cookie, uint64_t new_version,
+           const struct timespec *deadline, void **garbagep)
+{
+    struct lr_var *vp = tsv->impl;
+    struct vwrapper *wrapper = cookie;
+    uint32_t lr;
+    int err;
+
+    /* vp->left_right is stable: we hold the write_lock */
+    lr = atomic_read_32(&vp->left_right) & 0x1;
+
+    /* Wait for readers of the instance we're about to overwrite */
+    if ((err = lr_drain(vp, deadline)) != 0)
+        return err;
+    wrapper->version = new_version;
+    tsv_live_add(tsv->live, &wrapper->live, new_version);
+
+    /*
+     * Now no reader can be reading the other instance; update it.  Its
+     * value is NULL if lr_oldest() already released it.
+     */
+    *garbagep = vp->instances[lr ^ 0x1];
+    atomic_write_ptr((volatile void **)&vp->instances[lr ^ 0x1], wrapper);
+
+    /*
+     * Publish.  We toggle with atomic CAS rather than a release write
+     * because we need a full memory barrier between toggling and the
+     * next writer's reads of the read indicators (readers, in turn,
+     * arrive with an atomic increment before reading left_right).
+     */
+    (void) atomic_cas_32(&vp->left_right, lr, lr ^ 0x1);
+    atomic_write_64(&vp->version, new_version);
+    return 0;
+}
+
+static void
+lr_abort(thread_safe_var tsv, void *cookie)
+{
+    (void) tsv;
+    free(cookie);
+}
+
+/* Release the var's reference to the value before the previous one */
+static void
+lr_reclaim(thread_safe_var tsv, void *garbage)
+{
+    (void) tsv;
+    wrapper_free(garbage);
+}
+
+/*
+ * The var's reference to the previous value holds up synchronizers, so
+ * release it now instead of at the next write.  All wrappers are in
+ * tsv->live, so that's all we need to report.
+ */
+static uint64_t
+lr_oldest(thread_safe_var tsv, void **garbagep)
+{
+    struct lr_var *vp = tsv->impl;
+    uint32_t lr = atomic_read_32(&vp->left_right) & 0x1;
+
+    *garbagep = NULL;
+    if (vp->instances[lr ^ 0x1] == NULL)
+        return UINT64_MAX;
+    (void) lr_drain(vp, NULL);
+    *garbagep = vp->instances[lr ^ 0x1];
+    atomic_write_ptr((volatile void **)&vp->instances[lr ^ 0x1], NULL);
+    return UINT64_MAX;
+}
+
+static int
+lr_acquire(thread_safe_var tsv, void **handlep, void **res,
+           uint64_t *version)
+{
+    struct lr_var *vp = tsv->impl;
+    struct vwrapper *wrapper;
+    int err;
+
+    /* Our thread's reference keeps the wrapper alive while we add one */
+    if ((err = lr_get(tsv, res, version)) != 0 ||
+        (wrapper = pthread_getspecific(vp->tkey)) == NULL)
+        return err;
+    (void) atomic_inc_32_nv(&wrapper->nref);
+    *handlep = wrapper;
+    return 0;
+}
+
+static void
+lr_ref_dup(thread_safe_var tsv, void *handle)
+{
+    (void) tsv;
+    (void) atomic_inc_32_nv(&((struct vwrapper *)handle)->nref);
+}
+
+static void
+lr_ref_put(thread_safe_var tsv, void *handle)
+{
+    (void) tsv;
+    wrapper_free(handle);
+}
+
+/* Output this thread's value without looking at the var */
+static int
+lr_peek(thread_safe_var tsv, void **res, uint64_t *version)
+{
+    struct lr_var *vp = tsv->impl;
+    struct vwrapper *wrapper;
+
+    if ((wrapper = pthread_getspecific(vp->tkey)) == NULL)
+        return ENOENT;
+    *res = wrapper->ptr;
+    *version = wrapper->version;
+    return 0;
+}
+
+const struct tsv_ops tsv_left_right_ops = {
+    "leftright",
+    lr_init,
+    lr_destroy,
+    lr_get,
+    lr_release,
+    lr_prepare,
+    lr_publish,
+    lr_abort,
+    lr_reclaim,
+    lr_oldest,
+    lr_acquire,
+    lr_ref_dup,
+    lr_ref_put,
+    lr_peek,
+};
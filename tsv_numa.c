@@ -0,0 +1,565 @@
+/*
+ * Copyright (c) 2015 Cryptonector LLC
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE /* for sched_getcpu() */
+#endif
+
+#include <sys/types.h>
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "thread_safe_global.h"
+#include "tsv_impl.h"
+#include "atomics.h"
+
+/*
+ * NUMA Replicas
+ *
+ * In every design all readers read the current value's pointer and
+ * version from the same few cache lines, and every write invalidates
+ * those lines in every reader's cache.  On multi-socket systems that
+ * traffic crosses the interconnect: cheap reads become remote cache
+ * misses after every write.
+ *
+ * A THREAD_SAFE_VAR_NUMA_REPLICAS var has one child TSV (a replica) per
+ * NUMA node, of the design picked by the rest of its attributes.
+ * Readers read only the replica for the node they're running on, so
+ * they share cache lines only with readers on the same node.  Writers
+ * write every replica: writes get more expensive, reads get cheaper.
+ *
+ * Values are boxed (see tsv_impl.h).  By default all replicas share the
+ * caller's value, and only the pointer and version are replicated.  If
+ * the var has a clone callback, the writer asks it for a copy of the
+ * value for each node other than the writer's own, so that readers
+ * touch only node-local memory.
+ *
+ * Writers prepare writes to every replica (allocating, cloning) before
+ * taking the write lock, then publish them one node at a time.  A
+ * thread that migrates from a node whose replica has been updated to
+ * one whose replica hasn't been yet could thus see versions go
+ * backwards, so readers remember which node they last read from, and
+ * when that changes, they read both replicas and keep the newer value.
+ *
+ * Every replica's write honours the writer's deadline, if any.  If the
+ * first replica's write fails, so does the whole write.  After that the
+ * write has happened, so if a later replica's write fails (say, because
+ * its readers took too long to drain), that replica is marked as behind
+ * and its node's readers read the first replica instead until a later
+ * write catches it up.
+ *
+ * The replicas' state is allocated by the thread that initializes the
+ * var, so page placement is up to the OS (first touch, typically).  We
+ * don't depend on libnuma: the topology comes from sysfs.
+ */
+
+/* Nodes beyond this many share replicas */
+#define TSV_NUMA_MAX_NODES      64
+
+struct numa_var {
+    pthread_key_t       tkey;           /* 1 + node last read from */
+    int                 nnodes;         /* number of replicas */
+    thread_safe_var_clone_f clone;      /* optional */
+    thread_safe_var     replicas[TSV_NUMA_MAX_NODES];
+    volatile uint32_t   behind[TSV_NUMA_MAX_NODES]; /* missed a write */
+};
+
+/* A prepared write */
+struct numa_write {
+    struct tsv_box      *shared;        /* box of the caller's value */
+    int                 owned;          /* whether we own the value */
+    struct numa_node_write {
+        struct tsv_box  *box;           /* box for this node's replica */
+        void            *cookie;        /* replica's prepared write */
+    } *nodes;                           /* follows this struct */
+};
+
+static pthread_once_t numa_once = PTHREAD_ONCE_INIT;
+static int numa_nnodes = 1;
+static int numa_ncpus;
+static unsigned char *numa_cpu_node;    /* CPU -> node map */
+static int numa_fake_nnodes;            /* for tests; 0 -> real topology */
+static volatile uint32_t numa_fake_next;
+
+/* Parse a sysfs CPU list ("0-3,8-11") into the CPU -> node map */
+static void
+numa_parse_cpulist(FILE *f, int node)
+{
+    int first, last, c;
+
+    while (fscanf(f, "%d", &first) == 1) {
+        last = first;
+        if ((c = getc(f)) == '-') {
+            if (fscanf(f, "%d", &last) != 1)
+                return;
+            c = getc(f);
+        }
+        for (; first <= last && first < numa_ncpus; first++)
+            numa_cpu_node[first] = node;
+        if (c != ',')
+            return;
+    }
+}
+
+static void
+numa_topology_init(void)
+{
+#ifdef __linux__
+    char path[64];
+    FILE *f;
+    long ncpus;
+    int node;
+
+    if ((ncpus = sysconf(_SC_NPROCESSORS_CONF)) < 1)
+        return;
+    if ((numa_cpu_node = calloc(ncpus, sizeof(numa_cpu_node[0]))) == NULL)
+        return;
+    numa_ncpus = ncpus;
+
+    for (node = 0; node < TSV_NUMA_MAX_NODES; node++) {
+        (void) snprintf(path, sizeof(path),
+                        "/sys/devices/system/node/node%d/cpulist", node);
+        if ((f = fopen(path, "r")) == NULL)
+            continue; /* node numbers can have holes */
+        numa_parse_cpulist(f, node);
+        (void) fclose(f);
+        numa_nnodes = node + 1;
+    }
+#endif
+}
+
+/**
+ * Returns the number of NUMA nodes, or 1 if unknown
+ */
+int
+tsv_numa_nodes(void)
+{
+    (void) pthread_once(&numa_once, numa_topology_init);
+    if (numa_fake_nnodes > 0)
+        return numa_fake_nnodes;
+    return numa_nnodes;
+}
+
+/**
+ * Pretend there are this many NUMA nodes (for tests)
+ *
+ * Threads then hop to the next node every time they ask which one
+ * they're on, so readers and writers see every replica and migrate all
+ * the time.  Only vars initialized after this call get that many
+ * replicas.  Zero restores the real topology.  Call this only while no
+ * other thread is using TSVs.
+ *
+ * @param [in] nnodes Number of nodes to pretend there are, or 0
+ */
+void
+tsv_numa_fake_nodes(int nnodes)
+{
+    (void) pthread_once(&numa_once, numa_topology_init);
+    if (nnodes > TSV_NUMA_MAX_NODES)
+        nnodes = TSV_NUMA_MAX_NODES;
+    numa_fake_nnodes = nnodes > 0 ? nnodes : 0;
+}
+
+/**
+ * Returns the NUMA node the caller is running on, or 0 if unknown
+ *
+ * The answer can be stale by the time the caller looks at it, as
+ * threads can migrate at any time.
+ */
+int
+tsv_numa_node(void)
+{
+#ifdef __linux__
+    int cpu;
+#endif
+
+    if (numa_fake_nnodes > 0)
+        return atomic_inc_32_nv(&numa_fake_next) % numa_fake_nnodes;
+#ifdef __linux__
+    if (tsv_numa_nodes() > 1 && (cpu = sched_getcpu()) >= 0 &&
+        cpu < numa_ncpus)
+        return numa_cpu_node[cpu];
+#endif
+    return 0;
+}
+
+static int
+numa_init(thread_safe_var tsv, const thread_safe_var_attr *attr)
+{
+    struct numa_var *vp;
+    thread_safe_var_attr replica_attr;
+    int err;
+    int i;
+
+    if ((vp = calloc(1, sizeof(*vp))) == NULL)
+        return errno;
+
+    vp->nnodes = tsv_numa_nodes();
+    vp->clone = attr->clone;
+    replica_attr = *attr;
+    replica_attr.flags &= ~THREAD_SAFE_VAR_NUMA_REPLICAS;
+    replica_attr.clone = NULL;
+    replica_attr.max_stale_ns = 0;     /* the NUMA var does these */
+    replica_attr.max_stale_reads = 0;
+    replica_attr.max_retained_bytes = 0;
+
+    for (i = 0; i < vp->nnodes; i++) {
+        if ((err = thread_safe_var_init_attr(&vp->replicas[i],
+                                             tsv_box_release,
+                                             &replica_attr)) != 0) {
+            while (i-- > 0)
+                thread_safe_var_destroy(vp->replicas[i]);
+            free(vp);
+            return err;
+        }
+    }
+    if ((err = pthread_key_create(&vp->tkey, NULL)) != 0) {
+        for (i = 0; i < vp->nnodes; i++)
+            thread_safe_var_destroy(vp->replicas[i]);
+        free(vp);
+        return err;
+    }
+    tsv->impl = vp;
+    return 0;
+}
+
+static void
+numa_destroy(thread_safe_var tsv)
+{
+    struct numa_var *vp = tsv->impl;
+    int i;
+
+    for (i = 0; i < vp->nnodes; i++)
+        thread_safe_var_destroy(vp->replicas[i]);
+    (void) pthread_key_delete(vp->tkey);
+    free(vp);
+}
+
+/* Reads the nearest replica; the box stays alive until our next read */
+static int
+numa_read(struct numa_var *vp, struct tsv_box **boxp)
+{
+    struct tsv_box *box;
+    struct tsv_box *last_box;
+    uintptr_t last;
+    int node;
+    int err;
+
+    node = tsv_numa_node();
+    if (node >= vp->nnodes || atomic_read_32(&vp->behind[node]))
+        node = 0; /* the first replica is never behind */
+    if ((err = thread_safe_var_get(vp->replicas[node],
+                                   (void **)&box, NULL)) != 0)
+        return err;
+
+    last = (uintptr_t)pthread_getspecific(vp->tkey);
+    if (last != 0 && last - 1 != (uintptr_t)node) {
+        /*
+         * We moved.  The replica we last read may be ahead of this one
+         * if we raced with a writer; don't go backwards.
+         */
+        if ((err = thread_safe_var_get(vp->replicas[last - 1],
+                                       (void **)&last_box, NULL)) != 0)
+            return err;
+        if (last_box != NULL &&
+            (box == NULL || last_box->version > box->version)) {
+            thread_safe_var_release(vp->replicas[node]);
+            box = last_box;
+            node = last - 1;
+        } else {
+            thread_safe_var_release(vp->replicas[last - 1]);
+        }
+    }
+    if (last != (uintptr_t)node + 1 &&
+        (err = pthread_setspecific(vp->tkey,
+                                   (void *)((uintptr_t)node + 1))) != 0)
+        return err;
+
+    *boxp = box;
+    return 0;
+}
+
+static int
+numa_get(thread_safe_var tsv, void **res, uint64_t *version)
+{
+    struct tsv_box *box;
+    int err;
+
+    if ((err = numa_read(tsv->impl, &box)) != 0)
+        return err;
+    if (box != NULL) {
+        *res = box->value;
+        *version = box->version;
+    }
+    return 0;
+}
+
+static void
+numa_release(thread_safe_var tsv)
+{
+    struct numa_var *vp = tsv->impl;
+    uintptr_t last;
+
+    if ((last = (uintptr_t)pthread_getspecific(vp->tkey)) != 0)
+        thread_safe_var_release(vp->replicas[last - 1]);
+}
+
+/* Undo a node's part of a prepared write, if not yet published */
+static void
+numa_drop_node(struct numa_var *vp, struct numa_write *nw, int node)
+{
+    thread_safe_var replica = vp->replicas[node];
+    struct tsv_box *box = nw->nodes[node].box;
+
+    if (nw->nodes[node].cookie != NULL)
+        replica->ops->abort(replica, nw->nodes[node].cookie);
+    nw->nodes[node].cookie = NULL;
+    nw->nodes[node].box = NULL;
+
+    if (box == NULL || atomic_dec_32_nv(&box->nref) > 0)
+        return;
+    /* On failure the caller keeps its value, but not our clones */
+    if ((box != nw->shared || nw->owned) && box->dtor != NULL)
+        box->dtor(box->value);
+    if (box == nw->shared)
+        nw->shared = NULL;
+    tsv_live_remove(&box->live);
+    free(box);
+}
+
+static void
+numa_abort(thread_safe_var tsv, void *cookie)
+{
+    struct numa_var *vp = tsv->impl;
+    struct numa_write *nw = cookie;
+    int i;
+
+    for (i = 0; i < vp->nnodes; i++)
+        numa_drop_node(vp, nw, i);
+    if (nw->shared != NULL && nw->shared->nref == 0)
+        free(nw->shared);
+    free(nw);
+}
+
+static int
+numa_prepare(thread_safe_var tsv, void *data, void **cookiep)
+{
+    struct numa_var *vp = tsv->impl;
+    struct numa_write *nw;
+    struct tsv_box *box;
+    thread_safe_var replica;
+    void *clone;
+    int node = tsv_numa_node();
+    int err;
+    int i;
+
+    if ((nw = calloc(1, sizeof(*nw) +
+                        vp->nnodes * sizeof(nw->nodes[0]))) == NULL)
+        return errno;
+    nw->nodes = (struct numa_node_write *)(nw + 1);
+    if ((nw->shared = calloc(1, sizeof(*nw->shared))) == NULL) {
+        err = errno;
+        free(nw);
+        return err;
+    }
+    nw->shared->dtor = tsv->dtor;
+    nw->shared->value = data;
+    nw->shared->nref = 0;
+
+    for (i = 0; i < vp->nnodes; i++) {
+        /* The caller's value presumably is local to the caller's node */
+        box = nw->shared;
+        if (vp->clone != NULL && i != node &&
+            (clone = vp->clone(data, i)) != NULL) {
+            if ((box = calloc(1, sizeof(*box))) == NULL) {
+                err = errno;
+                if (tsv->dtor != NULL)
+                    tsv->dtor(clone);
+                numa_abort(tsv, nw);
+                return err;
+            }
+            box->dtor = tsv->dtor;
+            box->value = clone;
+        }
+        box->nref++;
+        nw->nodes[i].box = box;
+
+        replica = vp->replicas[i];
+        if ((err = replica->ops->prepare(replica, box,
+                                         &nw->nodes[i].cookie)) != 0) {
+            nw->nodes[i].cookie = NULL;
+            numa_abort(tsv, nw);
+            return err;
+        }
+    }
+    *cookiep = nw;
+    return 0;
+}
+
+static int
+numa_publish(thread_safe_var tsv, void *cookie, uint64_t new_version,
+             const struct timespec *deadline, void **garbagep)
+{
+    struct numa_var *vp = tsv->impl;
+    struct numa_write *nw = cookie;
+    void *replica_cookie;
+    int err;
+    int i;
+
+    *garbagep = NULL;
+    for (i = 0; i < vp->nnodes; i++) {
+        nw->nodes[i].box->version = new_version;
+        if (nw->nodes[i].box->live.live == NULL)
+            tsv_live_add(tsv->live, &nw->nodes[i].box->live, new_version);
+    }
+
+    for (i = 0; i < vp->nnodes; i++) {
+        replica_cookie = nw->nodes[i].cookie;
+        nw->nodes[i].cookie = NULL; /* consumed either way */
+        if ((err = tsv_set_prepared(vp->replicas[i], replica_cookie,
+                                    deadline, NULL)) == 0) {
+            nw->nodes[i].box = NULL; /* the replica's reference now */
+            nw->owned = 1;
+            if (vp->behind[i])
+                atomic_write_32(&vp->behind[i], 0);
+            continue;
+        }
+        numa_drop_node(vp, nw, i);
+        if (!nw->owned)
+            return err;
+        /*
+         * The first replica has the new value, so the write has
+         * happened.  This node's readers must read that replica until
+         * this one catches up.
+         */
+        atomic_write_32(&vp->behind[i], 1);
+    }
+    nw->shared = NULL; /* freed by the last replica to release it */
+    *garbagep = nw;
+    return 0;
+}
+
+/* Free what remains of a write that was published */
+static void
+numa_reclaim(thread_safe_var tsv, void *garbage)
+{
+    (void) tsv;
+    free(garbage);
+}
+
+/* Have the replicas release what they hold that no reader does */
+static uint64_t
+numa_oldest(thread_safe_var tsv, void **garbagep)
+{
+    struct numa_var *vp = tsv->impl;
+    uint64_t oldest;
+    int i;
+
+    *garbagep = NULL;
+    for (i = 0; i < vp->nnodes; i++)
+        (void) tsv_oldest(vp->replicas[i], &oldest);
+    return UINT64_MAX;  /* boxes are in tsv->live */
+}
+
+static int
+numa_acquire(thread_safe_var tsv, void **handlep, void **res,
+             uint64_t *version)
+{
+    struct tsv_box *box;
+    int err;
+
+    /* Our reference in the replica keeps the box alive while we add one */
+    if ((err = numa_read(tsv->impl, &box)) != 0 || box == NULL)
+        return err;
+    (void) atomic_inc_32_nv(&box->nref);
+    *handlep = box;
+    *res = box->value;
+    *version = box->version;
+    return 0;
+}
+
+static void
+numa_ref_dup(thread_safe_var tsv, void *handle)
+{
+    (void) tsv;
+    (void) atomic_inc_32_nv(&((struct tsv_box *)handle)->nref);
+}
+
+static void
+numa_ref_put(thread_safe_var tsv, void *handle)
+{
+    (void) tsv;
+    tsv_box_release(handle);
+}
+
+/* Output this thread's value from the replica it last read */
+static int
+numa_peek(thread_safe_var tsv, void **res, uint64_t *version)
+{
+    struct numa_var *vp = tsv->impl;
+    thread_safe_var replica;
+    struct tsv_box *box;
+    uintptr_t last;
+    uint64_t vers;
+
+    if ((last = (uintptr_t)pthread_getspecific(vp->tkey)) == 0)
+        return ENOENT;
+    replica = vp->replicas[last - 1];
+    if (replica->ops->peek(replica, (void **)&box, &vers) != 0 ||
+        box == NULL)
+        return ENOENT;
+    *res = box->value;
+    *version = box->version;
+    return 0;
+}
+
+const struct tsv_ops tsv_numa_ops = {
+    "numa",
+    numa_init,
+    numa_destroy,
+    numa_get,
+    numa_release,
+    numa_prepare,
+    numa_publish,
+    numa_abort,
+    numa_reclaim,
+    numa_oldest,
+    numa_acquire,
+    numa_ref_dup,
+    numa_ref_put,
+    numa_peek,
+};
@@ -0,0 +1,468 @@
+/*
+ * Copyright (c) 2015 Cryptonector LLC
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "thread_safe_global.h"
+#include "tsv_impl.h"
+#include "atomics.h"
+
+/*
+ * Quiescent-State-Based Reclamation (QSBR) Design
+ *
+ * Here readers do nothing but an acquire-fenced load of a pointer to
+ * the current value (a plain load on most architectures).  In exchange,
+ * reader threads must periodically announce that they hold no
+ * references to values read from any QSBR TSV by calling
+ * thread_safe_var_quiescent() at natural points in their execution
+ * (e.g., between requests).  A value read from a TSV remains valid
+ * until the reading thread's next quiescent state, not merely until its
+ * next read of the TSV.
+ *
+ * There is a single, process-wide grace period counter, and a
+ * process-wide registry of reader threads, each of which records the
+ * grace period that was current at its last quiescent state.  Reader
+ * threads register on their first read and go offline when they exit.
+ *
+ * Writers publish a new value, then retire the old one, tagging it with
+ * a freshly incremented grace period.  A retired value can be destroyed
+ * once every online reader thread has announced a quiescent state at or
+ * after that grace period.  Writers never wait for readers: they destroy
+ * whichever retired values are safe to destroy at each write, leaving
+ * the rest for subsequent writes (or for destruction of the TSV).
+ *
+ * Reads are O(1) and never block, spin, or call the allocator (except
+ * for a thread's very first read).  Writes are O(N) where N is the
+ * number of reader threads ever registered at once.
+ *
+ * Note that a registered reader thread that stops calling
+ * thread_safe_var_quiescent() holds up the destruction of all values
+ * retired from all QSBR TSVs since, though it does not hold up writers.
+ */
+
+/* This is a value, either current or retired */
+struct qvalue {
+    struct qvalue           *next;      /* next retired value; writer-only */
+    void                    *value;     /* actual value */
+    uint64_t                version;    /* version number */
+    uint64_t                retired;    /* grace period when retired */
+    volatile uint32_t       npinned;    /* atomic; thread_safe_var_ref's */
+};
+
+/* Each thread that has read any QSBR TSV gets one of these */
+struct qsbr_reader {
+    struct qsbr_reader      *next;      /* registry is push-only */
+    volatile uint64_t       ctr;        /* atomic; grace period at last QS */
+    volatile uint32_t       in_use;     /* atomic */
+};
+
+static volatile uint64_t            qsbr_gp = 1;    /* atomic; 0 -> offline */
+static volatile struct qsbr_reader  *qsbr_readers;  /* atomic registry head */
+static pthread_key_t                qsbr_key;       /* to detect thread exits */
+static pthread_once_t               qsbr_once = PTHREAD_ONCE_INIT;
+static int                          qsbr_key_err;
+
+struct qsbr_var {
+    volatile struct qvalue  *current;       /* atomic current value */
+    struct qvalue           *retired;       /* writer-only; oldest first */
+    struct qvalue           **retired_tail; /* writer-only */
+};
+
+/* Thread specific key destructor for handling thread exit */
+static void
+qsbr_reader_exit(void *data)
+{
+    struct qsbr_reader *r = data;
+
+    if (r == NULL)
+        return;
+
+    /* Go offline, then release the registry entry for reuse */
+    atomic_write_64(&r->ctr, 0);
+    atomic_write_32(&r->in_use, 0);
+}
+
+static void
+qsbr_key_init(void)
+{
+    qsbr_key_err = pthread_key_create(&qsbr_key, qsbr_reader_exit);
+}
+
+/* Register the calling thread as a reader (slow path; first read only) */
+static int
+qsbr_register(void)
+{
+    struct qsbr_reader *r;
+    struct qsbr_reader *head;
+    uint64_t gp;
+
+    /* Look for a registry entry released by an exited thread */
+    for (r = atomic_read_ptr((volatile void **)&qsbr_readers);
+         r != NULL;
+         r = r->next) {
+        if (atomic_cas_32(&r->in_use, 0, 1) == 0)
+            break;
+    }
+
+    if (r == NULL) {
+        if ((r = calloc(1, sizeof(*r))) == NULL)
+            return errno;
+        r->ctr = 0;
+        r->in_use = 1;
+        do {
+            head = atomic_read_ptr((volatile void **)&qsbr_readers);
+            r->next = head;
+        } while (atomic_cas_ptr((volatile void **)&qsbr_readers,
+                                head, r) != head);
+    }
+
+    /*
+     * Come online.  This must be a full memory barrier so that our
+     * subsequent reads of TSVs cannot be reordered before it: a writer
+     * that sees us as offline will not wait for us, so we must see the
+     * values it published.
+     */
+    gp = atomic_read_64(&qsbr_gp);
+    (void) atomic_cas_64(&r->ctr, 0, gp);
+    return pthread_setspecific(qsbr_key, r);
+}
+
+static int
+qsbr_init(thread_safe_var tsv, const thread_safe_var_attr *attr)
+{
+    struct qsbr_var *vp;
+    int err;
+
+    (void) attr;
+
+    if ((err = pthread_once(&qsbr_once, qsbr_key_init)) != 0)
+        return err;
+    if (qsbr_key_err != 0)
+        return qsbr_key_err;
+
+    if ((vp = calloc(1, sizeof(*vp))) == NULL)
+        return errno;
+
+    vp->current = NULL;
+    vp->retired = NULL;
+    vp->retired_tail = &vp->retired;
+    tsv->impl = vp;
+    return 0;
+}
+
+static void
+qsbr_destroy(thread_safe_var tsv)
+{
+    struct qsbr_var *vp = tsv->impl;
+    struct qvalue *v;
+
+    if ((v = atomic_read_ptr((volatile void **)&vp->current)) != NULL) {
+        v->next = vp->retired;
+        vp->retired = v;
+    }
+    while ((v = vp->retired) != NULL) {
+        vp->retired = v->next;
+        if (tsv->dtor != NULL)
+            tsv->dtor(v->value);
+        free(v);
+    }
+    free(vp);
+}
+
+/*
+ * The value output remains valid until this thread next calls
+ * thread_safe_var_quiescent().
+ */
+static int
+qsbr_get(thread_safe_var tsv, void **res, uint64_t *version)
+{
+    struct qsbr_var *vp = tsv->impl;
+    struct qvalue *v;
+    int err;
+
+    /* First time for this thread -> slow path (register thread) */
+    if (pthread_getspecific(qsbr_key) == NULL &&
+        (err = qsbr_register()) != 0)
+        return err;
+
+    /* Fast path: one acquire read.  O(1) */
+    if ((v = atomic_read_ptr((volatile void **)&vp->current)) != NULL) {
+        *res = v->value;
+        *version = v->version;
+    }
+    return 0;
+}
+
+/*
+ * In the QSBR design references are not tracked per-variable, so this
+ * does nothing; references are released by thread_safe_var_quiescent().
+ */
+static void
+qsbr_release(thread_safe_var tsv)
+{
+    (void) tsv;
+}
+
+/**
+ * Announce a quiescent state for the calling thread: the calling thread
+ * holds no references to values read from any QSBR TSV.
+ *
+ * Reader threads of QSBR TSVs should call this at natural points in
+ * their execution (e.g., between requests).  This is cheap: one
+ * acquire-fenced read and one release-fenced write, and no locks.  It
+ * is a no-op in threads that have never read a QSBR TSV.
+ */
+void
+thread_safe_var_quiescent(void)
+{
+    struct qsbr_reader *r;
+
+    if (pthread_once(&qsbr_once, qsbr_key_init) != 0 || qsbr_key_err != 0)
+        return;
+    if ((r = pthread_getspecific(qsbr_key)) == NULL)
+        return; /* Not a reader */
+
+    /*
+     * The acquire read of the grace period counter orders our
+     * subsequent reads of TSVs after any publications that preceded the
+     * grace period we announce, and the release write orders our prior
+     * reads of values before the announcement.
+     */
+    atomic_write_64(&r->ctr, atomic_read_64(&qsbr_gp));
+    tsv_sync_notify();
+}
+
+/*
+ * Detach and return retired values that no reader can be referencing.
+ * Must be called with the write lock held.  O(N) where N is the number
+ * of registered readers.
+ */
+static struct qvalue *
+qsbr_collect(struct qsbr_var *vp)
+{
+    struct qsbr_reader *r;
+    struct qvalue *garbage = NULL;
+    struct qvalue **tailp = &garbage;
+    struct qvalue **prevp = &vp->retired;
+    struct qvalue *v;
+    uint64_t min_ctr = UINT64_MAX;
+    uint64_t ctr;
+
+    if (vp->retired == NULL)
+        return NULL;
+
+    for (r = atomic_read_ptr((volatile void **)&qsbr_readers);
+         r != NULL;
+         r = r->next) {
+        /* Offline readers (ctr == 0) hold no references */
+        if ((ctr = atomic_read_64(&r->ctr)) != 0 && ctr < min_ctr)
+            min_ctr = ctr;
+    }
+
+    /*
+     * The retired list is in grace period order, so we can stop at the
+     * first value that some reader might still be referencing.
+     *
+     * Values pinned by references (see qsbr_acquire()) stay.  Readers
+     * pin values before announcing quiescent states, and we read pin
+     * counts after reading the readers' counters, so we can't miss a
+     * pin.
+     */
+    while ((v = *prevp) != NULL && v->retired <= min_ctr) {
+        if (atomic_read_32(&v->npinned) > 0) {
+            prevp = &v->next;
+            continue;
+        }
+        *prevp = v->next;
+        *tailp = v;
+        tailp = &v->next;
+    }
+    *tailp = NULL;
+    if (*prevp == NULL)
+        vp->retired_tail = prevp;
+    return garbage;
+}
+
+static int
+qsbr_prepare(thread_safe_var tsv, void *data, void **cookiep)
+{
+    struct qvalue *new_value;
+
+    (void) tsv;
+    if ((*cookiep = new_value = calloc(1, sizeof(*new_value))) == NULL)
+        return errno;
+    new_value->value = data;
+    return 0;
+}
+
+static int
+qsbr_publish(thread_safe_var tsv, void *cookie, uint64_t new_version,
+             const struct timespec *deadline, void **garbagep)
+{
+    struct qsbr_var *vp = tsv->impl;
+    struct qvalue *new_value = cookie;
+    struct qvalue *old_value;
+
+    (void) deadline;    /* we never wait for readers */
+
+    /* No allocations/free()s done with write lock held */
+
+    old_value = atomic_read_ptr((volatile void **)&vp->current);
+    new_value->version = new_version;
+
+    /* Publish the new value */
+    atomic_write_ptr((volatile void **)&vp->current, new_value);
+
+    if (old_value != NULL) {
+        /*
+         * Retire the old value.  Readers that announce a quiescent state
+         * at or after this grace period cannot be referencing it.  The
+         * atomic increment is also a full memory barrier between the
+         * publication above and our reading of reader counters below.
+         */
+        old_value->retired = atomic_inc_64_nv(&qsbr_gp);
+        old_value->next = NULL;
+        *vp->retired_tail = old_value;
+        vp->retired_tail = &old_value->next;
+    }
+
+    *garbagep = qsbr_collect(vp);
+    return 0;
+}
+
+static void
+qsbr_abort(thread_safe_var tsv, void *cookie)
+{
+    (void) tsv;
+    free(cookie);
+}
+
+/* Retired values wait for the next write; collect them now */
+static uint64_t
+qsbr_oldest(thread_safe_var tsv, void **garbagep)
+{
+    struct qsbr_var *vp = tsv->impl;
+    struct qvalue *v;
+
+    *garbagep = qsbr_collect(vp);
+    if (vp->retired != NULL)
+        return vp->retired->version;
+    if ((v = atomic_read_ptr((volatile void **)&vp->current)) != NULL)
+        return v->version;
+    return UINT64_MAX;
+}
+
+static void
+qsbr_reclaim(thread_safe_var tsv, void *garbage)
+{
+    struct qvalue *v;
+
+    /* Free old values now, holding no locks */
+    while ((v = garbage) != NULL) {
+        garbage = v->next;
+        if (tsv->dtor != NULL)
+            tsv->dtor(v->value);
+        free(v);
+    }
+}
+
+static int
+qsbr_acquire(thread_safe_var tsv, void **handlep, void **res,
+             uint64_t *version)
+{
+    struct qsbr_var *vp = tsv->impl;
+    struct qvalue *v;
+    int err;
+
+    if (pthread_getspecific(qsbr_key) == NULL &&
+        (err = qsbr_register()) != 0)
+        return err;
+
+    /* Not being quiescent keeps the value alive while we pin it */
+    if ((v = atomic_read_ptr((volatile void **)&vp->current)) != NULL) {
+        (void) atomic_inc_32_nv(&v->npinned);
+        *handlep = v;
+        *res = v->value;
+        *version = v->version;
+    }
+    return 0;
+}
+
+static void
+qsbr_ref_dup(thread_safe_var tsv, void *handle)
+{
+    (void) tsv;
+    (void) atomic_inc_32_nv(&((struct qvalue *)handle)->npinned);
+}
+
+/* The value gets destroyed by a later write (or synchronizer) */
+static void
+qsbr_ref_put(thread_safe_var tsv, void *handle)
+{
+    (void) tsv;
+    if (atomic_dec_32_nv(&((struct qvalue *)handle)->npinned) == 0)
+        tsv_sync_notify();
+}
+
+/*
+ * Readers hold no per-variable state to peek at, and qsbr_get() writes
+ * nothing shared anyway.
+ */
+static int
+qsbr_peek(thread_safe_var tsv, void **res, uint64_t *version)
+{
+    (void) tsv;
+    (void) res;
+    (void) version;
+    return ENOENT;
+}
+
+const struct tsv_ops tsv_qsbr_ops = {
+    "qsbr",
+    qsbr_init,
+    qsbr_destroy,
+    qsbr_get,
+    qsbr_release,
+    qsbr_prepare,
+    qsbr_publish,
+    qsbr_abort,
+    qsbr_reclaim,
+    qsbr_oldest,
+    qsbr_acquire,
+    qsbr_ref_dup,
+    qsbr_ref_put,
+    qsbr_peek,
+};
@@ -0,0 +1,866 @@
+/*
+ * Copyright (c) 2015 Cryptonector LLC
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <linux/membarrier.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "thread_safe_global.h"
+#include "tsv_impl.h"
+#include "atomics.h"
+
+/*
+ * Subscription Slot Design
+ *
+ * Here we have a linked list of extant values where the head has the
+ * current value and where the head and the next pointers are the only
+ * things written to by the writer; all readers "subscribe" and thence
+ * their state consists of a single pointer to what was at read-time the
+ * head of that linked list, with that pointer held where the writers
+ * can find it (in "subscription" slots) so they can garbage collect in
+ * order to release no-longer referenced values.
+ *
+ * Subscription is lock-less.  There's an index into a logical array of
+ * subscription slots.  New reader threads increment a counter to
+ * determine their index into this array.  If the array index goes past
+ * the allocated array size, then the array is grown lock-less-ly.  The
+ * array is maintained as a linked list of array chunks; when a reader
+ * goes to grow it, it will either win a race to grow it or lose it,
+ * using an atomic CAS operation to perform the growth; losers free
+ * their chunk and then look for their slot in the winner's chunk and
+ * possibly retry the array growth operation.
+ *
+ * Once subcribed, readers only ever do an acquire-fenced read on the
+ * head of the linked list of values, and write that to their slot with
+ * a release-fenced write.
+ *
+ * Writers only add new values at the head of the list, with the
+ * previous head as the next pointer of the new element.
+ *
+ * Writers also mark-and-sweep garbage collect the extant value list by
+ * reading every subscribed thread's pointer with an acquire-fenced
+ * read, marking all in-use values as such, then the writer releases and
+ * removes from the list those elements not marked as in-used.  Readers
+ * never read the next pointers of the list's elements.
+ *
+ * Readers do two fenced memory operations.  Writers do N fenced memory
+ * operations plus the writer lock acquire/release and any locks
+ * required to allocate and free list elements.  Readers may have to
+ * allocate the first time they read, but not thereafter.
+ *
+ * For vars initialized with the THREAD_SAFE_VAR_MEMBARRIER attribute
+ * flag (or all slot-list vars, when built with USE_TSV_MEMBARRIER), on a
+ * Linux kernel that supports membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED),
+ * readers do no fenced memory operations at all: they use plain loads
+ * and stores separated by compiler barriers, and the writer makes up
+ * for it by issuing the membarrier() system call after publishing a new
+ * value and before scanning the slots.  That system call forces a full
+ * memory barrier on every CPU running a thread of this process, so by
+ * the time it returns any reader's slot store that preceded its read of
+ * the old head is visible to the writer, and any reader that has yet to
+ * read the head will see the new one.  If the system call is not
+ * available we fall back on the fenced fast path.
+ */
+
+/*
+ * Design #2: Value list + per-reader thread slots.
+ *
+ * This design uses a list of referenced values and a set of slots, one per
+ * thread that has read this thread-safe global variable.
+ *
+ * Readers "subscribe" the first time they read a thread-safe global variable,
+ * allocating a slot.  Thereafter readers are very fast, using two fenced
+ * memory operations to get the newest value of the thread-safe global
+ * variable.
+ *
+ * Writers add new values to the head of a linked list, then garbage collect
+ * the list by visiting all the reader subscription slots to mark the list then
+ * sweep it.
+ *
+ * Readers never ever block and never call into the allocator.  First time
+ * readers are O(N), else they are O(1).  Compare to the two-slot design where
+ * readers may block briefly but are always O(1).
+ *
+ * Writers are serialized but do not block while holding the lock.  Writers do
+ * not call the allocator while holding the lock.  Writers are O(N).  Compare to
+ * the two-slot design, where writers are O(1).
+ */
+
+/* This is an element on the list of referenced values */
+struct value {
+    volatile struct value   *next;      /* previous (still ref'd) value */
+    void                    *value;     /* actual value */
+    volatile uint64_t       version;    /* version number */
+    volatile uint32_t       referenced; /* for mark and sweep */
+    volatile uint32_t       npinned;    /* atomic; thread_safe_var_ref's */
+};
+
+/*
+ * Each thread that has read this thread-safe global variable gets one
+ * of these.
+ */
+struct slot {
+    volatile struct value       *value; /* reference to last value read */
+    volatile uint32_t           in_use; /* atomic */
+    struct sl_var               *vp;    /* for cleanup from thread key dtor */
+    /* We could add a pthread_t here */
+};
+
+/*
+ * Slots are allocated in arrays that are linked into one larger logical
+ * array.
+ */
+struct slots {
+    volatile struct slots   *next;      /* atomic */
+    struct slot             *slot_array;/* atomic */
+    volatile uint32_t       slot_count; /* atomic */
+    uint32_t                slot_base;  /* logical index of slot_array[0] */
+};
+
+/*
+ * This outlives the thread_safe_var when readers still hold slots at
+ * destruction time, so it has its own copy of the value destructor.
+ */
+struct sl_var {
+    pthread_key_t           tkey;           /* to detect thread exits */
+    var_dtor_t              dtor;           /* value destructor */
+    volatile struct value   *values;        /* atomic ref'd value list head */
+    volatile struct slots   *slots;         /* atomic reader subscription slots */
+    volatile uint32_t       next_slot_idx;  /* atomic index of next new slot */
+    volatile uint32_t       slots_in_use;   /* atomic count of live readers */
+    uint32_t                nvalues;        /* writer-only; for housekeeping */
+    uint32_t                membarrier;     /* readers use no fences */
+};
+
+/*
+ * Lock-less utility that scans through logical slot array looking for a
+ * free slot to reuse.
+ */
+static struct slot *
+get_free_slot(struct sl_var *vp)
+{
+    struct slots *slots;
+    struct slot *slot;
+    size_t i;
+
+    for (slots = atomic_read_ptr((volatile void **)&vp->slots);
+         slots != NULL;
+         slots = atomic_read_ptr((volatile void **)&slots->next)) {
+        for (i = 0; i < slots->slot_count; i++) {
+            slot = &slots->slot_array[i];
+            if (atomic_cas_32(&slot->in_use, 0, 1) == 0)
+                return slot;
+        }
+    }
+    return NULL;
+}
+
+/* Lock-less utility to get nth slot */
+static struct slot *
+get_slot(struct sl_var *vp, uint32_t slot_idx)
+{
+    struct slots *slots;
+    uint32_t nslots = 0;
+
+    for (slots = atomic_read_ptr((volatile void **)&vp->slots);
+         slots != NULL;
+         slots = atomic_read_ptr((volatile void **)&slots->next)) {
+        nslots += slots->slot_count;
+        if (nslots > slot_idx)
+            break;
+    }
+
+    if (nslots <= slot_idx)
+        return NULL;
+
+    assert(slot_idx - slots->slot_base < slots->slot_count);
+    return &slots->slot_array[slot_idx - slots->slot_base];
+}
+
+/* Lock-less utility to grow the logical slot array */
+static int
+grow_slots(struct sl_var *vp, uint32_t slot_idx, int tries)
+{
+    uint32_t nslots = 0;
+    uint32_t additions;
+    uint32_t i;
+    volatile struct slots **slotsp;
+    struct slots *new_slots;
+
+    for (slotsp = &vp->slots;
+         atomic_read_ptr((volatile void **)slotsp) != NULL;
+         slotsp = &((struct slots *)atomic_read_ptr((volatile void **)slotsp))->next)
+        nslots += (*slotsp)->slot_count;
+
+    if (nslots > slot_idx)
+        return 0;
+
+    if (tries < 1)
+        return EAGAIN; /* shouldn't happen; XXX assert? */
+
+    if ((new_slots = calloc(1, sizeof(*new_slots))) == NULL)
+        return errno;
+
+    additions = (nslots == 0) ? 4 : nslots + nslots / 2;
+    while (slot_idx >= nslots + additions) {
+        additions += additions + additions / 2;
+        tries++;
+    }
+    assert(slot_idx - nslots < additions);
+
+    new_slots->slot_array = calloc(additions, sizeof(*new_slots->slot_array));
+    if (new_slots->slot_array == NULL) {
+        free(new_slots);
+        return errno;
+    }
+    new_slots->slot_count = additions;
+    new_slots->slot_base = nslots;
+    for (i = 0; i < additions; i++) {
+        new_slots->slot_array[i].in_use = 0;
+        new_slots->slot_array[i].value = 0;
+        new_slots->slot_array[i].vp = vp;
+    }
+
+    /* Reserve the slot we wanted (new slots not added yet) */
+    atomic_write_32(&new_slots->slot_array[slot_idx - nslots].in_use, 1);
+
+    /* Add new slots to logical array of slots */
+    if (atomic_cas_ptr((volatile void **)slotsp, NULL, new_slots) != NULL) {
+        /*
+         * We lost the race to grow the array.  The index we wanted is
+         * not guaranteed to be covered by the array as grown by the
+         * winner.  We fall through to recurse to repeat.
+         *
+         * See commentary above where tries is incremented.
+         */
+        free(new_slots->slot_array);
+        free(new_slots);
+        grow_slots(vp, slot_idx, tries);
+    }
+
+    /*
+     * If we won the race to grow the array then the index we wanted is
+     * guaranteed to be present and recursing here is cheap.  If we lost
+     * the race we need to retry.  We could goto the top of the function
+     * though, just in case there's no tail call optimization.
+     */
+    return 0;
+}
+
+/* Utility to destroy a thread-safe global variable */
+static void
+destroy_var(struct sl_var *vp)
+{
+    struct slots *slots;
+    struct value *val;
+
+    if (vp == 0)
+        return;
+
+    while (vp->values != NULL) {
+        val = atomic_read_ptr((volatile void **)&vp->values);
+        vp->values = val->next;
+        if (vp->dtor != NULL)
+            vp->dtor(val->value);
+        free(val);
+    }
+    while (vp->slots != NULL) {
+        slots = atomic_read_ptr((volatile void **)&vp->slots);
+        vp->slots = slots->next;
+        free(slots->slot_array);
+        free(slots);
+    }
+    vp->dtor = NULL;
+    free(vp);
+    /* XXX We leak vp->tkey! */
+}
+
+#ifdef __NR_membarrier
+static pthread_once_t membarrier_once = PTHREAD_ONCE_INIT;
+static volatile uint32_t have_membarrier;   /* set once, then read-only */
+
+static int
+membarrier(int cmd, unsigned int flags)
+{
+    return syscall(__NR_membarrier, cmd, flags);
+}
+
+/* Probe for and register for private expedited membarrier() */
+static void
+membarrier_setup(void)
+{
+    int cmds = membarrier(MEMBARRIER_CMD_QUERY, 0);
+
+    if (cmds == -1 || !(cmds & MEMBARRIER_CMD_PRIVATE_EXPEDITED) ||
+        !(cmds & MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED))
+        return;
+    if (membarrier(MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0) == -1)
+        return;
+    atomic_write_32(&have_membarrier, 1);
+}
+
+/*
+ * Make all readers' prior slot stores visible to us, and our prior
+ * store of the values list head visible to all readers.
+ */
+static void
+membarrier_sync(struct sl_var *vp)
+{
+    if (vp->membarrier && membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0) == -1)
+        abort();    /* can't happen once registered */
+}
+
+/* Can vars use membarrier()?  Registers this process if so. */
+static int
+membarrier_available(void)
+{
+    if (pthread_once(&membarrier_once, membarrier_setup) != 0)
+        return 0;
+    return atomic_read_32(&have_membarrier);
+}
+#else
+#define membarrier_sync(vp)
+#define membarrier_available() 0
+#endif
+
+/* Thread specific key destructor for handling thread exit */
+static void
+release_slot(void *data)
+{
+    struct slot *slot = data;
+
+    if (slot == NULL)
+        return;
+
+    /* Release value */
+    atomic_write_ptr((volatile void **)&slot->value, NULL);
+    tsv_sync_notify();
+
+    /* Release slot */
+    atomic_write_32(&slot->in_use, 0);
+
+    /*
+     * If the thread-safe global was destroyed while we held the last
+     * slot then it falls to us to complete the destruction.
+     */
+    if (atomic_dec_32_nv(&slot->vp->slots_in_use) == 0)
+        destroy_var(slot->vp);
+}
+
+static int
+sl_init(thread_safe_var tsv, const thread_safe_var_attr *attr)
+{
+    struct sl_var *vp;
+    int err;
+
+    (void) attr;
+
+    if ((vp = calloc(1, sizeof(*vp))) == NULL)
+        return errno;
+
+    vp->values = NULL;
+    vp->slots = NULL;
+    vp->dtor = tsv->dtor;
+    vp->slots_in_use = 1; /* decremented upon destruction */
+    vp->nvalues = 0;
+
+    /*
+     * Registration for membarrier() has to happen before any reader
+     * relies on it, and readers can only read vars that have been
+     * initialized.
+     */
+#ifdef USE_TSV_MEMBARRIER
+    vp->membarrier = membarrier_available();
+#else
+    if (tsv->flags & THREAD_SAFE_VAR_MEMBARRIER)
+        vp->membarrier = membarrier_available();
+#endif
+
+    if ((err = pthread_key_create(&vp->tkey, release_slot)) != 0) {
+        free(vp);
+        return err;
+    }
+
+    if ((err = grow_slots(vp, 3, 1)) != 0) {
+        destroy_var(vp);
+        return err;
+    }
+
+    assert(get_slot(vp, 0) != NULL);
+    tsv->impl = vp;
+    return 0;
+}
+
+static void
+sl_destroy(thread_safe_var tsv)
+{
+    struct sl_var *vp = tsv->impl;
+
+    if (atomic_dec_32_nv(&vp->slots_in_use) > 0)
+        return;     /* defer to last reader slot release via thread key dtor */
+    destroy_var(vp);/* we're the last, destroy now */
+}
+
+static int
+sl_get(thread_safe_var tsv, void **res, uint64_t *version)
+{
+    struct sl_var *vp = tsv->impl;
+    int err = 0;
+    uint32_t slot_idx;
+    uint32_t slots_in_use;
+    struct slot *slot;
+    struct value *newest;
+    struct value *previous;
+
+    if ((slot = pthread_getspecific(vp->tkey)) == NULL) {
+        /* First time for this thread -> O(N) slow path (subscribe thread) */
+        slot_idx = atomic_inc_32_nv(&vp->next_slot_idx) - 1;
+        if ((slot = get_free_slot(vp)) == NULL) {
+            /* Slower path still: grow slots array list */
+            err = grow_slots(vp, slot_idx, 2);  /* O(log N) */
+            assert(err == 0);
+            slot = get_slot(vp, slot_idx);      /* O(N) */
+            assert(slot != NULL);
+            atomic_write_32(&slot->in_use, 1);
+        }
+        assert(slot->vp == vp);
+        slots_in_use = atomic_inc_32_nv(&vp->slots_in_use);
+        assert(slots_in_use > 1);
+        if ((err = pthread_setspecific(vp->tkey, slot)) != 0)
+            return err;
+    }
+
+    /*
+     * Else/then fast path: one acquire read, one release write, no
+     * free()s.  O(1).
+     *
+     * We have to loop because we could read one value in the
+     * conditional and that value could get freed if a writer runs
+     * between the read in the conditional and the assignment to
+     * slot->value with no other readers also succeeding in capturing
+     * that value before that writer completes.
+     *
+     * This loop will run just once if there are no writers, and will
+     * run as many times as writers can run between the conditional and
+     * the body.  This loop can only be an infinite loop if there's an
+     * infinite number of writers who run with higher priority than this
+     * thread.  This is why writers sched_yield() before dropping their
+     * write lock.
+     *
+     * Note that in the body of this loop we can write a soon-to-become-
+     * invalid value to our slot because many writers can write between
+     * the loop condition and the body.  The writer has to jump through
+     * some hoops to deal with this.
+     */
+    previous = (struct value *)slot->value;
+    if (vp->membarrier) {
+        /*
+         * Same loop with plain loads and stores; the writer's
+         * membarrier() supplies the fences.  The compiler barrier keeps
+         * the compiler from hoisting the head load above the slot store
+         * (or caching it across iterations).  Loads through newest are
+         * address-dependent on the head load.
+         */
+        for (;;) {
+            newest = (struct value *)*(struct value * volatile *)&vp->values;
+            if (slot->value == newest)
+                break;
+            slot->value = newest;
+            compiler_barrier();
+        }
+    } else {
+        while (atomic_read_ptr((volatile void **)&slot->value) !=
+               (newest = atomic_read_ptr((volatile void **)&vp->values)))
+            atomic_write_ptr((volatile void **)&slot->value, newest);
+    }
+
+    /* We let go of a value; a synchronizer might care */
+    if (previous != NULL && previous != newest)
+        tsv_sync_notify();
+
+    if (newest != NULL) {
+        *res = newest->value;
+        *version = newest->version;
+    }
+
+    return 0;
+}
+
+static void
+sl_release(thread_safe_var tsv)
+{
+    struct sl_var *vp = tsv->impl;
+    struct slot *slot;
+
+    /*
+     * Always fast; never free()s.  O(1)
+     *
+     * The slot itself stays ours until thread exit: our thread-specific
+     * still points to it, so it must not be handed to another thread.
+     */
+    if ((slot = pthread_getspecific(vp->tkey)) == NULL ||
+        slot->value == NULL)
+        return;
+    atomic_write_ptr((volatile void **)&slot->value, NULL);
+    tsv_sync_notify();
+}
+
+static volatile struct value *mark_values(struct sl_var *);
+
+static int
+sl_prepare(thread_safe_var tsv, void *data, void **cookiep)
+{
+    struct value *new_value;
+
+    (void) tsv;
+    if ((*cookiep = new_value = calloc(1, sizeof(*new_value))) == NULL)
+        return errno;
+    new_value->value = data;
+    return 0;
+}
+
+static int
+sl_publish(thread_safe_var tsv, void *cookie, uint64_t new_version,
+           const struct timespec *deadline, void **garbagep)
+{
+    struct sl_var *vp = tsv->impl;
+    struct value *new_value = cookie;
+
+    (void) deadline;    /* we never wait for readers */
+
+    /*
+     * No allocations/free()s done with write lock held -> higher write
+     * throughput.
+     */
+
+    new_value->next = atomic_read_ptr((volatile void **)&vp->values);
+    new_value->version = new_version;
+    assert(new_value->next == NULL ||
+           new_value->next->version + 1 == new_version);
+
+    /* Publish the new value */
+    atomic_write_ptr((volatile void **)&vp->values, new_value);
+    vp->nvalues++;
+
+    /*
+     * In membarrier mode readers' slot stores are unfenced; force them
+     * out before we scan the slots.
+     */
+    membarrier_sync(vp);
+
+    /* Now comes the slow part: garbage collect vp->values */
+    *garbagep = (void *)mark_values(vp);
+
+    /*
+     * Because readers must loop, and could be kept from reading by a
+     * long sequence of back-to-back higher-priority writers (presumably
+     * all threads of a process will run with the same priority, but we
+     * don't know that here), we yield the CPU before releasing the
+     * write lock.  Hopefully we yield to a reader.
+     */
+    sched_yield();
+    return 0;
+}
+
+static void
+sl_abort(thread_safe_var tsv, void *cookie)
+{
+    (void) tsv;
+    free(cookie);
+}
+
+static void
+sl_reclaim(thread_safe_var tsv, void *garbage)
+{
+    struct sl_var *vp = tsv->impl;
+    volatile struct value *old_values = garbage;
+    volatile struct value *value;
+
+    /* Free old values now, holding no locks */
+    for (value = old_values; value != NULL; value = old_values) {
+        if (vp->dtor)
+            vp->dtor(value->value);
+        old_values = value->next;
+        free((void *)value);
+    }
+}
+
+/*
+ * Values stay on the list until the next write garbage collects it, so
+ * collect it now.  The list is in version order, newest first.
+ */
+static uint64_t
+sl_oldest(thread_safe_var tsv, void **garbagep)
+{
+    struct sl_var *vp = tsv->impl;
+    volatile struct value *v;
+
+    *garbagep = NULL;
+    if ((v = atomic_read_ptr((volatile void **)&vp->values)) == NULL)
+        return UINT64_MAX;
+
+    membarrier_sync(vp);
+    *garbagep = (void *)mark_values(vp);
+    for (v = vp->values; v->next != NULL; v = v->next)
+        ;
+    return v->version;
+}
+
+static int
+value_cmp(const void *a, const void *b)
+{
+    if (*(const struct value **)a < *(const struct value **)b)
+        return -1;
+    if (*(const struct value **)a > *(const struct value **)b)
+        return 1;
+    return 0;
+}
+
+static volatile struct value *
+value_binary_search(volatile struct value **seen, size_t n, volatile struct value *v)
+{
+    size_t left = 0;
+
+    while (n > left) {
+        size_t mid;
+
+        /* Two or more array elements */
+        mid = (left + n - 1) >> 1;
+        if (seen[mid] < v)
+            left = mid + 1; /* search right */
+        else if (seen[mid] > v)
+            n = mid;        /* search left */
+        else
+            return v; /* seen[mid] == v -> so we found v */
+    }
+    return NULL;
+}
+
+/* Mark half of mark-and-sweep GC */
+static volatile struct value *
+mark_values(struct sl_var *vp)
+{
+    volatile struct value **old_values_array;
+    volatile struct value * volatile *p;
+    volatile struct value *old_values = NULL;
+    volatile struct value *v, *v2;
+    volatile struct slots *slots;
+    struct slot *slot;
+    size_t i;
+
+    old_values_array = calloc(vp->nvalues, sizeof(old_values_array[0]));
+
+    /*
+     * XXX There should be no need to atomically read vp->values here,
+     * as we are the writer and hold a lock.
+     */
+    for (i = 0, v = atomic_read_ptr((volatile void **)&vp->values);
+         i < vp->nvalues && v != NULL;
+         v = v->next, i++)
+        old_values_array[i] = v;
+    assert(i == vp->nvalues && v == NULL);
+    qsort(old_values_array, vp->nvalues, sizeof(old_values_array[0]),
+          value_cmp);
+    /* Assert that qsort() sorted */
+    for (i = 1; i < vp->nvalues; i++)
+        assert(old_values_array[i-1] < old_values_array[i]);
+
+    /*
+     * Mark. This is O(N log(M)) where N is the number of subscribed
+     * threads and M is the number of values, but with the optimizations
+     * below, and with a bit of luck, this is more like O(N) than like
+     * O(N log(M)).
+     */
+    vp->values->referenced = 1; /* curr value is always in use */
+
+    for (i = 0, slots = atomic_read_ptr((volatile void **)&vp->slots);
+         slots != NULL;
+         i++) {
+        assert(slots != NULL);
+        assert(i >= slots->slot_base);
+        assert(i <= slots->slot_base + slots->slot_count);
+        if (i == slots->slot_base + slots->slot_count) {
+            slots = slots->next;
+            if (slots == NULL)
+                break;
+        }
+        assert(slots->slot_count > 0);
+        assert(i >= slots->slot_base);
+        assert(i < slots->slot_base + slots->slot_count);
+        slot = &slots->slot_array[i - slots->slot_base];
+        v = atomic_read_ptr((volatile void **)&slot->value);
+
+        /*
+         * Optimization: ignore slots with a NULL value.  The owner of
+         * that slot may be about to write a value that we're about to
+         * free, but they will notice that multiple writers went by and
+         * re-read vp->value.
+         *
+         * Also ignore slots with the current value.
+         */
+        if (v == NULL || v == vp->values)
+            continue;
+
+        /*
+         * We can't just dereference v->referenced because there's a
+         * window in the get-side where we can set the slot's value to
+         * an immediately-after free()'ed value, and we could be seeing
+         * such a value, which means we can't dereference it.
+         *
+         * Instead we search for v in the old_values_array[].  If it's
+         * found then it's safe to write to v->referenced because it is
+         * stable through the execution of this function and won't be
+         * free()'ed until after.
+         */
+        if ((value_binary_search(old_values_array,
+                                 vp->nvalues, v)) != NULL) {
+            v->referenced = 1;  /* so v is valid, safe to deref */
+            continue;
+        }
+
+#ifndef NDEBUG
+        for (v2 = vp->values; v2 != NULL; v2 = v2->next)
+            assert(v2 != v);
+#endif
+    }
+    free(old_values_array);
+
+    /*
+     * Sweep; O(N) where N is the number of referenced values
+     *
+     * Values pinned by references (see sl_acquire()) stay.  Readers pin
+     * values before their slots let go of them, and we read pin counts
+     * after reading the slots, so we can't miss a pin.
+     */
+    for (p = &vp->values; *p != NULL;) {
+        v = *p;
+
+        if (!v->referenced && atomic_read_32(&v->npinned) == 0) {
+            assert(v != vp->values);
+
+            /* Remove from list and setup to continue at v->next */
+            *p = v->next;
+            /* Prepend v to old_values list */
+            v->next = old_values;
+            old_values = v;
+            vp->nvalues--;
+
+            /* Sweep the remainder of the list */
+            continue;
+        }
+
+        /* Step into this value's next sub-list */
+        v->referenced = 0;
+        p = &v->next;
+        assert(p != &vp->values);
+    }
+
+    errno = 0;
+    return old_values;
+}
+
+static int
+sl_acquire(thread_safe_var tsv, void **handlep, void **res,
+           uint64_t *version)
+{
+    struct sl_var *vp = tsv->impl;
+    struct value *v;
+    struct slot *slot;
+    int err;
+
+    /* Our slot keeps the value alive while we pin it */
+    if ((err = sl_get(tsv, res, version)) != 0 ||
+        (slot = pthread_getspecific(vp->tkey)) == NULL ||
+        (v = (struct value *)slot->value) == NULL)
+        return err;
+    (void) atomic_inc_32_nv(&v->npinned);
+    *handlep = v;
+    return 0;
+}
+
+static void
+sl_ref_dup(thread_safe_var tsv, void *handle)
+{
+    (void) tsv;
+    (void) atomic_inc_32_nv(&((struct value *)handle)->npinned);
+}
+
+/* The value gets freed by a later write (or synchronizer) */
+static void
+sl_ref_put(thread_safe_var tsv, void *handle)
+{
+    (void) tsv;
+    if (atomic_dec_32_nv(&((struct value *)handle)->npinned) == 0)
+        tsv_sync_notify();
+}
+
+/* Output this thread's value without looking at the var */
+static int
+sl_peek(thread_safe_var tsv, void **res, uint64_t *version)
+{
+    struct sl_var *vp = tsv->impl;
+    struct value *v;
+    struct slot *slot;
+
+    if ((slot = pthread_getspecific(vp->tkey)) == NULL ||
+        (v = (struct value *)slot->value) == NULL)
+        return ENOENT;
+    *res = v->value;
+    *version = v->version;
+    return 0;
+}
+
+const struct tsv_ops tsv_slot_list_ops = {
+    "slotlist",
+    sl_init,
+    sl_destroy,
+    sl_get,
+    sl_release,
+    sl_prepare,
+    sl_publish,
+    sl_abort,
+    sl_reclaim,
+    sl_oldest,
+    sl_acquire,
+    sl_ref_dup,
+    sl_ref_put,
+    sl_peek,
+};
@@ -0,0 +1,572 @@
+/*
+ * Copyright (c) 2015 Cryptonector LLC
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "thread_safe_global.h"
+#include "tsv_impl.h"
+#include "atomics.h"
+
+/*
+ * Slot-Pair Design
+ */
+
+/*
+ * The design for this implementation uses a pair of slots such that one
+ * has a current value for the variable, and the other holds the
+ * previous value and will hold the next value.
+ *
+ * There are several atomic compositions needed to make this work.
+ *
+ *  - writers have to write two things (a pointer to a struct wrapping
+ *    the intended value, and a version number)
+ *
+ *  - readers have to atomically read a version number, a pointer, and
+ *    increment a ref count.
+ *
+ * These compositions are the challenging part of this.
+ *
+ * In a way this structure is a lot like a read-write lock that doesn't
+ * starve writers.  But since the only thing readers here do with a
+ * would-be read-write lock held is grab a reference to a "current"
+ * value, this construction can be faster than read-write locks without
+ * writer starvation: readers (almost) *never* block on contended
+ * resources.  We achieve this by having two value slots: one for the
+ * current value, and one for the previous/next value.  Readers can
+ * always lock-less-ly find one of the two values.
+ *
+ * Whereas in the case of a read-write lock without writer starvation,
+ * readers arriving after a writer must get held up for the writer who,
+ * in turn, is held up by readers.  Therefore, for the typical case
+ * where one uses read-write locks (to mediate access to rarely-changing
+ * mostly-read-only data, typically configuration data), the API
+ * implemented here is superior to read-write locks.
+ *
+ * We often use atomic CAS with equal new and old values as an atomic
+ * read.  We could do better though.  We could use a LoadStore fence
+ * around reads instead.
+ *
+ * NOTE WELL: We assume that atomic operations imply memory barriers.
+ *
+ *            The general rule is that all things which are to be
+ *            atomically modified in some cases are always modified
+ *            atomically, except at initialization time, and even then,
+ *            in some cases the initialized value is immediately
+ *            modified with an atomic operation.  This is to ensure
+ *            memory visibility rules (see above), though we may be
+ *            trying much too hard in some cases.
+ *
+ *            The atomic operations from atomics.[ch] provide the necessary
+ *            barriers.
+ */
+
+/*
+ * This design uses a pair of "slots", such that one holds the current value of
+ * the thread-safe global variable, while the other holds the previous/next
+ * value.
+ *
+ * Writers make the previous slot into the new current slot, being careful not
+ * to step on the toes of a reader that was reading from that slot thinking it
+ * was the current slot.
+ *
+ * Readers are lock-less, except that when a reader is the last reader of a
+ * slot it has to signal a writer that might be waiting for that reader to be
+ * done with the slot.  Also, readers do call free(), which may acquire locks.
+ * Sending that signal requires taking a lock that the writer will have dropped
+ * in order to wait, thus it should be an uncontended lock, and if the reader
+ * blocks racing with a writer, it should unblock very soon after.  This is
+ * never needed when the value has not changed since the previous read.
+ *
+ * Both, reading, and writing are O(1).
+ */
+
+/*
+ * Values set on a thread-global variable are wrapped with a struct that
+ * holds a reference count.
+ */
+struct vwrapper {
+    var_dtor_t          dtor;       /* value destructor */
+    void                *ptr;       /* the actual value */
+    uint64_t            version;    /* version of this data */
+    volatile uint32_t   nref;       /* release when drops to 0 */
+    struct tsv_live_entry live;     /* for thread_safe_var_synchronize() */
+};
+
+/* This is a slot.  There are two of these. */
+struct var {
+    struct vwrapper     *wrapper;   /* wraps real ptr, has nref */
+    struct var          *other;     /* always points to the other slot */
+    uint64_t            version;    /* version of this slot's data */
+    volatile uint32_t   nreaders;   /* no. of readers active in this slot */
+};
+
+struct sp_var {
+    pthread_key_t       tkey;           /* to detect thread exits */
+    pthread_mutex_t     cv_lock;        /* to signal waiting writer */
+    pthread_cond_t      cv;             /* to signal waiting writer */
+    struct var          vars[2];        /* the two slots */
+    volatile uint64_t   version;        /* both read; writer writes */
+};
+
+
+static void
+wrapper_free(struct vwrapper *wrapper)
+{
+    if (wrapper == NULL)
+        return;
+    if (atomic_dec_32_nv(&wrapper->nref) > 0)
+        return;
+    if (wrapper->dtor != NULL)
+        wrapper->dtor(wrapper->ptr);
+    tsv_live_remove(&wrapper->live);
+    free(wrapper);
+}
+
+/* For the thread-specific key */
+static void
+var_dtor_wrapper(void *wrapper)
+{
+    wrapper_free(wrapper);
+}
+
+static int
+sp_init(thread_safe_var tsv, const thread_safe_var_attr *attr)
+{
+    struct sp_var *vp;
+    int err;
+
+    (void) attr;
+
+    if ((vp = calloc(1, sizeof(*vp))) == NULL)
+        return errno;
+
+    /*
+     * The thread-local key is used to hold a reference for destruction
+     * at thread-exit time, if the thread does not explicitly drop the
+     * reference before then.
+     *
+     * There's no pthread_key_destroy(), so we leak these.  We ought to
+     * have a single global thread key whose values point to a
+     * counted-length array of keys, with a global counter that we
+     * snapshot here and use as an index into that array (and which is
+     * realloc()'ed as needed).
+     */
+    if ((err = pthread_key_create(&vp->tkey, var_dtor_wrapper)) != 0) {
+        free(vp);
+        return err;
+    }
+    if ((err = pthread_mutex_init(&vp->cv_lock, NULL)) != 0) {
+        free(vp);
+        return err;
+    }
+    if ((err = pthread_cond_init(&vp->cv, NULL)) != 0) {
+        pthread_mutex_destroy(&vp->cv_lock);
+        free(vp);
+        return err;
+    }
+
+    /*
+     * vp->version is a 64-bit unsigned int.  If ever we can't get
+     * atomics to deal with it on 32-bit platforms we could have a
+     * pointer to one of two version numbers which are not atomically
+     * updated, and instead atomically update the pointer.
+     */
+    vp->version = 0;
+    vp->vars[0].nreaders = 0;
+    vp->vars[0].wrapper = NULL;
+    vp->vars[0].other = &vp->vars[1]; /* other pointer never changes */
+    vp->vars[1].nreaders = 0;
+    vp->vars[1].wrapper = NULL;
+    vp->vars[1].other = &vp->vars[0]; /* other pointer never changes */
+    tsv->impl = vp;
+    return 0;
+}
+
+static void sp_release(thread_safe_var);
+
+static void
+sp_destroy(thread_safe_var tsv)
+{
+    struct sp_var *vp = tsv->impl;
+
+    sp_release(tsv);
+    pthread_cond_destroy(&vp->cv);
+    pthread_mutex_destroy(&vp->cv_lock);
+    wrapper_free(vp->vars[0].wrapper);
+    wrapper_free(vp->vars[1].wrapper);
+    free(vp);
+    /* Remaining references will be released by the thread key destructor */
+    /* XXX We leak vp->tkey!  See note in initiator above. */
+}
+
+static int
+signal_writer(struct sp_var *vp)
+{
+    int err;
+
+    if ((err = pthread_mutex_lock(&vp->cv_lock)) != 0)
+        return err;
+    if ((err = pthread_cond_signal(&vp->cv)) != 0)
+        abort();
+    return pthread_mutex_unlock(&vp->cv_lock);
+}
+
+static int
+sp_get(thread_safe_var tsv, void **res, uint64_t *version)
+{
+    struct sp_var *vp = tsv->impl;
+    int err = 0;
+    int err2 = 0;
+    uint32_t nref;
+    struct var *v;
+    struct vwrapper *wrapper;
+
+    if ((wrapper = pthread_getspecific(vp->tkey)) != NULL &&
+        wrapper->version == atomic_read_64(&vp->version)) {
+
+        /* Fast path */
+        *version = wrapper->version;
+        *res = wrapper->ptr;
+        return 0;
+    }
+
+    /* Busy loop to get current slot.  Races with writers. */
+    for (;;) {
+        /* Get the current version */
+        *version = atomic_read_64(&vp->version);
+        if (*version == 0)
+            return 0;
+
+        /* Get what we hope is still the current slot */
+        v = &vp->vars[(*version) & 0x1];
+
+        /*
+         * We picked a slot, but we could just have lost against one or more
+         * writers.  So far nothing we've done would block any number of
+         * them.
+         *
+         * We increment nreaders for the slot we picked to keep out
+         * subsequent writers; we can then lose one more race at most.
+         */
+        (void) atomic_inc_32_nv(&v->nreaders);
+        /* Repeat until we're done losing any races */
+        if (atomic_read_64(&vp->version) == *version)
+            break;
+        if (atomic_dec_32_nv(&v->nreaders) == 0)
+            (void) signal_writer(vp);
+    }
+
+    assert(v->wrapper != NULL);
+    assert(*version == atomic_read_64(&vp->version) ||
+           *version + 1 == atomic_read_64(&vp->version));
+
+    /* Take the wrapped value for the slot we chose */
+    nref = atomic_inc_32_nv(&v->wrapper->nref);
+    assert(nref > 1);
+    *version = v->wrapper->version;
+    *res = v->wrapper->ptr;
+
+
+    /*
+     * Release the slot and signal any possible waiting writer if the slot's
+     * nreaders drops to zero (that's what the writer will be waiting for).
+     *
+     * The one blocking operation done by readers happens in
+     * signal_writer(), but that one blocking operation is for a lock
+     * that the writer will have or will soon have released, so it's
+     * a practically uncontended blocking operation.
+     */
+    wrapper = v->wrapper;
+    if (atomic_dec_32_nv(&v->nreaders) == 0 &&
+        atomic_read_64(&vp->version) != *version)
+        err2 = signal_writer(vp);
+
+    /*
+     * Release the value previously read in this thread, if any.
+     *
+     * Note that we call free() here, which means that we might take a
+     * lock in free().  The application's value destructor also can do
+     * the same.
+     *
+     * TODO We could use a lock-less queue/stack to queue up wrappers
+     *      for destruction by writers, then readers could be even more
+     *      light-weight.  But then while synchronous value destruction could
+     *      be valuable.
+     */
+    if (wrapper != pthread_getspecific(vp->tkey))
+        sp_release(tsv);
+
+    /* Recall this value we just read */
+    err = pthread_setspecific(vp->tkey, wrapper);
+    return (err2 == 0) ? err : err2;
+}
+
+static void
+sp_release(thread_safe_var tsv)
+{
+    struct sp_var *vp = tsv->impl;
+    struct vwrapper *wrapper = pthread_getspecific(vp->tkey);
+
+    if (wrapper == NULL)
+        return;
+    if (pthread_setspecific(vp->tkey, NULL) != 0)
+        abort();
+    assert(pthread_getspecific(vp->tkey) == NULL);
+    wrapper_free(wrapper);
+}
+
+/*
+ * Wait until no reader is in the given slot, or until the deadline, if
+ * any; call with the write lock
+ */
+static int
+wait_slot(struct sp_var *vp, struct var *v, const struct timespec *deadline)
+{
+    int err;
+
+    if ((err = pthread_mutex_lock(&vp->cv_lock)) != 0)
+        return err;
+    while (atomic_read_32(&v->nreaders) > 0) {
+        /*
+         * We have a separate lock for writing vs. waiting so that no
+         * other writer can steal our march.  All writers will enter,
+         * all writers will finish.  We got here by winning the race for
+         * the writer lock, so we'll hold onto it, and thus avoid having
+         * to restart here.
+         */
+        if ((err = deadline == NULL ?
+             pthread_cond_wait(&vp->cv, &vp->cv_lock) :
+             pthread_cond_timedwait(&vp->cv, &vp->cv_lock,
+                                    deadline)) != 0) {
+            (void) pthread_mutex_unlock(&vp->cv_lock);
+            return err;
+        }
+    }
+    return pthread_mutex_unlock(&vp->cv_lock);
+}
+
+static int
+sp_prepare(thread_safe_var tsv, void *cfdata, void **cookiep)
+{
+    struct vwrapper *wrapper;
+
+    /* Build a wrapper for the new value */
+    if ((*cookiep = wrapper = calloc(1, sizeof(*wrapper))) == NULL)
+        return errno;
+
+    /*
+     * The var itself holds a reference to the current value, thus its
+     * nref starts at 1, but that is made so in sp_publish().
+     */
+    wrapper->dtor = tsv->dtor;
+    wrapper->nref = 0;
+    wrapper->ptr = cfdata;
+    return 0;
+}
+
+static int
+sp_publish(thread_safe_var tsv, void *cookie, uint64_t new_version,
+           const struct timespec *deadline, void **garbagep)
+{
+    struct sp_var *vp = tsv->impl;
+    struct vwrapper *wrapper = cookie;
+    struct vwrapper *old_wrapper;
+    struct vwrapper *tmp;
+    struct var *v;
+    uint64_t tmp_version;
+    uint32_t nref;
+    size_t i;
+    int err;
+
+    *garbagep = NULL;
+
+    /* Grab the next slot */
+    v = &vp->vars[new_version & 0x1];
+    old_wrapper = atomic_read_ptr((volatile void **)&v->wrapper);
+
+    /* Wait until that slot is quiescent before mutating anything */
+    if (new_version > 1 && (err = wait_slot(vp, v, deadline)) != 0)
+        return err;
+
+    wrapper->version = new_version;
+    tsv_live_add(tsv->live, &wrapper->live, new_version);
+
+    if (new_version == 1) {
+        /* This is the first write; set wrapper on both slots */
+
+        for (i = 0; i < sizeof(vp->vars)/sizeof(vp->vars[0]); i++) {
+            v = &vp->vars[i];
+            nref = atomic_inc_32_nv(&wrapper->nref);
+            v->version = new_version;
+            /* This functions as a memory barrier for the above writes */
+            tmp = atomic_cas_ptr((volatile void **)&v->wrapper,
+                                 old_wrapper, wrapper);
+            assert(tmp == old_wrapper && tmp == NULL);
+        }
+
+        assert(nref > 1);
+
+        tmp_version = atomic_inc_64_nv(&vp->version);
+        assert(tmp_version == 1);
+        return 0;
+    }
+
+    nref = atomic_inc_32_nv(&wrapper->nref);
+    assert(nref == 1);
+
+    /* NULL if sp_oldest() already released it */
+    assert(old_wrapper == NULL || atomic_read_32(&old_wrapper->nref) > 0);
+
+    /* Update that now quiescent slot; these are the release operations */
+    tmp = atomic_cas_ptr((volatile void **)&v->wrapper, old_wrapper, wrapper);
+    assert(tmp == old_wrapper);
+    v->version = new_version;
+    tmp_version = atomic_inc_64_nv(&vp->version); /* Memory barrier */
+    assert(tmp_version == new_version);
+    assert(v->version > v->other->version);
+
+    /* The old value gets released by sp_reclaim() */
+    *garbagep = old_wrapper;
+    return 0;
+}
+
+/*
+ * The previous slot holds a reference to the previous value until the
+ * next write, which would hold up synchronizers, so release it early.
+ * Readers only use the previous slot while racing with the write that
+ * made it the previous slot, so once they're out of it no reader will
+ * look at its wrapper again until the next write replaces it.
+ *
+ * All wrappers are in tsv->live, so that's all we need to report.
+ */
+static uint64_t
+sp_oldest(thread_safe_var tsv, void **garbagep)
+{
+    struct sp_var *vp = tsv->impl;
+    uint64_t version = atomic_read_64(&vp->version);
+    struct vwrapper *old_wrapper;
+    struct var *v;
+
+    *garbagep = NULL;
+    if (version < 2)
+        return UINT64_MAX;
+
+    v = &vp->vars[(version + 1) & 0x1];
+    old_wrapper = atomic_read_ptr((volatile void **)&v->wrapper);
+    if (old_wrapper == NULL || wait_slot(vp, v, NULL) != 0)
+        return UINT64_MAX;
+    atomic_write_ptr((volatile void **)&v->wrapper, NULL);
+    *garbagep = old_wrapper;
+    return UINT64_MAX;
+}
+
+static void
+sp_abort(thread_safe_var tsv, void *cookie)
+{
+    (void) tsv;
+    free(cookie);   /* never published, so never referenced */
+}
+
+static void
+sp_reclaim(thread_safe_var tsv, void *garbage)
+{
+    (void) tsv;
+    assert(garbage == NULL ||
+           atomic_read_32(&((struct vwrapper *)garbage)->nref) > 0);
+    wrapper_free(garbage);
+}
+
+static int
+sp_acquire(thread_safe_var tsv, void **handlep, void **res,
+           uint64_t *version)
+{
+    struct sp_var *vp = tsv->impl;
+    struct vwrapper *wrapper;
+    int err;
+
+    /* Our thread's reference keeps the wrapper alive while we add one */
+    if ((err = sp_get(tsv, res, version)) != 0 ||
+        (wrapper = pthread_getspecific(vp->tkey)) == NULL)
+        return err;
+    (void) atomic_inc_32_nv(&wrapper->nref);
+    *handlep = wrapper;
+    return 0;
+}
+
+static void
+sp_ref_dup(thread_safe_var tsv, void *handle)
+{
+    (void) tsv;
+    (void) atomic_inc_32_nv(&((struct vwrapper *)handle)->nref);
+}
+
+static void
+sp_ref_put(thread_safe_var tsv, void *handle)
+{
+    (void) tsv;
+    wrapper_free(handle);
+}
+
+/* Output this thread's value without looking at the var */
+static int
+sp_peek(thread_safe_var tsv, void **res, uint64_t *version)
+{
+    struct sp_var *vp = tsv->impl;
+    struct vwrapper *wrapper;
+
+    if ((wrapper = pthread_getspecific(vp->tkey)) == NULL)
+        return ENOENT;
+    *res = wrapper->ptr;
+    *version = wrapper->version;
+    return 0;
+}
+
+const struct tsv_ops tsv_slot_pair_ops = {
+    "slotpair",
+    sp_init,
+    sp_destroy,
+    sp_get,
+    sp_release,
+    sp_prepare,
+    sp_publish,
+    sp_abort,
+    sp_reclaim,
+    sp_oldest,
+    sp_acquire,
+    sp_ref_dup,
+    sp_ref_put,
+    sp_peek,
+};